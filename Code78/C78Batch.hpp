@@ -0,0 +1,330 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Code78 handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// C78 batch encoders and decoders
+//
+// Decode (or encode) whole arrays of C78 values at a time, for payloads that are long
+// runs of C78-encoded integers.
+//
+// When built with SSSE3 and SSE4.1 (e.g. -msse4.1), the decoder works 16 bytes at a time
+// in the style of MaskedVByte: the high bits of the input are gathered with a movemask,
+// and that mask selects a precomputed pshufb pattern which moves each value's bytes into
+// its own lane, where the 7-bit groups are compacted with shifts and masks. A run of
+// single-byte values is simply zero-extended (32 bytes at a time with AVX2). Anything the
+// tables cannot handle falls back to the scalar Code78::decode(), as do builds without
+// those instruction sets.
+
+#pragma once
+
+#include "Code78.hpp"
+
+#if defined(__SSSE3__) && defined(__SSE4_1__)
+#define C78_BATCH_SIMD
+#include <immintrin.h>
+#endif
+
+namespace Code78{
+
+#ifdef C78_BATCH_SIMD
+
+// Shuffle table entry: byte pattern, number of values produced, input bytes consumed.
+struct BatchShuffle {
+  uint8_t shuffle[16];
+  uint8_t count;
+  uint8_t consumed;
+};
+
+// Shuffle tables, built on first use.
+//   narrow: indexed by the continuation bits of 8 input bytes. Up to 8 values of 1 or 2
+//           bytes, each placed big-endian in a 16-bit lane.
+//   wide:   indexed by the continuation bits of 12 input bytes. Up to 4 values of 1 to 4
+//           bytes, each placed big-endian in a 32-bit lane.
+// An entry with count 0 means the first value is too long for that table.
+class BatchShuffleTables {
+public:
+  BatchShuffle narrow[1 << 8];
+  BatchShuffle wide[1 << 12];
+
+  BatchShuffleTables(){
+    for(uint16_t mask = 0; mask < (1 << 8); mask++)
+      build(narrow[mask], mask, 8, 2, 8);
+    for(uint16_t mask = 0; mask < (1 << 12); mask++)
+      build(wide[mask], mask, 12, 4, 4);
+  }
+
+  static const BatchShuffleTables& get(){
+    static const BatchShuffleTables tables;
+    return tables;
+  }
+
+private:
+// Lay out as many whole values as fit in lanes of laneBytes bytes each.
+  static void build(BatchShuffle &entry, const uint16_t mask, const uint8_t inputBytes, const uint8_t laneBytes, const uint8_t maxCount){
+    memset(entry.shuffle, 0x80, sizeof(entry.shuffle));
+    entry.count = 0;
+    entry.consumed = 0;
+
+    uint8_t start = 0;
+    while(entry.count < maxCount){
+    // Find this value's terminating byte.
+      uint8_t end = start;
+      while(end < inputBytes && (mask & (1 << end)))
+        end++;
+      if(end >= inputBytes || end - start + 1 > laneBytes)
+        break;
+
+    // Last byte into the lowest (little-endian) lane byte, earlier bytes above it.
+      uint8_t *lane = entry.shuffle + entry.count * laneBytes;
+      for(uint8_t i = 0; i <= end - start; i++)
+        lane[i] = end - i;
+
+      entry.count++;
+      start = end + 1;
+    }
+    entry.consumed = start;
+  }
+};
+
+// Store four 32-bit lanes.
+inline void storeBatchLanes(uint32_t *values, const __m128i lanes){
+  _mm_storeu_si128((__m128i*) values, lanes);
+}
+inline void storeBatchLanes(uint64_t *values, const __m128i lanes){
+  _mm_storeu_si128((__m128i*) values, _mm_cvtepu32_epi64(lanes));
+  _mm_storeu_si128((__m128i*) (values + 2), _mm_cvtepu32_epi64(_mm_srli_si128(lanes, 8)));
+}
+
+#endif
+
+// Decode one value of either width.
+inline uint8_t decodeValue(const uint8_t *ptr, const uint8_t *end, uint32_t &value){
+  return decode(ptr, end, value);
+}
+inline uint8_t decodeValue(const uint8_t *ptr, const uint8_t *end, uint64_t &value){
+  return decode64(ptr, end, value);
+}
+
+// Decode up to count values from [input, end) into values.
+// input is advanced past the decoded values. Returns the number of values decoded, which
+// is less than count only if the input ran out (or ended in an unterminated value).
+template <typename Value_t>
+uint32_t decodeArray(const uint8_t *&input, const uint8_t *end, Value_t *values, uint32_t count){
+  // Worked on in a local, which the compiler need not reload after every store.
+  const uint8_t *ptr = input;
+  Value_t *values_ptr = values;
+  Value_t *values_end = values + count;
+
+#ifdef C78_BATCH_SIMD
+  const BatchShuffleTables &tables = BatchShuffleTables::get();
+  const __m128i zero = _mm_setzero_si128();
+
+  // Each step may read 16 (or 32) bytes and write 16 values, whatever it consumes.
+  while(end - ptr >= 16 && values_end - values_ptr >= 16){
+    __m128i input = _mm_loadu_si128((const __m128i*) ptr);
+    uint32_t continuation = _mm_movemask_epi8(input);
+
+  // Single-byte values: zero-extend.
+    if((continuation & 0xFFFF) == 0){
+#ifdef __AVX2__
+      if(end - ptr >= 32 && values_end - values_ptr >= 32
+         && _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) ptr)) == 0){
+        for(uint8_t i = 0; i < 32; i += 8){
+          __m128i bytes = _mm_loadl_epi64((const __m128i*) (ptr + i));
+          storeBatchLanes(values_ptr + i, _mm256_castsi256_si128(_mm256_cvtepu8_epi32(bytes)));
+          storeBatchLanes(values_ptr + i + 4, _mm256_extracti128_si256(_mm256_cvtepu8_epi32(bytes), 1));
+        }
+        ptr += 32;
+        values_ptr += 32;
+        continue;
+      }
+#endif
+      storeBatchLanes(values_ptr, _mm_cvtepu8_epi32(input));
+      storeBatchLanes(values_ptr + 4, _mm_cvtepu8_epi32(_mm_srli_si128(input, 4)));
+      storeBatchLanes(values_ptr + 8, _mm_cvtepu8_epi32(_mm_srli_si128(input, 8)));
+      storeBatchLanes(values_ptr + 12, _mm_cvtepu8_epi32(_mm_srli_si128(input, 12)));
+      ptr += 16;
+      values_ptr += 16;
+      continue;
+    }
+
+  // Whichever table yields more values.
+    const BatchShuffle &narrow = tables.narrow[continuation & 0xFF];
+    const BatchShuffle &wide = tables.wide[continuation & 0xFFF];
+
+    if(narrow.count > wide.count){
+    // 16-bit lanes: hi << 8 | lo.
+      __m128i lanes = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i*) narrow.shuffle));
+      lanes = _mm_or_si128(
+                _mm_and_si128(lanes, _mm_set1_epi16(0x007F)),
+                _mm_and_si128(_mm_srli_epi16(lanes, 1), _mm_set1_epi16(0x3F80)) );
+      storeBatchLanes(values_ptr, _mm_unpacklo_epi16(lanes, zero));
+      storeBatchLanes(values_ptr + 4, _mm_unpackhi_epi16(lanes, zero));
+      ptr += narrow.consumed;
+      values_ptr += narrow.count;
+    }else if(wide.count > 0){
+    // 32-bit lanes: b0 << 24 | b1 << 16 | b2 << 8 | b3.
+      __m128i lanes = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i*) wide.shuffle));
+      lanes = _mm_or_si128(
+                _mm_or_si128(
+                  _mm_and_si128(lanes, _mm_set1_epi32(0x0000007F)),
+                  _mm_and_si128(_mm_srli_epi32(lanes, 1), _mm_set1_epi32(0x00003F80)) ),
+                _mm_or_si128(
+                  _mm_and_si128(_mm_srli_epi32(lanes, 2), _mm_set1_epi32(0x001FC000)),
+                  _mm_and_si128(_mm_srli_epi32(lanes, 3), _mm_set1_epi32(0x0FE00000)) ) );
+      storeBatchLanes(values_ptr, lanes);
+      ptr += wide.consumed;
+      values_ptr += wide.count;
+    }else{
+    // A value too long for the tables. Long values tend to come in runs, so decode the
+    // next 64 bytes' values one by one before trying the tables again.
+      const uint8_t *run_end = ptr + 64;
+      uint8_t length = 1;
+      while(ptr < run_end && values_ptr < values_end && (length = decodeValue(ptr, end, *values_ptr)) != 0){
+        ptr += length;
+        values_ptr++;
+      }
+      if(length == 0)
+        break;
+    }
+  }
+#endif
+
+  // Remainder (or everything, without SIMD).
+  for(; values_ptr < values_end; values_ptr++){
+    uint8_t length = decodeValue(ptr, end, *values_ptr);
+    if(length == 0)
+      break;
+    ptr += length;
+  }
+
+  input = ptr;
+  return values_ptr - values;
+}
+
+// Signed (zigzag) variants.
+inline uint32_t decodeArraySigned(const uint8_t *&ptr, const uint8_t *end, int32_t *values, uint32_t count){
+  uint32_t decoded = decodeArray(ptr, end, (uint32_t*) values, count);
+  for(uint32_t i = 0; i < decoded; i++)
+    values[i] = decodeSigned((uint32_t) values[i]);
+  return decoded;
+}
+inline uint32_t decodeArraySigned(const uint8_t *&ptr, const uint8_t *end, int64_t *values, uint32_t count){
+  uint32_t decoded = decodeArray(ptr, end, (uint64_t*) values, count);
+  for(uint32_t i = 0; i < decoded; i++)
+    values[i] = decodeSigned64((uint64_t) values[i]);
+  return decoded;
+}
+
+// Encode one value of either width.
+inline uint8_t encodedValueLength(const uint32_t value){
+  return encodedLength(value);
+}
+inline uint8_t encodedValueLength(const uint64_t value){
+  return encodedLength64(value);
+}
+inline uint8_t encodeValue(const uint32_t value, uint8_t *buf){
+  return encode(value, buf);
+}
+inline uint8_t encodeValue(const uint64_t value, uint8_t *buf){
+  return encode64(value, buf);
+}
+
+// Total encoded length of an array of values.
+template <typename Value_t>
+uint32_t encodedArrayLength(const Value_t *values, uint32_t count){
+  uint32_t length = 0;
+  for(; count > 0; count--, values++)
+    length += encodedValueLength(*values);
+  return length;
+}
+
+// Encode up to count values into [output, end).
+// output is advanced past the encoded values. Returns the number of values encoded, which is
+// less than count only if the output ran out of room.
+template <typename Value_t>
+uint32_t encodeArray(const Value_t *values, uint32_t count, uint8_t *&output, const uint8_t *end){
+  // Worked on in a local: byte stores could otherwise alias output, forcing a reload of it
+  // after each one.
+  uint8_t *buf = output;
+  const Value_t *values_ptr = values;
+  const Value_t *values_end = values + count;
+
+  // Blocks of sixteen values, while there is room for their longest encodings, so that the
+  // room need not be checked value by value.
+  const uint8_t maxLength = (sizeof(Value_t) == sizeof(uint32_t))? MaxEncodedLength32 : MaxEncodedLength64;
+  while(values_end - values_ptr >= 16 && end - buf >= 16 * maxLength){
+#ifdef C78_BATCH_SIMD
+  // Sixteen single-byte values: narrow and store.
+    if(sizeof(Value_t) == sizeof(uint32_t)){
+      __m128i v0 = _mm_loadu_si128((const __m128i*) values_ptr);
+      __m128i v1 = _mm_loadu_si128((const __m128i*) (values_ptr + 4));
+      __m128i v2 = _mm_loadu_si128((const __m128i*) (values_ptr + 8));
+      __m128i v3 = _mm_loadu_si128((const __m128i*) (values_ptr + 12));
+      __m128i high = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+      if(_mm_testz_si128(high, _mm_set1_epi32(~0x7F))){
+        _mm_storeu_si128((__m128i*) buf, _mm_packus_epi16(_mm_packus_epi32(v0, v1), _mm_packus_epi32(v2, v3)));
+        buf += 16;
+        values_ptr += 16;
+        continue;
+      }
+    }
+#endif
+
+    for(const Value_t *block_end = values_ptr + 16; values_ptr < block_end; values_ptr++)
+      buf += encodeValue(*values_ptr, buf);
+  }
+
+  // The rest, checking the exact length near the end of the output.
+  for(; values_ptr < values_end; values_ptr++){
+    if(end - buf < maxLength && end - buf < encodedValueLength(*values_ptr))
+      break;
+    buf += encodeValue(*values_ptr, buf);
+  }
+
+  output = buf;
+  return values_ptr - values;
+}
+
+// Signed (zigzag) variants, mapped a block at a time.
+template <typename Signed_t, typename Value_t>
+uint32_t encodeArraySigned(const Signed_t *values, uint32_t count, uint8_t *&buf, const uint8_t *end){
+  static const uint8_t BlockSize = 64;
+  Value_t block[BlockSize];
+
+  uint32_t encoded = 0;
+  while(encoded < count){
+    uint32_t blockCount = count - encoded;
+    if(blockCount > BlockSize)
+      blockCount = BlockSize;
+
+    for(uint8_t i = 0; i < blockCount; i++)
+      block[i] = (sizeof(Value_t) == sizeof(uint64_t))? encodeSigned64(values[encoded + i]) : encodeSigned(values[encoded + i]);
+
+    uint32_t blockEncoded = encodeArray(block, blockCount, buf, end);
+    encoded += blockEncoded;
+    if(blockEncoded < blockCount)
+      break;
+  }
+
+  return encoded;
+}
+inline uint32_t encodeArraySigned(const int32_t *values, uint32_t count, uint8_t *&buf, const uint8_t *end){
+  return encodeArraySigned<int32_t, uint32_t>(values, count, buf, end);
+}
+inline uint32_t encodeArraySigned(const int64_t *values, uint32_t count, uint8_t *&buf, const uint8_t *end){
+  return encodeArraySigned<int64_t, uint64_t>(values, count, buf, end);
+}
+
+// Total encoded length of an array of signed values.
+inline uint32_t encodedArrayLengthSigned(const int32_t *values, uint32_t count){
+  uint32_t length = 0;
+  for(; count > 0; count--, values++)
+    length += encodedLength(encodeSigned(*values));
+  return length;
+}
+
+// End namespace: C78
+}
+
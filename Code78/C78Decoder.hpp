@@ -0,0 +1,145 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Code78 handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// C78 decoder
+//
+// Where at least eight bytes are readable, the value is decoded from a single word load:
+// the terminating byte is located by masking the high bits and counting zeros from the
+// first byte's end of the word, and the 7-bit groups are compacted with fixed shifts and
+// masks (no per-byte branch). The length is found from the word as loaded, so that the
+// next value's load waits on as few operations as possible.
+// Otherwise, and on AVR (where wide arithmetic is expensive), values are decoded byte by byte.
+
+#pragma once
+
+namespace Code78{
+
+// Byte-by-byte decoding. Returns the encoded length, or 0 if the value is not terminated
+// before end. Values too large for the result keep only their low bits.
+inline uint8_t decodeBytewise(const uint8_t *ptr, const uint8_t *end, uint32_t &value){
+  value = 0;
+  for(const uint8_t *data_ptr = ptr; data_ptr < end; data_ptr++){
+    value = (value << 7) | (*data_ptr & 0x7F);
+    if(isLastByte(*data_ptr))
+      return data_ptr - ptr + 1;
+  }
+  return 0;
+}
+inline uint8_t decodeBytewise64(const uint8_t *ptr, const uint8_t *end, uint64_t &value){
+  value = 0;
+  for(const uint8_t *data_ptr = ptr; data_ptr < end; data_ptr++){
+    value = (value << 7) | (*data_ptr & 0x7F);
+    if(isLastByte(*data_ptr))
+      return data_ptr - ptr + 1;
+  }
+  return 0;
+}
+
+#ifndef __AVR__
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define C78_LITTLE_ENDIAN
+#endif
+
+// Load eight bytes, in host byte order.
+inline uint64_t loadWord64(const uint8_t *ptr){
+  uint64_t word;
+  memcpy(&word, ptr, sizeof(word));
+  return word;
+}
+
+// Reorder a loaded word as big-endian (first byte highest).
+inline uint64_t toBigEndian64(const uint64_t word){
+#ifdef C78_LITTLE_ENDIAN
+  return __builtin_bswap64(word);
+#else
+  return word;
+#endif
+}
+
+// Mask of the first count bytes of a loaded word.
+inline uint64_t firstBytesMask(const uint8_t count){
+#ifdef C78_LITTLE_ENDIAN
+  return (count >= 8)? ~0ULL : (1ULL << (8 * count)) - 1;
+#else
+  return (count >= 8)? ~0ULL : ~(~0ULL >> (8 * count));
+#endif
+}
+
+// Bytes up to and including the first terminator of a loaded word, given its (nonzero)
+// terminator mask.
+inline uint8_t terminatedLength(const uint64_t terminators){
+#ifdef C78_LITTLE_ENDIAN
+  return (__builtin_ctzll(terminators) >> 3) + 1;
+#else
+  return (__builtin_clzll(terminators) >> 3) + 1;
+#endif
+}
+
+// Gather the low 7 bits of each byte of a big-endian word into one value.
+inline uint64_t compactGroups(const uint64_t word){
+  return (word & 0x7FULL)
+       | ((word >> 1) & (0x7FULL << 7))
+       | ((word >> 2) & (0x7FULL << 14))
+       | ((word >> 3) & (0x7FULL << 21))
+       | ((word >> 4) & (0x7FULL << 28))
+       | ((word >> 5) & (0x7FULL << 35))
+       | ((word >> 6) & (0x7FULL << 42))
+       | ((word >> 7) & (0x7FULL << 49));
+}
+
+// Terminators (bytes with a clear MSb) within a word.
+inline uint64_t terminatorMask(const uint64_t word){
+  return ~word & 0x8080808080808080ULL;
+}
+
+#endif
+
+// Decode a C78 value from [ptr, end).
+// Returns the encoded length, or 0 if the value is not terminated before end.
+inline uint8_t decode(const uint8_t *ptr, const uint8_t *end, uint32_t &value){
+#ifndef __AVR__
+  if(end - ptr >= 8){
+    uint64_t word = loadWord64(ptr);
+  // Only the first five bytes can belong to a 32-bit value.
+    uint64_t terminators = terminatorMask(word) & firstBytesMask(5);
+    if(terminators != 0){
+      uint8_t length = terminatedLength(terminators);
+    // Drop the bytes following the terminator.
+      value = compactGroups(toBigEndian64(word) >> (8 * (8 - length)));
+      return length;
+    }
+  }
+#endif
+  return decodeBytewise(ptr, end, value);
+}
+
+inline uint8_t decode64(const uint8_t *ptr, const uint8_t *end, uint64_t &value){
+#ifndef __AVR__
+  if(end - ptr >= 8){
+    uint64_t word = loadWord64(ptr);
+    uint64_t terminators = terminatorMask(word);
+    if(terminators != 0){
+      uint8_t length = terminatedLength(terminators);
+      value = compactGroups(toBigEndian64(word) >> (8 * (8 - length)));
+      return length;
+    }
+  // Longer than eight bytes: rare enough to decode bytewise.
+  }
+#endif
+  return decodeBytewise64(ptr, end, value);
+}
+
+// Inverse of the zigzag mapping.
+inline int32_t decodeSigned(const uint32_t value){
+  return (int32_t) ((value >> 1) ^ (0 - (value & 0x01)));
+}
+inline int64_t decodeSigned64(const uint64_t value){
+  return (int64_t) ((value >> 1) ^ (0 - (value & 0x01)));
+}
+
+// End namespace: C78
+}
+
@@ -0,0 +1,58 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Code78 handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// C78 encoder
+//
+// C78 values are big-endian, 7 bits per byte; every byte but the last has its MSb set.
+// The encoded length is computed directly from the count of leading zero bits, so a value
+// is written in a single pass once space for all of its bytes has been reserved.
+
+#pragma once
+
+namespace Code78{
+
+// Longest encodings of 32- and 64-bit values, in bytes.
+static const uint8_t MaxEncodedLength32 = 5;
+static const uint8_t MaxEncodedLength64 = 10;
+
+// Bytes required to encode a value. (0 still takes one byte.)
+inline uint8_t encodedLength(const uint32_t value){
+  uint8_t significantBits = 32 - __builtin_clz(value | 1);
+  return (significantBits + 6) / 7;
+}
+inline uint8_t encodedLength64(const uint64_t value){
+  uint8_t significantBits = 64 - __builtin_clzll(value | 1);
+  return (significantBits + 6) / 7;
+}
+
+// Encode a value to buf, which must have room for encodedLength(value) bytes.
+// Returns the number of bytes written.
+inline uint8_t encode(const uint32_t value, uint8_t *buf){
+  uint8_t length = encodedLength(value);
+  // Highest 7-bit groups first, each flagged as continuing.
+  for(uint8_t shift = 7 * (length - 1); shift > 0; shift -= 7)
+    *(buf++) = (value >> shift) | 0x80;
+  *buf = value & 0x7F;
+  return length;
+}
+inline uint8_t encode64(const uint64_t value, uint8_t *buf){
+  uint8_t length = encodedLength64(value);
+  for(uint8_t shift = 7 * (length - 1); shift > 0; shift -= 7)
+    *(buf++) = (value >> shift) | 0x80;
+  *buf = value & 0x7F;
+  return length;
+}
+
+// Zigzag mapping for signed values: 0, -1, 1, -2, ... => 0, 1, 2, 3, ...
+inline uint32_t encodeSigned(const int32_t value){
+  return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+inline uint64_t encodeSigned64(const int64_t value){
+  return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+// End namespace: C78
+}
+
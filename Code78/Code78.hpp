@@ -7,9 +7,6 @@
 
 #pragma once
 
-//#include "C78Encoder.hpp"
-//#include "C78Decoder.hpp"
-
 namespace Code78{
 
 inline bool isLastByte(uint8_t enc_data){
@@ -19,3 +16,6 @@ inline bool isLastByte(uint8_t enc_data){
 // End namespace: C78
 }
 
+#include "C78Encoder.hpp"
+#include "C78Decoder.hpp"
+
@@ -0,0 +1,205 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+#include "ClassedMAPPacketBuffer.hpp"
+
+/* PacketClass */
+
+MAP::PacketClass::~PacketClass(){
+  while(! packetBuffer.is_empty()){
+    MAPPacket *packet = packetBuffer.get_in_place().packet;
+    packetBuffer.increment_read_position();
+    dereferencePacket(packet);
+  }
+}
+
+void MAP::PacketClass::resetStatistics(){
+  refusedCount = 0;
+  for(uint8_t bucket = 0; bucket < HistogramBuckets; bucket++)
+    latencyHistogram[bucket] = 0;
+}
+
+void MAP::PacketClass::recordLatency(const ProcessClock::Time_t latency){
+  uint8_t bucket = (latency == 0)? 0 : 32 - __builtin_clz(latency);
+  if(bucket >= HistogramBuckets)
+    bucket = HistogramBuckets - 1;
+  latencyHistogram[bucket]++;
+}
+
+MAP::ProcessClock::Time_t MAP::PacketClass::get_latencyPercentile(const uint8_t percent) const{
+  uint32_t total = 0;
+  for(uint8_t bucket = 0; bucket < HistogramBuckets; bucket++)
+    total += latencyHistogram[bucket];
+  if(total == 0)
+    return 0;
+
+// Smallest count reaching the percentile (rounded up).
+  uint32_t threshold = ((uint64_t) total * percent + 99) / 100;
+  uint32_t count = 0;
+  uint8_t bucket = 0;
+  for(; bucket < HistogramBuckets - 1; bucket++){
+    count += latencyHistogram[bucket];
+    if(count >= threshold)
+      break;
+  }
+  if(bucket == 0)
+    return 0;
+  if(bucket >= 32)
+    return (ProcessClock::Time_t) -1;
+  return (((ProcessClock::Time_t) 1 << bucket) - 1);
+}
+
+/* ClassedMAPPacketBuffer */
+
+MAP::ClassedMAPPacketBuffer::ClassIndex_t MAP::ClassedMAPPacketBuffer::classify(MAPPacket* const packet, const MAPPacket::HeaderOffset_t headerOffset){
+  if(rules.is_empty())
+    return defaultClass;
+
+  Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return defaultClass;
+
+// Decode only the fields some rule matches on.
+  PacketClassRule::MatchMask_t presentFields = PacketClassRule::Match__AddressType;
+  AddressType_t addressType = get_addressType(*header);
+  uint32_t nextProto = 0;
+  uint32_t destAddress = 0;
+  if(ruleFields & PacketClassRule::Match__NextProto){
+    Data_t *data_ptr = packet->get_nextProto(header);
+    if(data_ptr != NULL && packet->sourceC78(nextProto, data_ptr))
+      presentFields |= PacketClassRule::Match__NextProto;
+  }
+  if(ruleFields & PacketClassRule::Match__DestAddress){
+    Data_t *data_ptr = packet->get_destAddress(header);
+    if(data_ptr != NULL && packet->sourceC78(destAddress, data_ptr))
+      presentFields |= PacketClassRule::Match__DestAddress;
+  }
+
+// First matching rule wins.
+  for(PacketClassRule *rule = rules.front(); rule < rules.back(); rule++){
+    if((rule->matchMask & presentFields) != rule->matchMask)
+      continue;
+    if((rule->matchMask & PacketClassRule::Match__AddressType) && rule->addressType != addressType)
+      continue;
+    if((rule->matchMask & PacketClassRule::Match__NextProto) && rule->nextProto != nextProto)
+      continue;
+    if((rule->matchMask & PacketClassRule::Match__DestAddress) && rule->destAddress != destAddress)
+      continue;
+    return rule->classIndex;
+  }
+
+  return defaultClass;
+}
+
+Status::Status_t MAP::ClassedMAPPacketBuffer::sinkPacket(MAPPacket* const packet, MAPPacket::HeaderOffset_t headerOffset){
+  if(classes.is_empty())
+    return Status::Status__Bad;
+
+  PacketClass *packetClass = classes.get(classify(packet, headerOffset));
+
+// If nothing is buffered (in any class), try to sink the packet immediately.
+  if(backlog == 0){
+    Status::Status_t tempStatus = packetSink->sinkPacket(packet, headerOffset);
+    if(tempStatus != Status::Status__Busy){
+      packetClass->recordLatency(0);
+      return tempStatus;
+    }
+  }
+
+  if(packetClass->packetBuffer.is_full()){
+    packetClass->refusedCount++;
+    return Status::Status__Busy;
+  }
+
+// Reference the packet (until passed on).
+  referencePacket(packet);
+  packetClass->packetBuffer.sinkData(TimedOffsetMAPPacket(packet, headerOffset, get_time()));
+  backlog++;
+  signalReady();
+  return Status::Status__Good;
+}
+
+Status::Status_t MAP::ClassedMAPPacketBuffer::process(){
+// The backlog (across classes) may exceed 255.
+  uint16_t count = 0;
+  bool sinkBusy = false;
+  while(backlog > 0){
+    PacketClass *packetClass = NULL;
+    if(scheduling == Scheduling__DeficitRoundRobin){
+      packetClass = selectDeficitRoundRobin();
+    }else{
+    // Highest-priority (lowest-indexed) class with packets buffered.
+      for(PacketClass **packetClass_ptr = classes.front(); packetClass_ptr < classes.back(); packetClass_ptr++){
+        if(! (*packetClass_ptr)->packetBuffer.is_empty()){
+          packetClass = *packetClass_ptr;
+          break;
+        }
+      }
+    }
+
+    if(! sinkHead(packetClass)){
+      sinkBusy = true;
+      break;
+    }
+
+    count++;
+    if(drainBudget != 0 && count == drainBudget)
+      break;
+  }
+
+  if(count > 0)
+    signalUpstream();
+// Out of budget? Run again. (A busy sink signals when it has space.)
+  if(! sinkBusy && backlog > 0)
+    signalReady();
+
+  return Status::Status__Good;
+}
+
+// Visit the classes in turn, until one has a head packet within its deficit.
+// Terminates as long as some class has packets buffered, since that class's deficit grows
+// by its quantum every round.
+MAP::PacketClass* MAP::ClassedMAPPacketBuffer::selectDeficitRoundRobin(){
+  while(true){
+    PacketClass *packetClass = classes.get(currentClass);
+    if(packetClass->packetBuffer.is_empty()){
+    // An idle class doesn't save up quantum.
+      packetClass->deficit = 0;
+    }else{
+      if(! quantumGranted){
+        packetClass->deficit += packetClass->quantum;
+        quantumGranted = true;
+      }
+      if(packetClass->packetBuffer.get_in_place().packet->get_totalSize() <= packetClass->deficit)
+        return packetClass;
+    }
+
+    quantumGranted = false;
+    currentClass++;
+    if(currentClass >= classes.get_size())
+      currentClass = 0;
+  }
+}
+
+// Pass on the class's head packet; returns false if the sink was busy.
+bool MAP::ClassedMAPPacketBuffer::sinkHead(PacketClass* const packetClass){
+// Temporarily pop a packet. If the sink does not return Busy, permanently remove
+// the packet from the buffer.
+  TimedOffsetMAPPacket timedPacket = packetClass->packetBuffer.get_in_place();
+  MAPPacket::TotalSize_t size = timedPacket.packet->get_totalSize();
+  if(packetSink->sinkPacket(timedPacket.packet, timedPacket.headerOffset) == Status::Status__Busy)
+    return false;
+  packetClass->packetBuffer.increment_read_position();
+  backlog--;
+
+  if(scheduling == Scheduling__DeficitRoundRobin)
+    packetClass->deficit -= size;
+  if(clock != NULL)
+    packetClass->recordLatency(clock->get_time() - timedPacket.bufferTime);
+
+// Dereference the packet (which we referenced upon sinking).
+  dereferencePacket(timedPacket.packet);
+  return true;
+}
+
@@ -0,0 +1,223 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Multi-class packet buffer
+//
+// MAPPacketBuffer with one FIFO per traffic class, so that control traffic (e.g. AddressGraph
+// command packets, or server replies) need not queue behind bulk data. Each packet is
+// classified by the first rule matching its header (on address type, next-proto and/or
+// destination address); packets matching no rule go to the default class.
+//
+// Classes are served, from process(), by either:
+//   Scheduling__StrictPriority     The lowest-indexed class with packets buffered, always.
+//   Scheduling__DeficitRoundRobin  Each class in turn, up to its quantum of bytes per round.
+//                                  Unused quantum carries over (as a deficit) while the class
+//                                  has packets left, so large packets are not starved.
+//
+// Each class has its own depth limit (its buffer capacity); a full class refuses packets as Busy,
+// without affecting the others. With a clock set, each class also keeps a histogram of how long
+// its packets were buffered, in power-of-two buckets (of clock units).
+//
+// Under a ReadyScheduler, signalled as MAPPacketBuffer is.
+
+#pragma once
+
+#include "MAP.hpp"
+
+#ifndef MAP_PACKET_CLASS_HISTOGRAM_BUCKETS
+#define MAP_PACKET_CLASS_HISTOGRAM_BUCKETS 24
+#endif
+
+namespace MAP {
+
+class TimedOffsetMAPPacket : public OffsetMAPPacket {
+public:
+// Clock time when buffered.
+  ProcessClock::Time_t bufferTime;
+
+  TimedOffsetMAPPacket(MAPPacket *new_packet = NULL, MAPPacket::HeaderOffset_t new_headerOffset = 0, ProcessClock::Time_t new_bufferTime = 0)
+  : OffsetMAPPacket(new_packet, new_headerOffset), bufferTime(new_bufferTime)
+  { }
+};
+
+class PacketClass {
+public:
+  typedef uint8_t Capacity_t;
+  typedef uint16_t Quantum_t;
+  static const Quantum_t DefaultQuantum = 256;
+  static const uint8_t HistogramBuckets = MAP_PACKET_CLASS_HISTOGRAM_BUCKETS;
+
+private:
+  friend class ClassedMAPPacketBuffer;
+
+  DataStore::RingBuffer<TimedOffsetMAPPacket, Capacity_t> packetBuffer;
+
+// Deficit round-robin: bytes added to the deficit per round, and bytes still sendable.
+  Quantum_t quantum;
+  uint32_t deficit;
+
+// Statistics
+  uint32_t refusedCount;
+// Bucket 0 counts packets never buffered (or buffered for less than a clock unit); bucket n
+// counts latencies from 2^(n-1) to 2^n - 1. The last bucket also counts anything longer.
+  uint32_t latencyHistogram[HistogramBuckets];
+
+public:
+
+  PacketClass(TimedOffsetMAPPacket* raw_packet_buffer, Capacity_t buffer_capacity, Quantum_t new_quantum = DefaultQuantum)
+  : packetBuffer(raw_packet_buffer, buffer_capacity),
+    quantum(new_quantum), deficit(0)
+  {
+    assert(buffer_capacity > 0);
+    assert(new_quantum > 0);
+    resetStatistics();
+  }
+
+// Dereferences any packets still buffered.
+  ~PacketClass();
+
+  inline Capacity_t get_backlog() const{
+    return packetBuffer.get_size();
+  }
+// Packets refused (Busy) because the class was full.
+  inline uint32_t get_refusedCount() const{
+    return refusedCount;
+  }
+  inline uint32_t get_latencyCount(const uint8_t bucket) const{
+    return latencyHistogram[bucket];
+  }
+// Upper bound of the latency (in clock units) under which at least percent% of the packets
+// were passed on; 0 if none have been.
+  ProcessClock::Time_t get_latencyPercentile(const uint8_t percent) const;
+
+  void resetStatistics();
+
+private:
+  void recordLatency(const ProcessClock::Time_t latency);
+};
+
+// Header fields mapping packets to a class.
+class PacketClassRule {
+public:
+  typedef uint8_t MatchMask_t;
+  static const MatchMask_t Match__AddressType = 0x01;
+  static const MatchMask_t Match__NextProto = 0x02;
+  static const MatchMask_t Match__DestAddress = 0x04;
+
+// Fields to match on; packets lacking one of them don't match.
+  MatchMask_t matchMask;
+  AddressType_t addressType;
+  uint32_t nextProto;
+// C78-decoded destination address.
+  uint32_t destAddress;
+
+  uint8_t classIndex;
+
+  PacketClassRule(const uint8_t new_classIndex = 0, const MatchMask_t new_matchMask = 0, const AddressType_t new_addressType = AddressType__none, const uint32_t new_destAddress = 0, const uint32_t new_nextProto = 0)
+  : matchMask(new_matchMask), addressType(new_addressType),
+    nextProto(new_nextProto), destAddress(new_destAddress),
+    classIndex(new_classIndex)
+  { }
+};
+
+class ClassedMAPPacketBuffer : public MAPPacketSink, public Process, public ReadySignal, public SpaceSignal {
+public:
+// Max of 255 classes and 255 rules
+  typedef uint8_t ClassIndex_t;
+
+  typedef uint8_t Scheduling_t;
+  static const Scheduling_t Scheduling__StrictPriority = 0;
+  static const Scheduling_t Scheduling__DeficitRoundRobin = 1;
+
+private:
+  MAPPacketSink *packetSink;
+
+// Static
+  DataStore::ArrayBuffer<PacketClass*, ClassIndex_t> classes;
+  DataStore::ArrayBuffer<PacketClassRule, uint8_t> rules;
+// Fields matched on by any rule (and so decoded when classifying).
+  PacketClassRule::MatchMask_t ruleFields;
+  ClassIndex_t defaultClass;
+
+  Scheduling_t scheduling;
+// Max packets passed on per process() call; 0 for no limit.
+  uint8_t drainBudget;
+// Used to time latencies, if set.
+  ProcessClock *clock;
+
+// Packets buffered, across all classes.
+  uint16_t backlog;
+
+// Deficit round-robin: the class being served, and whether it has had its quantum this round.
+  ClassIndex_t currentClass;
+  bool quantumGranted;
+
+public:
+
+  ClassedMAPPacketBuffer(MAPPacketSink* const new_packetSink, PacketClass** const classes_buffer, const ClassIndex_t classes_buffer_capacity, PacketClassRule* const rules_buffer, const uint8_t rules_buffer_capacity, const Scheduling_t new_scheduling = Scheduling__StrictPriority, const uint8_t new_drainBudget = 0)
+  : packetSink(new_packetSink),
+    classes(classes_buffer, classes_buffer_capacity),
+    rules(rules_buffer, rules_buffer_capacity),
+    ruleFields(0), defaultClass(0),
+    scheduling(new_scheduling), drainBudget(new_drainBudget),
+    clock(NULL),
+    backlog(0),
+    currentClass(0), quantumGranted(false)
+  { }
+
+// Classes are indexed in the order added (in priority order, under strict priority).
+// Classes and rules may only be added while no packets are buffered.
+  Status::Status_t addClass(PacketClass* const &new_class){
+    return classes.sinkData(new_class);
+  }
+// The rule's class must already have been added.
+  Status::Status_t addRule(const PacketClassRule &new_rule){
+    if(new_rule.classIndex >= classes.get_size())
+      return Status::Status__Bad;
+    if(! rules.sinkData(new_rule))
+      return Status::Status__Busy;
+    ruleFields |= new_rule.matchMask;
+    return Status::Status__Good;
+  }
+  bool set_defaultClass(const ClassIndex_t new_defaultClass){
+    if(new_defaultClass >= classes.get_size())
+      return false;
+    defaultClass = new_defaultClass;
+    return true;
+  }
+
+  void set_drainBudget(const uint8_t new_drainBudget){
+    drainBudget = new_drainBudget;
+  }
+  void set_clock(ProcessClock* const new_clock){
+    clock = new_clock;
+  }
+
+  inline PacketClass* get_class(const ClassIndex_t classIndex) const{
+    return classes.get(classIndex);
+  }
+  inline uint16_t get_backlog() const{
+    return backlog;
+  }
+
+  ClassIndex_t classify(MAPPacket* const packet, const MAPPacket::HeaderOffset_t headerOffset);
+
+  Status::Status_t sinkPacket(MAPPacket* const packet, MAPPacket::HeaderOffset_t headerOffset);
+
+// Pass on buffered packets, per the scheduling, until the sink is busy or the budget runs out.
+  Status::Status_t process();
+
+private:
+  PacketClass* selectDeficitRoundRobin();
+  bool sinkHead(PacketClass* const packetClass);
+
+  inline ProcessClock::Time_t get_time(){
+    return (clock != NULL)? clock->get_time() : 0;
+  }
+};
+
+// End namespace: MAP
+}
+
@@ -22,6 +22,7 @@
 //#include "../Bpacket/Bpacket.hpp"
 #include <Upacket/Code78/Code78.hpp>
 #include <MapOS/TimedScheduler/TimedScheduler.hpp>
+#include <Upacket/Scheduling/ReadyScheduler.hpp>
 #include <ATcommon/DataStore/RingBuffer.hpp>
 
 namespace MAP {
@@ -165,6 +166,8 @@ namespace MAP {
 
 // MAPPacket class
 #include "MAPPacket.hpp"
+// HeaderMap class
+#include "MAPHeaderMap.hpp"
 
 namespace MAP {
 
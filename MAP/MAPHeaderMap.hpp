@@ -0,0 +1,248 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// MAP header chain parser
+//
+// Maps the fields of every nested MAP header in one pass. The first 32 header bytes are
+// loaded at once and reduced to a bitmask of C78 terminators (bytes with the MSb clear);
+// each C78 field is then bypassed with a single count-trailing-zeros, guided by the header's
+// flag bits, instead of stepping through it byte by byte as MAPPacket::c78Pass does.
+// Header chains running past the 32-byte window are finished with the scalar accessors.
+//
+// The results are exactly those of the MAPPacket accessors: a field is marked present (in the
+// header's presence mask) exactly where the accessor returns non-NULL. The offsets of fields
+// not present are meaningless. (Any offset may be valid, in a large enough packet, so none is
+// reserved to mean absent.)
+
+#pragma once
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace MAP {
+
+#ifndef MAP_HEADER_MAP_DEPTH
+#define MAP_HEADER_MAP_DEPTH 8
+#endif
+
+// Field offsets of one MAP header, from the front of the packet.
+struct HeaderFields {
+  typedef uint8_t FieldMask_t;
+  static const FieldMask_t NextProto_Mask = 0x01;
+  static const FieldMask_t DestAddress_Mask = 0x02;
+  static const FieldMask_t SrcAddress_Mask = 0x04;
+  static const FieldMask_t Contents_Mask = 0x08;
+
+// Fields present, as the corresponding accessor (get_nextProto, get_destAddress, get_srcAddress,
+// get_contents) returning non-NULL.
+  FieldMask_t present;
+  MAPPacket::Capacity_t header;
+  MAPPacket::Capacity_t nextProto;
+  MAPPacket::Capacity_t destAddress;
+  MAPPacket::Capacity_t srcAddress;
+  MAPPacket::Capacity_t contents;
+
+  inline bool is_present(const FieldMask_t fields) const{
+    return (present & fields) == fields;
+  }
+};
+
+class HeaderMap {
+public:
+  typedef MAPPacket::Capacity_t Capacity_t;
+
+  static const uint8_t MaxDepth = MAP_HEADER_MAP_DEPTH;
+
+// Width of the terminator mask window, in bytes.
+  static const uint8_t WindowSize = 32;
+
+// Nested headers, outermost first.
+  HeaderFields headers[MaxDepth];
+  uint8_t depth;
+// False if the chain was deeper than MaxDepth.
+  bool complete;
+
+  HeaderMap()
+  : depth(0), complete(true)
+  { }
+
+  HeaderMap(MAPPacket &packet)
+  { parse(packet); }
+
+// Offset of the first non-MAP contents, as MAPPacket::get_data().
+// Returns false if there are none (or the chain was too deep to map).
+  inline bool get_data(Capacity_t &data_offset) const{
+    if(depth == 0 || ! complete || ! headers[depth - 1].is_present(HeaderFields::Contents_Mask))
+      return false;
+    data_offset = headers[depth - 1].contents;
+    return true;
+  }
+
+// Map every header in the packet.
+  void parse(MAPPacket &packet){
+    depth = 0;
+    complete = true;
+    if(packet.is_empty())
+      return;
+
+    front = packet.front();
+    size = packet.get_size();
+    contiguous = packet.is_contiguous();
+    windowLength = (size < WindowSize)? size : WindowSize;
+    terminators = terminatorMask(front, windowLength);
+
+    Capacity_t header = 0;
+    do{
+      if(depth >= MaxDepth){
+        complete = false;
+        return;
+      }
+
+      HeaderFields &fields = headers[depth];
+      fields.header = header;
+      if(! mapFields(fields)){
+      // Beyond the window: finish this header and all following it with the scalar accessors.
+        parseScalar(packet, header);
+        return;
+      }
+      depth++;
+    }while(nextHeader(headers[depth - 1], header));
+  }
+
+private:
+  Data_t *front;
+  Capacity_t size;
+  bool contiguous;
+  uint8_t windowLength;
+// Bit i set if window byte i ends a C78 field.
+  uint32_t terminators;
+
+// Outcome of passing a C78 field.
+  typedef uint8_t Pass_t;
+  static const Pass_t Pass__Found = 0;
+  static const Pass_t Pass__Absent = 1;
+// The end of the field can't be resolved within the window.
+  static const Pass_t Pass__OutsideWindow = 2;
+
+// Build the terminator mask of the first length bytes (at most WindowSize).
+  static inline uint32_t terminatorMask(const Data_t *data, uint8_t length){
+    uint32_t mask = 0;
+    uint8_t i = 0;
+
+#if defined(__AVX2__)
+    if(length == 32){
+      mask = ~ (uint32_t) _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*) data));
+      i = 32;
+    }
+#endif
+#if defined(__SSE2__)
+    for(; i + 16 <= length; i += 16)
+      mask |= (uint32_t) (~_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) (data + i))) & 0xFFFF) << i;
+#endif
+    for(; i < length; i++)
+      mask |= (uint32_t) Code78::isLastByte(data[i]) << i;
+
+    return mask;
+  }
+
+// Advance position just past the C78 field beginning there, as MAPPacket::c78Pass.
+// Position is only advanced if the field is found.
+  inline Pass_t pass(Capacity_t &position) const{
+    if(position >= size)
+      return Pass__Absent;
+    if(position >= windowLength)
+      return Pass__OutsideWindow;
+
+    uint32_t remaining = terminators >> position;
+    if(remaining == 0)
+    // No terminator before the end of the packet, or none within the window.
+      return (windowLength == size)? Pass__Absent : Pass__OutsideWindow;
+
+    Capacity_t next = position + __builtin_ctz(remaining) + 1;
+    if(next > size || (next == size && contiguous))
+      return Pass__Absent;
+    position = next;
+    return Pass__Found;
+  }
+
+// Fill in the fields of the header at fields.header.
+// Returns false if any lies beyond the window.
+  inline bool mapFields(HeaderFields &fields) const{
+    Data_t header = front[fields.header];
+    Capacity_t position = fields.header + 1;
+    Pass_t found = Pass__Found;
+    fields.present = 0;
+
+  // Each field begins where the one before it ends (as MAPPacket::bypass_*).
+    if(get_nextProtoPresent(header)){
+      fields.nextProto = position;
+      fields.present |= HeaderFields::NextProto_Mask;
+      found = pass(position);
+    }
+    if(found == Pass__Found && get_destAddressPresent(header)){
+      fields.destAddress = position;
+      fields.present |= HeaderFields::DestAddress_Mask;
+      found = pass(position);
+    }
+    if(found == Pass__Found && get_srcAddressPresent(header)){
+      fields.srcAddress = position;
+      fields.present |= HeaderFields::SrcAddress_Mask;
+      found = pass(position);
+    }
+    if(found == Pass__Found){
+      fields.contents = position;
+      fields.present |= HeaderFields::Contents_Mask;
+    }
+
+    return (found != Pass__OutsideWindow);
+  }
+
+// Offset of the encapsulated header, as MAPPacket::get_next_header.
+// Returns false if there is none.
+  inline bool nextHeader(const HeaderFields &fields, Capacity_t &header) const{
+    if(! fields.is_present(HeaderFields::NextProto_Mask | HeaderFields::Contents_Mask))
+      return false;
+    if(fields.nextProto >= size || front[fields.nextProto] != Protocol__MAP)
+      return false;
+  // Headers must lie within the head buffer.
+    if(fields.contents >= size)
+      return false;
+    header = fields.contents;
+    return true;
+  }
+
+// Record the offset of a field pointer, if not NULL.
+  inline void mapField(HeaderFields &fields, const HeaderFields::FieldMask_t field_mask, Capacity_t &field_offset, const Data_t* const field) const{
+    if(field == NULL)
+      return;
+    field_offset = field - front;
+    fields.present |= field_mask;
+  }
+
+// Map the header at position, and everything following it, one byte at a time.
+  void parseScalar(MAPPacket &packet, Capacity_t position){
+    do{
+      if(depth >= MaxDepth){
+        complete = false;
+        return;
+      }
+
+      Data_t *header = front + position;
+      HeaderFields &fields = headers[depth];
+      fields.header = position;
+      fields.present = 0;
+      mapField(fields, HeaderFields::NextProto_Mask, fields.nextProto, packet.get_nextProto(header));
+      mapField(fields, HeaderFields::DestAddress_Mask, fields.destAddress, packet.get_destAddress(header));
+      mapField(fields, HeaderFields::SrcAddress_Mask, fields.srcAddress, packet.get_srcAddress(header));
+      mapField(fields, HeaderFields::Contents_Mask, fields.contents, packet.get_contents(header));
+      depth++;
+    }while(nextHeader(headers[depth - 1], position));
+  }
+};
+
+// End namespace: MAP
+}
+
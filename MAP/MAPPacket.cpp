@@ -5,21 +5,38 @@
 
 #include "MAP.hpp"
 #include <Upacket/PosixCRC32ChecksumEngine/PosixCRC32ChecksumEngine.hpp>
+#include <Upacket/Code78/C78Batch.hpp>
 
 // Sink a numeric value in C78-encoded big-endian format.
 bool MAP::MAPPacket::sinkC78(const uint32_t value, const Capacity_t capacity_increment, const Capacity_t capacity_limit){
-  // Calculate extra C78 bytes required (before concluding byte, with its 0 MSb).
-  // Will need an extra byte for each log (base 2^7) increment.
-  uint8_t extraBytes = 0;
-  for(uint32_t tmpValue = value >> 7; tmpValue > 0; tmpValue >>= 7)
-    extraBytes++;
-
-  // For each extra byte, sink the corresponding highest 7 bits.
-  for(; extraBytes > 0; extraBytes--){
-    if(! sinkExpand((value >> (7 * extraBytes)) | 0x80, capacity_increment, capacity_limit)) return false;
+  // Chained packets append through the segment chain.
+  if(! is_contiguous()){
+    Data_t encoded[Code78::MaxEncodedLength32];
+    return sinkSegmented(encoded, Code78::encode(value, encoded));
   }
-  // Sink last posByte
-  return sinkExpand(value & 0x7F, capacity_increment, capacity_limit);
+
+  // Reserve room for every byte at once, then write them in place.
+  uint8_t length = Code78::encodedLength(value);
+  if(! reserveAvailableCapacity(length, capacity_increment, capacity_limit))
+    return false;
+
+  Code78::encode(value, back());
+  set_size(get_size() + length);
+  return true;
+}
+bool MAP::MAPPacket::sinkC78_64(const uint64_t value, const Capacity_t capacity_increment, const Capacity_t capacity_limit){
+  if(! is_contiguous()){
+    Data_t encoded[Code78::MaxEncodedLength64];
+    return sinkSegmented(encoded, Code78::encode64(value, encoded));
+  }
+
+  uint8_t length = Code78::encodedLength64(value);
+  if(! reserveAvailableCapacity(length, capacity_increment, capacity_limit))
+    return false;
+
+  Code78::encode64(value, back());
+  set_size(get_size() + length);
+  return true;
 }
 
 // Source a C78-encoded big-endian numeric value.
@@ -29,22 +46,93 @@ bool MAP::MAPPacket::sourceC78(uint32_t &value, Data_t*& data_ptr){
   if(data_ptr == NULL || data_ptr >= back())
     return false;
 
-// Initial value for numerics.
-  value = 0;
-  while(data_ptr < back()){
-    value |= *data_ptr & 0x7F;
-  // Check if C78 value has concluded.
-    if(!(*data_ptr & 0x80))
-      break;
+  uint8_t length = Code78::decode(data_ptr, back(), value);
+// Check whether C78 value concluded properly.
+  if(length == 0){
+    data_ptr = back();
+    return false;
+  }
 
-  // Left-shift in preparation for next byte.
-    value <<= 7;
-  // Next byte.
-    data_ptr++;
+  data_ptr += length - 1;
+  return true;
+}
+bool MAP::MAPPacket::sourceC78_64(uint64_t &value, Data_t*& data_ptr){
+  if(data_ptr == NULL || data_ptr >= back())
+    return false;
+
+  uint8_t length = Code78::decode64(data_ptr, back(), value);
+  if(length == 0){
+    data_ptr = back();
+    return false;
   }
 
-// Check whether C78 value concluded properly.
-  return (data_ptr < back());
+  data_ptr += length - 1;
+  return true;
+}
+
+// Source an array of C78-encoded values.
+bool MAP::MAPPacket::sourceC78Array(uint32_t *values, const Capacity_t count, Data_t*& data_ptr){
+  if(data_ptr == NULL || data_ptr >= back())
+    return false;
+  if(count == 0)
+    return true;
+
+  const Data_t *batch_ptr = data_ptr;
+  if(Code78::decodeArray(batch_ptr, back(), values, count) < count)
+    return false;
+
+  data_ptr = (Data_t*) batch_ptr - 1;
+  return true;
+}
+bool MAP::MAPPacket::sourceC78SignedArray(int32_t *values, const Capacity_t count, Data_t*& data_ptr){
+  if(data_ptr == NULL || data_ptr >= back())
+    return false;
+  if(count == 0)
+    return true;
+
+  const Data_t *batch_ptr = data_ptr;
+  if(Code78::decodeArraySigned(batch_ptr, back(), values, count) < count)
+    return false;
+
+  data_ptr = (Data_t*) batch_ptr - 1;
+  return true;
+}
+
+// Sink an array of values in C78-encoded format.
+bool MAP::MAPPacket::sinkC78Array(const uint32_t *values, const Capacity_t count, const Capacity_t capacity_increment, const Capacity_t capacity_limit){
+  // Chained packets append value by value.
+  if(! is_contiguous()){
+    for(Capacity_t i = 0; i < count; i++){
+      if(! sinkC78(values[i])) return false;
+    }
+    return true;
+  }
+
+  uint32_t length = Code78::encodedArrayLength(values, count);
+  if(length > (Capacity_t) ~0 || ! reserveAvailableCapacity(length, capacity_increment, capacity_limit))
+    return false;
+
+  Data_t *data_ptr = back();
+  Code78::encodeArray(values, count, data_ptr, data_ptr + length);
+  set_size(get_size() + length);
+  return true;
+}
+bool MAP::MAPPacket::sinkC78SignedArray(const int32_t *values, const Capacity_t count, const Capacity_t capacity_increment, const Capacity_t capacity_limit){
+  if(! is_contiguous()){
+    for(Capacity_t i = 0; i < count; i++){
+      if(! sinkC78(Code78::encodeSigned(values[i]))) return false;
+    }
+    return true;
+  }
+
+  uint32_t length = Code78::encodedArrayLengthSigned(values, count);
+  if(length > (Capacity_t) ~0 || ! reserveAvailableCapacity(length, capacity_increment, capacity_limit))
+    return false;
+
+  Data_t *data_ptr = back();
+  Code78::encodeArraySigned(values, count, data_ptr, data_ptr + length);
+  set_size(get_size() + length);
+  return true;
 }
 
 // Source a C78String (C78 pascal encoding).
@@ -73,6 +161,139 @@ bool MAP::MAPPacket::sourceC78String(Data_t *strBuf, Capacity_t &read_len, Capac
   return true;
 }
 
+// Chain a new, empty segment onto the packet.
+bool MAP::MAPPacket::appendSegment(){
+  MemoryPool *memoryPool = get_memoryPool();
+  if(memoryPool == NULL)
+    return false;
+
+// HEAP
+  void *new_mem = memoryPool->malloc(sizeof(MAPPacketSegment));
+  if(new_mem == NULL){
+    DEBUGprint_MAP("MPPapSeg: alloc fld\n");
+    return false;
+  }
+  MAPPacketSegment *segment = new(new_mem) MAPPacketSegment();
+
+  if(lastSegment == NULL)
+    firstSegment = segment;
+  else
+    lastSegment->next = segment;
+  lastSegment = segment;
+
+  return true;
+}
+
+// Free a chain of segments.
+void MAP::MAPPacket::freeSegmentChain(MAPPacketSegment *segment){
+  MemoryPool *memoryPool = get_memoryPool();
+  while(segment != NULL){
+    MAPPacketSegment *next = segment->next;
+  // Convention is that segments are stored in the packet's Pool.
+    delete segment;
+    if(memoryPool != NULL)
+      memoryPool->deallocate(sizeof(MAPPacketSegment));
+    segment = next;
+  }
+}
+
+void MAP::MAPPacket::clearSegments(){
+  freeSegmentChain(firstSegment);
+  firstSegment = lastSegment = NULL;
+  segmentedSize = 0;
+}
+
+// Append a byte without reallocating.
+bool MAP::MAPPacket::sinkSegmented(const Data_t data){
+// Use up the head's remaining capacity first.
+  if(is_contiguous() && get_availableCapacity() > 0)
+    return DataStore::DynamicArrayBuffer<Data_t,Capacity_t>::sinkData(data);
+
+  if(lastSegment == NULL || lastSegment->is_full()){
+    if(! appendSegment())
+      return false;
+  }
+
+  lastSegment->data[lastSegment->size++] = data;
+  segmentedSize++;
+  return true;
+}
+
+// Append a block of bytes without reallocating.
+// On failure, the bytes that did fit remain appended.
+bool MAP::MAPPacket::sinkSegmented(const Data_t *buf, TotalSize_t len){
+// Fill the head first.
+  if(is_contiguous()){
+    Capacity_t headLen = (len < get_availableCapacity())? len : get_availableCapacity();
+    memcpy(back(), buf, headLen);
+    set_size(get_size() + headLen);
+    buf += headLen;
+    len -= headLen;
+  }
+
+  while(len > 0){
+    if(lastSegment == NULL || lastSegment->is_full()){
+      if(! appendSegment())
+        return false;
+    }
+
+    MAPPacketSegment::SegmentCapacity_t segmentLen = MAPPacketSegment::Capacity - lastSegment->size;
+    if(len < segmentLen)
+      segmentLen = len;
+    memcpy(lastSegment->back(), buf, segmentLen);
+    lastSegment->size += segmentLen;
+    segmentedSize += segmentLen;
+    buf += segmentLen;
+    len -= segmentLen;
+  }
+
+  return true;
+}
+
+// Cut the packet down to new_size total bytes.
+void MAP::MAPPacket::truncate(TotalSize_t new_size){
+  if(new_size >= get_totalSize())
+    return;
+
+// New end lies within the head? Then the whole chain goes.
+  if(new_size <= get_size()){
+    clearSegments();
+    set_size(new_size);
+    return;
+  }
+
+// Find the segment containing the new end.
+  TotalSize_t remaining = new_size - get_size();
+  segmentedSize = remaining;
+  MAPPacketSegment *segment = firstSegment;
+  while(remaining > segment->size){
+    remaining -= segment->size;
+    segment = segment->next;
+  }
+
+// Trim it, and free everything after it.
+  segment->size = remaining;
+  freeSegmentChain(segment->next);
+  segment->next = NULL;
+  lastSegment = segment;
+}
+
+// View a C78String (C78 pascal encoding) in place.
+// As with sourceC78, data_ptr is left pointing at the last byte read (the last string byte,
+// or the last C78 prefix byte if the string is empty).
+bool MAP::MAPPacket::sourceC78StringView(DataView &view, Data_t*& data_ptr){
+  view = DataView();
+  uint32_t strLen;
+  if(! sourceC78(strLen, data_ptr)) return false;
+
+// Make sure the whole string is present.
+  if(strLen > (uint32_t) (back() - (data_ptr + 1))) return false;
+
+  view = DataView(data_ptr + 1, strLen);
+  data_ptr += strLen;
+  return true;
+}
+
 // Validate a MAP packet.
 //
 // If the require_checksum argument is true, then the packet must contain a (valid) checksum
@@ -99,6 +320,31 @@ bool MAP::MAPPacket::validate(HeaderOffset_t headerOffset, bool require_checksum
   if(data_ptr == NULL)
     return false;
 
+// Chained packets are validated by total offset rather than by pointer.
+  if(! is_contiguous()){
+    TotalSize_t stop = get_totalSize();
+
+    while(header != NULL){
+      if(get_checksumPresent(*header)){
+        DEBUGprint_MAP("MPPval: val seg crc\n");
+        if(! validateChecksum(header, stop))
+          return false;
+
+        stop -= MAP::ChecksumLength;
+
+        if(remove_checksums)
+          *header = MAP::set_checksumPresent(*header, false);
+      }
+
+      header = get_next_header(header);
+    }
+
+    if(remove_checksums)
+      truncate(stop);
+
+    return true;
+  }
+
   // Stop point
   Data_t *stop_ptr = back();
 
@@ -185,6 +431,52 @@ bool MAP::MAPPacket::validateChecksum(const Data_t* data_ptr, const Data_t* stop
   return true;
 }
 
+// Validate a checksum in a chained packet, from the header at data_ptr to the end of the
+// checksum just before the total offset stop.
+bool MAP::MAPPacket::validateChecksum(Data_t* data_ptr, const TotalSize_t stop){
+  PosixCRC32ChecksumEngine checksumEngine;
+
+  // Make sure that there is at least room for the checksum to exist.
+  TotalSize_t begin = data_ptr - front();
+  if(stop < begin + 1 + MAP::ChecksumLength)
+    return false;
+
+  // Run the headers and data through the checksum engine, run by run.
+  TotalSize_t remaining = stop - MAP::ChecksumLength - begin;
+  RunIterator run(*this, data_ptr);
+  for(;;){
+    for(; data_ptr < run.back() && remaining > 0; data_ptr++, remaining--)
+      checksumEngine.sinkData(*data_ptr);
+
+    if(remaining == 0)
+      break;
+    if(! run.next())
+      return false;
+    data_ptr = run.front();
+  }
+
+  MAP::Checksum_t checksum = checksumEngine.getChecksum();
+
+  // The checksum value itself may straddle two runs.
+  for(uint8_t i = MAP::ChecksumLength; i > 0; i--){
+    while(data_ptr >= run.back()){
+      if(! run.next())
+        return false;
+      data_ptr = run.front();
+    }
+
+    if(*data_ptr != (checksum & 0xFF)){
+      DEBUGprint_MAP("MPPvalCrc: seg CRC byte invalid. Exp %x, rcvd %x.\n", checksum & 0xFF, *data_ptr);
+      return false;
+    }
+
+    checksum >>= 8;
+    data_ptr++;
+  }
+
+  return true;
+}
+
 // Append an outer checksum to the packet, if not already present.
 // Note: Does NOT validate the existing checksum, if any.
 //
@@ -204,6 +496,37 @@ bool MAP::MAPPacket::appendChecksum(HeaderOffset_t headerOffset){
 
   DEBUGprint_MAP("apCrc: Crc not pres. cap %d, size %d\n", get_capacity(), get_size());
 
+  // Chained packets: checksum each run, then chain the checksum on (no reallocation).
+  if(! is_contiguous()){
+    *header = MAP::set_checksumPresent(*header, true);
+
+    PosixCRC32ChecksumEngine checksumEngine;
+    RunIterator run(*this, header);
+    do{
+      for(MAP::Data_t *data_ptr = run.front(); data_ptr < run.back(); data_ptr++)
+        checksumEngine.sinkData(*data_ptr);
+    }while(run.next());
+
+    Checksum_t checksum = checksumEngine.getChecksum();
+    Data_t checksumBytes[ChecksumLength];
+    for(uint8_t i = 0; i < ChecksumLength; i++){
+      checksumBytes[i] = checksum & 0xFF;
+      checksum = checksum >> 8;
+    }
+
+    TotalSize_t size = get_totalSize();
+    if(! sinkSegmented(checksumBytes, ChecksumLength)){
+      DEBUGprint_MAP("apCrc: Seg append failed\n");
+    // Back out.
+      truncate(size);
+      *header = MAP::set_checksumPresent(*header, false);
+      return false;
+    }
+
+    DEBUGprint_MAP("apCrc: Seg app cmplt.\n");
+    return true;
+  }
+
   // Make sure packet has sufficient buffer capacity to store the additional 4 CRC bytes.
   if(get_availableCapacity() < ChecksumLength){
     // Attempt to increase capacity
@@ -4,13 +4,84 @@
 
 namespace MAP {
 
+// Overflow segment capacity, in bytes.
+#ifndef MAP_PACKET_SEGMENT_CAPACITY
+#define MAP_PACKET_SEGMENT_CAPACITY 128
+#endif
+
+// A fixed-size block of packet data, chained after a packet's contiguous head buffer.
+// Segments are allocated (and freed) one at a time, so appending to a chained packet
+// never reallocates or copies the data already stored.
+class MAPPacketSegment {
+public:
+  typedef uint16_t SegmentCapacity_t;
+  static const SegmentCapacity_t Capacity = MAP_PACKET_SEGMENT_CAPACITY;
+
+// Next segment in the chain, if any.
+  MAPPacketSegment *next;
+// Bytes used.
+  SegmentCapacity_t size;
+  Data_t data[Capacity];
+
+  MAPPacketSegment()
+  : next(NULL), size(0)
+  { }
+
+  inline Data_t* front(){
+    return data;
+  }
+  inline Data_t* back(){
+    return data + size;
+  }
+  inline bool is_full() const{
+    return (size >= Capacity);
+  }
+};
+
+// A read-only view of a run of packet bytes, such as an address or a C78 string.
+// Views point into the packet itself (nothing is copied), so they are only good for as long
+// as the packet is referenced and not resized. A view with NULL data is invalid.
+class DataView {
+public:
+  const Data_t *data;
+  uint16_t length;
+
+  DataView(const Data_t *new_data = NULL, const uint16_t new_length = 0)
+  : data(new_data), length(new_length)
+  { }
+
+  inline bool is_valid() const{
+    return (data != NULL);
+  }
+
+  bool operator==(const DataView &cmpView) const{
+    return (length == cmpView.length) && (memcmp(data, cmpView.data, length) == 0);
+  }
+  bool operator!=(const DataView &cmpView) const{
+    return !(*this == cmpView);
+  }
+
+// FNV-1a hash of the viewed bytes.
+  uint32_t hash() const{
+    uint32_t hashValue = 2166136261UL;
+    for(uint16_t i = 0; i < length; i++)
+      hashValue = (hashValue ^ data[i]) * 16777619UL;
+    return hashValue;
+  }
+};
+
 // A MAP packet.
 // The first byte of the packet contents are taken as a MAP header.
 // Depending on the header byte, the following bytes may be dest and/or src addresses,
 // and the packet contents may be suffixed with a CRC32 checksum.
 //class MAPPacket : public Packet::Bpacket {
 // A packet of buffered (randomly accessible) data and an associated status.
-// Limited to a 2^16-1 byte count.
+// The contiguous head buffer is limited to a 2^16-1 byte count. Larger packets
+// (firmware images, bulk dumps) continue in a chain of MAPPacketSegments, up to a
+// 2^32-1 byte total. Headers must reside within the head buffer.
+// Only the head buffer is visible through data pointers: the header accessors, the source*
+// readers and the routers (which read headers alone) all stop at back(). Chained contents are
+// read with a RunIterator (as the checksum routines, replyEcho and the MEP encoder do).
 #define PACKET_CAPACITY_T uint16_t
 class MAPPacket : public DataStore::DynamicArrayBuffer<Data_t, PACKET_CAPACITY_T> {
   // Current status
@@ -21,18 +92,32 @@ public:
 // Header offset
   typedef uint8_t HeaderOffset_t;
   typedef uint8_t ReferenceCount_t;
+// Total (head plus chained segments) size
+  typedef uint32_t TotalSize_t;
 
 private:
   // Reference count (for garbage collection)
   ReferenceCount_t referenceCount;
 
+// Segment chain following the head buffer (NULL if contiguous).
+  MAPPacketSegment *firstSegment;
+  MAPPacketSegment *lastSegment;
+// Bytes stored in the segment chain.
+  TotalSize_t segmentedSize;
+
 public:
 
   MAPPacket(MemoryPool *new_memoryPool)
   : DataStore::DynamicArrayBuffer<Data_t,Capacity_t>(new_memoryPool),
-    referenceCount(0)
+    referenceCount(0),
+    firstSegment(NULL), lastSegment(NULL), segmentedSize(0)
   { }
 
+// Segments are freed along with the packet.
+  ~MAPPacket(){
+    clearSegments();
+  }
+
 // Set the current packet status
   inline void sinkStatus(const Status::Status_t &new_status){
 //    status = new_status;
@@ -41,11 +126,121 @@ public:
   static const Capacity_t DefaultCapacityLimit = 50;
 
 // Append a data byte to a packet, expanding the packet's capacity if necessary.
+// Once a packet is chained, bytes are appended to the segment chain instead (the head
+// can no longer grow without reordering data).
   inline bool sinkExpand(Data_t data, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit){
+    if(! is_contiguous())
+      return sinkSegmented(data);
     return DataStore::DynamicArrayBuffer<Data_t,Capacity_t>::sinkExpand(data, capacity_increment, capacity_limit);
   }
+// Make sure at least len bytes of capacity are available, growing the head buffer (by at
+// least capacity_increment, up to capacity_limit) in a single step if necessary.
+  inline bool reserveAvailableCapacity(const Capacity_t len, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit){
+    if(get_availableCapacity() >= len)
+      return true;
+
+    Capacity_t increment = len - get_availableCapacity();
+    if(increment < capacity_increment)
+      increment = capacity_increment;
+    Capacity_t new_capacity = get_capacity() + increment;
+    if(new_capacity > capacity_limit)
+      new_capacity = capacity_limit;
+    if(new_capacity < get_size() + len)
+      return false;
+
+    return set_capacity(new_capacity);
+  }
+
+// Append a block of bytes, reserving capacity for all of them at once.
+  inline bool sinkBlock(const Data_t *buf, const Capacity_t len, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit){
+    if(! is_contiguous())
+      return sinkSegmented(buf, len);
+    if(! reserveAvailableCapacity(len, capacity_increment, capacity_limit))
+      return false;
+    memcpy(back(), buf, len);
+    set_size(get_size() + len);
+    return true;
+  }
+
+// Append a data byte to a packet, without expanding the head buffer.
+// sinkExpand, sinkBlock and sinkData hide DynamicArrayBuffer's, rather than override them (they
+// are not virtual): appending through a DataStore buffer reference or pointer fills the head
+// buffer only, and fails once it is full.
+  inline bool sinkData(const Data_t &data){
+    if(! is_contiguous())
+      return sinkSegmented(data);
+    return DataStore::DynamicArrayBuffer<Data_t,Capacity_t>::sinkData(data);
+  }
+
+// True if the whole packet is stored in the head buffer (no segment chain).
+  inline bool is_contiguous() const{
+    return (firstSegment == NULL);
+  }
+  inline MAPPacketSegment* get_firstSegment() const{
+    return firstSegment;
+  }
+// Size of the entire packet, including any chained segments.
+  inline TotalSize_t get_totalSize() const{
+    return get_size() + segmentedSize;
+  }
+
+// Append data without ever reallocating: the head buffer's remaining capacity is
+// used first, then new fixed-size segments are chained as needed.
+  bool sinkSegmented(const Data_t data);
+  bool sinkSegmented(const Data_t *buf, TotalSize_t len);
+// Cut the packet down to new_size bytes (total), freeing any emptied segments.
+  void truncate(TotalSize_t new_size);
+// Free the segment chain.
+  void clearSegments();
+
+// Iterates over the contiguous runs of a packet, beginning at a position within the
+// head buffer: first the remainder of the head, then each chained segment.
+  class RunIterator {
+    Data_t *run_front;
+    Data_t *run_back;
+    MAPPacketSegment *nextSegment;
+
+  public:
+    RunIterator(const MAPPacket &packet, Data_t *from)
+    : run_front(from), run_back(packet.back()), nextSegment(packet.get_firstSegment())
+    { }
+
+    inline Data_t* front() const{
+      return run_front;
+    }
+    inline Data_t* back() const{
+      return run_back;
+    }
+  // Advance to the next run. Returns false at the end of the packet.
+    inline bool next(){
+      if(nextSegment == NULL)
+        return false;
+      run_front = nextSegment->front();
+      run_back = nextSegment->back();
+      nextSegment = nextSegment->next;
+      return true;
+    }
+  };
 
 // This will fail spectacularly on overflow.
+#ifdef MAP_THREADSAFE_REFERENCES
+// Packets shared between threads (e.g. by ThreadedBroadcastRouter) are counted atomically.
+// The memory pools the packets are freed into must then be thread-safe, too.
+  inline ReferenceCount_t incrementReferenceCount(){
+    return __atomic_add_fetch(&referenceCount, 1, __ATOMIC_RELAXED);
+  }
+  inline ReferenceCount_t decrementReferenceCount(){
+    ReferenceCount_t count = __atomic_load_n(&referenceCount, __ATOMIC_RELAXED);
+    do{
+      if(count == 0)
+        return 0;
+    }while(! __atomic_compare_exchange_n(&referenceCount, &count, count - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return count - 1;
+  }
+  inline ReferenceCount_t get_referenceCount() const{
+    return __atomic_load_n(&referenceCount, __ATOMIC_ACQUIRE);
+  }
+#else
   inline ReferenceCount_t incrementReferenceCount(){
     return ++referenceCount;
   }
@@ -55,6 +250,10 @@ public:
     else
       return --referenceCount;
   }
+  inline ReferenceCount_t get_referenceCount() const{
+    return referenceCount;
+  }
+#endif
 
   inline Data_t* get_first_header() const{
     return front();
@@ -87,8 +286,8 @@ public:
   // Pointer is at last C78 byte, need to advance one more.
     data_ptr++;
 
-  // Sanity check
-    if(data_ptr >= back())
+  // Sanity check. (A chained packet's contents may begin in the first segment.)
+    if(data_ptr > back() || (data_ptr == back() && is_contiguous()))
       return NULL;
 
     return data_ptr;
@@ -154,6 +353,28 @@ public:
   // Begin at first byte after header (header + 1). Bypass next-proto, dest-address, and src-address.
     return bypass_srcAddress( header, bypass_destAddress(header, bypass_nextProto(header, header + 1)) );
   }
+// View a C78 field (such as an address), without copying it.
+// The view is invalid if the field is absent or runs off the end of the packet.
+  inline DataView get_c78View(const Data_t* const field) const{
+    if(field == NULL || field >= back())
+      return DataView();
+
+    const Data_t *data_ptr = field;
+    for(; data_ptr < back() && (! Code78::isLastByte(*data_ptr)); data_ptr++);
+    if(data_ptr >= back())
+      return DataView();
+
+    return DataView(field, data_ptr - field + 1);
+  }
+// View the dest-address field.
+  inline DataView get_destAddressView(Data_t* const header) const{
+    return get_c78View(get_destAddress(header));
+  }
+// View the src-address field.
+  inline DataView get_srcAddressView(Data_t* const header) const{
+    return get_c78View(get_srcAddress(header));
+  }
+
 // Get the next header, if any.
 // Returns NULL if the next-proto is not MAP.
   inline Data_t* get_next_header(Data_t* const header){
@@ -164,7 +385,10 @@ public:
 
   // Return pointer to first byte of packet contents,
   // which is the encapsulated MAP header byte.
-    return get_contents(header);
+  // (A chained packet's contents may begin at back(), in the first segment; headers must
+  // reside within the head buffer, so there is no next header there.)
+    data_ptr = get_contents(header);
+    return (data_ptr == NULL || data_ptr >= back())? NULL : data_ptr;
   }
 
 // Step through headers until reach a non-MAP encapsulated packet.
@@ -194,6 +418,9 @@ public:
 // Validate a checksum from the header at data_ptr to the end of the checksum
 // just before stop_ptr.
   bool validateChecksum(const Data_t* data_ptr, const Data_t* stop_ptr);
+// Chained packets: validate a checksum from the header at data_ptr to the end of
+// the checksum just before total offset stop.
+  bool validateChecksum(Data_t* data_ptr, const TotalSize_t stop);
 
 // Append a checksum to the packet, if there is not already one present.
 //
@@ -216,6 +443,10 @@ public:
 
 // C78-sink a numeric value
   bool sinkC78(const uint32_t value, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit);
+  bool sinkC78_64(const uint64_t value, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit);
+  inline bool sinkC78Signed_64(const int64_t value, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit){
+    return sinkC78_64(Code78::encodeSigned64(value), capacity_increment, capacity_limit);
+  }
   inline bool sinkC78Signed(const int32_t value, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit){
     uint32_t unsigned_value;
     if(value < 0)  // Handle negative values specially.
@@ -226,8 +457,17 @@ public:
     return sinkC78(unsigned_value, capacity_increment, capacity_limit);
   }
 // Source a C78-encoded big-endian numeric value.
+// (From the head buffer only, as with every source* reader; a value running on into a chained
+// segment fails to decode.)
   //  template <typename IntType_t>
   bool sourceC78(uint32_t &value, Data_t*& data_ptr);
+  bool sourceC78_64(uint64_t &value, Data_t*& data_ptr);
+  inline bool sourceC78Signed_64(int64_t &value, Data_t*& data_ptr){
+    uint64_t unsigned_value;
+    if(! sourceC78_64(unsigned_value, data_ptr)) return false;
+    value = Code78::decodeSigned64(unsigned_value);
+    return true;
+  }
   inline bool sourceC78Signed(int32_t &value, Data_t*& data_ptr){
     uint32_t unsigned_value;
     if(! sourceC78(unsigned_value, data_ptr)) return false;
@@ -239,6 +479,23 @@ public:
   }
 
   bool sourceC78String(Data_t *strBuf, Capacity_t &read_len, Capacity_t max_len, Data_t*& data_ptr);
+// View a C78String in place, rather than copying it out.
+// Fails (leaving view invalid) unless the complete string is present.
+  bool sourceC78StringView(DataView &view, Data_t*& data_ptr);
+
+// Source count consecutive C78-encoded values (see Code78::decodeArray).
+// As with sourceC78, data_ptr is left pointing at the last C78 byte, if valid.
+  bool sourceC78Array(uint32_t *values, const Capacity_t count, Data_t*& data_ptr);
+  bool sourceC78SignedArray(int32_t *values, const Capacity_t count, Data_t*& data_ptr);
+// C78-sink count values, reserving capacity for all of them at once.
+  bool sinkC78Array(const uint32_t *values, const Capacity_t count, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit);
+  bool sinkC78SignedArray(const int32_t *values, const Capacity_t count, const Capacity_t capacity_increment = 1, const Capacity_t capacity_limit = DefaultCapacityLimit);
+
+private:
+// Chain a new, empty segment.
+  bool appendSegment();
+// Free a chain of segments, beginning with segment.
+  void freeSegmentChain(MAPPacketSegment *segment);
 };
 
 
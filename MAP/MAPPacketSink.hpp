@@ -7,12 +7,6 @@
 
 namespace MAP {
 
-class MAPPacketSink {
-public:
-  // HeaderOffset limited to 256, obviously.
-  virtual Status::Status_t sinkPacket(MAPPacket *packet, MAPPacket::HeaderOffset_t headerOffset = 0) = 0;
-};
-
 class OffsetMAPPacket {
 public:
   MAPPacket *packet;
@@ -23,18 +17,101 @@ public:
   { }
 };
 
-class MAPPacketBuffer : public MAPPacketSink, public Process {
+class MAPPacketSink {
+public:
+  // HeaderOffset limited to 256, obviously.
+  virtual Status::Status_t sinkPacket(MAPPacket *packet, MAPPacket::HeaderOffset_t headerOffset = 0) = 0;
+
+  // Sink a batch of packets, in order.
+  // Returns the number of packets sunk before the first that was refused as Busy;
+  // the packets from that one on are left to the caller.
+  // Sinks that can handle packets more efficiently together (e.g. routers) override this.
+  virtual uint16_t sinkPackets(OffsetMAPPacket* const packets, const uint16_t count){
+    for(uint16_t i = 0; i < count; i++){
+      if(sinkPacket(packets[i].packet, packets[i].headerOffset) == Status::Status__Busy)
+        return i;
+    }
+    return count;
+  }
+};
+
+// Time source for budgeted processing, e.g. a free-running hardware timer.
+// Units are up to the clock; the counter may wrap.
+class ProcessClock {
+public:
+  typedef uint32_t Time_t;
+  virtual Time_t get_time() = 0;
+};
+
+// Buffers packets refused (Busy) by the packet sink, and retries them from process().
+//
+// By default, process() forwards at most one buffered packet per call. With a drain budget,
+// it instead forwards packets until the sink returns Busy, the buffer empties, or the budget
+// (a number of packets, and optionally a time in clock units) runs out, so that a burst is
+// cleared in a few scheduler rounds rather than one round per packet.
+//
+// Under a ReadyScheduler, the buffer is run when a packet is buffered, and again while the budget
+// leaves packets buffered. Packets refused as Busy wait for the sink to signal the buffer (see
+// SpaceSignal, e.g. MEPEncoder::set_upstreamSignal). The buffer in turn signals its own upstream
+// when it frees space.
+class MAPPacketBuffer : public MAPPacketSink, public Process, public ReadySignal, public SpaceSignal {
   DataStore::RingBuffer<OffsetMAPPacket, uint8_t> packetBuffer;
 
   MAPPacketSink *packetSink;
 
+// Max packets forwarded per process() call; 0 for no limit.
+  uint8_t drainBudget;
+// Max time spent per process() call (checked after each packet); 0 for no limit.
+  ProcessClock *clock;
+  ProcessClock::Time_t drainTimeBudget;
+
+// Statistics (time only if a clock is set). Without a drain budget, a sink that refills the
+// buffer can keep one call going past 255 packets.
+  uint16_t lastDrainCount;
+  ProcessClock::Time_t lastProcessTime;
+  ProcessClock::Time_t maxProcessTime;
+
 public:
 
-  MAPPacketBuffer(MAPPacketSink *new_packetSink, OffsetMAPPacket* raw_packet_buffer, uint8_t buffer_capacity)
+  MAPPacketBuffer(MAPPacketSink *new_packetSink, OffsetMAPPacket* raw_packet_buffer, uint8_t buffer_capacity, uint8_t new_drainBudget = 1)
   : packetBuffer(raw_packet_buffer, buffer_capacity),
-    packetSink(new_packetSink)
+    packetSink(new_packetSink),
+    drainBudget(new_drainBudget),
+    clock(NULL), drainTimeBudget(0),
+    lastDrainCount(0), lastProcessTime(0), maxProcessTime(0)
   { }
 
+  void set_drainBudget(const uint8_t new_drainBudget){
+    drainBudget = new_drainBudget;
+  }
+// The clock is also used to time each process() call, whether or not time_budget is set. Without
+// a clock, time_budget is ignored.
+  void set_drainTimeBudget(ProcessClock* const new_clock, const ProcessClock::Time_t time_budget = 0){
+    clock = new_clock;
+    drainTimeBudget = time_budget;
+  }
+
+// Packets currently buffered.
+  inline uint8_t get_backlog() const{
+    return packetBuffer.get_size();
+  }
+// Packets forwarded by the last process() call.
+  inline uint16_t get_lastDrainCount() const{
+    return lastDrainCount;
+  }
+// Duration of the last process() call that found packets buffered, and the longest since reset.
+  inline ProcessClock::Time_t get_lastProcessTime() const{
+    return lastProcessTime;
+  }
+  inline ProcessClock::Time_t get_maxProcessTime() const{
+    return maxProcessTime;
+  }
+  void resetStatistics(){
+    lastDrainCount = 0;
+    lastProcessTime = 0;
+    maxProcessTime = 0;
+  }
+
   Status::Status_t sinkPacket(MAPPacket* const packet, MAPPacket::HeaderOffset_t headerOffset){
   // If the packet buffer is empty, try to sink the packet immediately.
     if(packetBuffer.is_empty()){
@@ -57,6 +134,7 @@ public:
   // Attempt to append the packet to the buffer
     if(packetBuffer.sinkData(OffsetMAPPacket(packet, headerOffset))){
     // Packet has been buffered.
+      signalReady();
       return Status::Status__Good;
     }
 
@@ -66,19 +144,48 @@ public:
   }
 
   Status::Status_t process(){
-  // Attempt to sink a buffered packet, if any are pending..
-    if(! packetBuffer.is_empty()){
+    lastDrainCount = 0;
+    if(packetBuffer.is_empty())
+      return Status::Status__Good;
+
+    ProcessClock::Time_t startTime = 0;
+    if(clock != NULL)
+      startTime = clock->get_time();
+
+  // Sink buffered packets until the sink is busy, or the budget runs out.
+    bool sinkBusy = false;
+    while(! packetBuffer.is_empty()){
     // Temporarily pop a packet. If the sink does not return Busy, permanently remove
     // the packet from the buffer.
       OffsetMAPPacket offsetPacket = packetBuffer.get_in_place();
-      if(packetSink->sinkPacket(offsetPacket.packet, offsetPacket.headerOffset) != Status::Status__Busy){
-        // Finish pop.
-        packetBuffer.increment_read_position();
-        // Dereference the packet (which we referenced upon sinking).
-        dereferencePacket(offsetPacket.packet);
+      if(packetSink->sinkPacket(offsetPacket.packet, offsetPacket.headerOffset) == Status::Status__Busy){
+        sinkBusy = true;
+        break;
       }
+      // Finish pop.
+      packetBuffer.increment_read_position();
+      // Dereference the packet (which we referenced upon sinking).
+      dereferencePacket(offsetPacket.packet);
+
+      lastDrainCount++;
+      if(drainBudget != 0 && lastDrainCount == drainBudget)
+        break;
+      if(clock != NULL && drainTimeBudget != 0 && (ProcessClock::Time_t) (clock->get_time() - startTime) >= drainTimeBudget)
+        break;
+    }
+
+    if(clock != NULL){
+      lastProcessTime = clock->get_time() - startTime;
+      if(lastProcessTime > maxProcessTime)
+        maxProcessTime = lastProcessTime;
     }
 
+    if(lastDrainCount > 0)
+      signalUpstream();
+  // Out of budget? Run again. (A busy sink signals when it has space.)
+    if(! sinkBusy && ! packetBuffer.is_empty())
+      signalReady();
+
   // Good.
     return Status::Status__Good;
   }
@@ -0,0 +1 @@
+../../ClassedMAPPacketBuffer.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../ClassedMAPPacketBuffer.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../MAPHeaderMap.hpp
\ No newline at end of file
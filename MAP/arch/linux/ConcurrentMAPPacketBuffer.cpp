@@ -0,0 +1,220 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "ConcurrentMAPPacketBuffer.hpp"
+
+static uint32_t roundUpToPowerOfTwo(const uint32_t value){
+  uint32_t rounded = 1;
+  while(rounded < value)
+    rounded <<= 1;
+  return rounded;
+}
+
+MAP::PacketBufferWakeup::PacketBufferWakeup(const bool enabled)
+: eventFd(enabled? eventfd(0, EFD_CLOEXEC) : -1), waiting(0)
+{
+  if(enabled)
+    assert(eventFd >= 0);
+}
+
+MAP::PacketBufferWakeup::~PacketBufferWakeup(){
+  if(eventFd >= 0)
+    close(eventFd);
+}
+
+void MAP::PacketBufferWakeup::signal(){
+  uint64_t increment = 1;
+  while(write(eventFd, &increment, sizeof(increment)) < 0 && errno == EINTR)
+    ;
+}
+
+// A signal left over from an earlier wait just returns early; the caller rechecks the buffer.
+void MAP::PacketBufferWakeup::block(){
+  uint64_t count;
+  while(read(eventFd, &count, sizeof(count)) < 0 && errno == EINTR)
+    ;
+}
+
+/* SPSC */
+
+MAP::SpscMAPPacketBuffer::SpscMAPPacketBuffer(MAPPacketSink* const new_packetSink, const Capacity_t buffer_capacity, const bool enable_wakeups)
+: packetSink(new_packetSink),
+  slots(NULL), capacity(roundUpToPowerOfTwo(buffer_capacity)),
+  readPosition(0), cachedWritePosition(0),
+  writePosition(0), cachedReadPosition(0),
+  wakeup(enable_wakeups)
+{
+  assert(new_packetSink != NULL);
+  slots = (OffsetMAPPacket*) malloc(capacity * sizeof(OffsetMAPPacket));
+  assert(slots != NULL);
+}
+
+MAP::SpscMAPPacketBuffer::~SpscMAPPacketBuffer(){
+  for(Capacity_t position = readPosition; position != writePosition; position++)
+    dereferencePacket(slots[position & (capacity - 1)].packet);
+  free(slots);
+}
+
+uint16_t MAP::SpscMAPPacketBuffer::sinkPackets(OffsetMAPPacket* const packets, const uint16_t count){
+  Capacity_t position = writePosition;
+// Only reload the consumer's position if the cached copy shows too little room.
+  Capacity_t available = capacity - (position - cachedReadPosition);
+  if(available < count){
+    cachedReadPosition = __atomic_load_n(&readPosition, __ATOMIC_ACQUIRE);
+    available = capacity - (position - cachedReadPosition);
+  }
+  uint16_t sunk = (available < count)? available : count;
+  if(sunk == 0)
+    return 0;
+
+  for(uint16_t i = 0; i < sunk; i++){
+  // Reference the packet (until passed on).
+    referencePacket(packets[i].packet);
+    slots[(position + i) & (capacity - 1)] = packets[i];
+  }
+  __atomic_store_n(&writePosition, position + sunk, __ATOMIC_RELEASE);
+
+  wakeup.notify();
+  signalReady();
+  return sunk;
+}
+
+Status::Status_t MAP::SpscMAPPacketBuffer::process(){
+  Capacity_t position = readPosition;
+  if(cachedWritePosition == position)
+    cachedWritePosition = __atomic_load_n(&writePosition, __ATOMIC_ACQUIRE);
+  Capacity_t available = cachedWritePosition - position;
+  uint16_t count = (available < BatchCapacity)? available : BatchCapacity;
+  if(count == 0)
+    return Status::Status__Good;
+
+  OffsetMAPPacket packets[BatchCapacity];
+  for(uint16_t i = 0; i < count; i++)
+    packets[i] = slots[(position + i) & (capacity - 1)];
+
+// Packets refused as Busy stay buffered, to be retried.
+  uint16_t sunk = packetSink->sinkPackets(packets, count);
+  __atomic_store_n(&readPosition, position + sunk, __ATOMIC_RELEASE);
+// Dereference the packets (which we referenced upon sinking).
+  for(uint16_t i = 0; i < sunk; i++)
+    dereferencePacket(packets[i].packet);
+
+  if(sunk > 0)
+    signalUpstream();
+// Stopped at the batch size? Run again. (A busy sink signals when it has space.)
+  if(sunk == count && ! is_empty())
+    signalReady();
+
+  return Status::Status__Good;
+}
+
+bool MAP::SpscMAPPacketBuffer::is_empty(){
+  if(cachedWritePosition == readPosition)
+    cachedWritePosition = __atomic_load_n(&writePosition, __ATOMIC_ACQUIRE);
+  return (cachedWritePosition == readPosition);
+}
+
+/* MPSC */
+
+MAP::MpscMAPPacketBuffer::MpscMAPPacketBuffer(MAPPacketSink* const new_packetSink, const Capacity_t buffer_capacity, const bool enable_wakeups)
+: packetSink(new_packetSink),
+  slots(NULL), capacity(roundUpToPowerOfTwo(buffer_capacity)),
+  writePosition(0), readPosition(0),
+  wakeup(enable_wakeups)
+{
+  assert(new_packetSink != NULL);
+  slots = (Slot*) malloc(capacity * sizeof(Slot));
+  assert(slots != NULL);
+  for(Capacity_t position = 0; position < capacity; position++)
+    slots[position].sequence = position;
+}
+
+MAP::MpscMAPPacketBuffer::~MpscMAPPacketBuffer(){
+  for(Capacity_t position = readPosition; slots[position & (capacity - 1)].sequence == position + 1; position++)
+    dereferencePacket(slots[position & (capacity - 1)].offsetPacket.packet);
+  free(slots);
+}
+
+uint16_t MAP::MpscMAPPacketBuffer::sinkPackets(OffsetMAPPacket* const packets, const uint16_t count){
+  if(count == 0)
+    return 0;
+
+  Capacity_t position = __atomic_load_n(&writePosition, __ATOMIC_RELAXED);
+  uint16_t claimed;
+  while(true){
+  // Count the free slots from position on (the consumer frees slots in order).
+    claimed = 0;
+    while(claimed < count && __atomic_load_n(&slots[(position + claimed) & (capacity - 1)].sequence, __ATOMIC_ACQUIRE) == position + claimed)
+      claimed++;
+
+    if(claimed == 0){
+  // Either the buffer is full, or another producer has claimed position since it was read.
+      int32_t lag = (int32_t) (__atomic_load_n(&slots[position & (capacity - 1)].sequence, __ATOMIC_ACQUIRE) - position);
+      if(lag < 0)
+        return 0;
+      position = __atomic_load_n(&writePosition, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if(__atomic_compare_exchange_n(&writePosition, &position, position + claimed, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      break;
+  }
+
+  for(uint16_t i = 0; i < claimed; i++){
+    Slot &slot = slots[(position + i) & (capacity - 1)];
+  // Reference the packet (until passed on).
+    referencePacket(packets[i].packet);
+    slot.offsetPacket = packets[i];
+    __atomic_store_n(&slot.sequence, position + i + 1, __ATOMIC_RELEASE);
+  }
+
+  wakeup.notify();
+  signalReady();
+  return claimed;
+}
+
+Status::Status_t MAP::MpscMAPPacketBuffer::process(){
+  Capacity_t position = readPosition;
+
+// Collect published packets, in order, stopping at the first slot not yet published.
+  OffsetMAPPacket packets[BatchCapacity];
+  uint16_t count = 0;
+  while(count < BatchCapacity){
+    Slot &slot = slots[(position + count) & (capacity - 1)];
+    if(__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != position + count + 1)
+      break;
+    packets[count++] = slot.offsetPacket;
+  }
+  if(count == 0)
+    return Status::Status__Good;
+
+// Packets refused as Busy stay buffered, to be retried.
+  uint16_t sunk = packetSink->sinkPackets(packets, count);
+  for(uint16_t i = 0; i < sunk; i++){
+  // Free the slot for the producers' next lap.
+    __atomic_store_n(&slots[(position + i) & (capacity - 1)].sequence, position + i + capacity, __ATOMIC_RELEASE);
+  // Dereference the packet (which we referenced upon sinking).
+    dereferencePacket(packets[i].packet);
+  }
+  readPosition = position + sunk;
+
+  if(sunk > 0)
+    signalUpstream();
+// Stopped at the batch size? Run again. (A busy sink signals when it has space.)
+  if(sunk == count && ! is_empty())
+    signalReady();
+
+  return Status::Status__Good;
+}
+
+bool MAP::MpscMAPPacketBuffer::is_empty(){
+  return (__atomic_load_n(&slots[readPosition & (capacity - 1)].sequence, __ATOMIC_ACQUIRE) != readPosition + 1);
+}
+
@@ -0,0 +1,182 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Concurrent packet buffers (linux)
+//
+// MAPPacketBuffers that may be filled and drained on different threads, e.g. to run the
+// decoder, router and encoder stages of a pipeline on separate cores. Packets are sunk (by
+// sinkPacket or sinkPackets) on the producer side, and passed on to the packet sink, a batch at
+// a time, from process() on the single consumer thread. Neither side takes a lock.
+//
+//   SpscMAPPacketBuffer  One producer thread. Head and tail positions are on separate cache
+//                        lines, and each side keeps a cached copy of the other's position, so
+//                        the sides only share a line when the cached copy runs out.
+//   MpscMAPPacketBuffer  Any number of producer threads. Producers claim runs of slots with a
+//                        compare-and-swap; each slot carries a sequence number marking it as
+//                        free or published (as in Vyukov's bounded queue).
+//
+// A batch sunk at once is published at once. When the buffer is full, sinkPacket returns Busy
+// (and sinkPackets returns the number accepted), as MAPPacketBuffer does.
+//
+// With wakeups enabled, the consumer can block in wait() while the buffer is empty; producers
+// then signal an eventfd, but only when the consumer is actually waiting. Alternatively, under a
+// ProcessExecutor, the buffer signals its group when packets are published, and runs again while
+// a full batch leaves packets buffered; packets refused as Busy wait for the sink to signal (see
+// SpaceSignal). The buffer signals its own upstream (one producer's group) when it frees slots.
+//
+// Packets cross threads, so MAP_THREADSAFE_REFERENCES must be defined (for every translation
+// unit), and the packets' memory pools must be thread-safe.
+
+#pragma once
+
+#ifndef MAP_THREADSAFE_REFERENCES
+#error Concurrent MAP packet buffers require MAP_THREADSAFE_REFERENCES.
+#endif
+
+#include "MAP.hpp"
+
+#ifndef MAP_CONCURRENT_BUFFER_BATCH_CAPACITY
+#define MAP_CONCURRENT_BUFFER_BATCH_CAPACITY 32
+#endif
+
+namespace MAP {
+
+// Optional eventfd wakeup for an idle consumer.
+class PacketBufferWakeup {
+// -1 if wakeups are disabled.
+  int eventFd;
+  uint8_t waiting;
+
+public:
+
+  PacketBufferWakeup(const bool enabled);
+  ~PacketBufferWakeup();
+
+  inline bool is_enabled() const{
+    return (eventFd >= 0);
+  }
+
+// Producer side, after publishing.
+  inline void notify(){
+    if(eventFd < 0)
+      return;
+  // A read-modify-write, ordered against the one in wait(): either the consumer then sees the
+  // published packets, or this sees the consumer waiting.
+    if(__atomic_fetch_or(&waiting, 0, __ATOMIC_SEQ_CST))
+      signal();
+  }
+
+// Consumer side: block until notified, unless the buffer turns out not to be empty.
+  template <typename Buffer_t>
+  void wait(Buffer_t* const buffer){
+    if(eventFd < 0)
+      return;
+    __atomic_exchange_n(&waiting, 1, __ATOMIC_SEQ_CST);
+    if(buffer->is_empty())
+      block();
+    __atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+  }
+
+private:
+  void signal();
+  void block();
+};
+
+class SpscMAPPacketBuffer : public MAPPacketSink, public Process, public ReadySignal, public SpaceSignal {
+public:
+  typedef uint32_t Capacity_t;
+  static const uint16_t BatchCapacity = MAP_CONCURRENT_BUFFER_BATCH_CAPACITY;
+
+private:
+  MAPPacketSink *packetSink;
+
+// Capacity is a power of two.
+  OffsetMAPPacket *slots;
+  Capacity_t capacity;
+
+// Consumer side. Positions are free-running.
+  Capacity_t readPosition __attribute__((aligned(64)));
+  Capacity_t cachedWritePosition;
+
+// Producer side.
+  Capacity_t writePosition __attribute__((aligned(64)));
+  Capacity_t cachedReadPosition;
+
+  PacketBufferWakeup wakeup __attribute__((aligned(64)));
+
+public:
+
+// buffer_capacity is rounded up to a power of two.
+  SpscMAPPacketBuffer(MAPPacketSink* const new_packetSink, const Capacity_t buffer_capacity, const bool enable_wakeups = false);
+// Dereferences any packets still buffered; neither side may be running.
+  ~SpscMAPPacketBuffer();
+
+  Status::Status_t sinkPacket(MAPPacket* const packet, MAPPacket::HeaderOffset_t headerOffset){
+    OffsetMAPPacket offsetPacket(packet, headerOffset);
+    return (sinkPackets(&offsetPacket, 1) == 1)? Status::Status__Good : Status::Status__Busy;
+  }
+  uint16_t sinkPackets(OffsetMAPPacket* const packets, const uint16_t count);
+
+// Pass on up to BatchCapacity buffered packets.
+  Status::Status_t process();
+
+// Consumer side.
+  bool is_empty();
+  void wait(){
+    wakeup.wait(this);
+  }
+};
+
+class MpscMAPPacketBuffer : public MAPPacketSink, public Process, public ReadySignal, public SpaceSignal {
+public:
+  typedef uint32_t Capacity_t;
+  static const uint16_t BatchCapacity = MAP_CONCURRENT_BUFFER_BATCH_CAPACITY;
+
+private:
+  struct Slot {
+  // Equal to the slot's position when free, and to the position plus one when published.
+    Capacity_t sequence;
+    OffsetMAPPacket offsetPacket;
+  };
+
+  MAPPacketSink *packetSink;
+
+// Capacity is a power of two.
+  Slot *slots;
+  Capacity_t capacity;
+
+// Next position to claim (shared by the producers).
+  Capacity_t writePosition __attribute__((aligned(64)));
+// Next position to consume.
+  Capacity_t readPosition __attribute__((aligned(64)));
+
+  PacketBufferWakeup wakeup __attribute__((aligned(64)));
+
+public:
+
+// buffer_capacity is rounded up to a power of two.
+  MpscMAPPacketBuffer(MAPPacketSink* const new_packetSink, const Capacity_t buffer_capacity, const bool enable_wakeups = false);
+// Dereferences any packets still buffered; neither side may be running.
+  ~MpscMAPPacketBuffer();
+
+  Status::Status_t sinkPacket(MAPPacket* const packet, MAPPacket::HeaderOffset_t headerOffset){
+    OffsetMAPPacket offsetPacket(packet, headerOffset);
+    return (sinkPackets(&offsetPacket, 1) == 1)? Status::Status__Good : Status::Status__Busy;
+  }
+  uint16_t sinkPackets(OffsetMAPPacket* const packets, const uint16_t count);
+
+// Pass on up to BatchCapacity buffered packets.
+  Status::Status_t process();
+
+// Consumer side.
+  bool is_empty();
+  void wait(){
+    wakeup.wait(this);
+  }
+};
+
+// End namespace: MAP
+}
+
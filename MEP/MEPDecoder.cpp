@@ -32,7 +32,7 @@ STATE_MACHINE__BEGIN(state);
   if(data != controlPrefix){
     // Attempt to enlarge packet, if necessary
     if((!discardingPacket)
-       && (! packet->sinkExpand(data, PacketCapacity__Increment, PacketCapacity__Max))
+       && (! sinkPacketData(data))
     ) return Status::Status__Busy;
 
     return Status::Status__Good;
@@ -54,8 +54,8 @@ STATE_MACHINE__BEGIN(state);
     // Then, append the data itsef.
     if((!discardingPacket)
        && !(
-            packet->sinkExpand(controlPrefix, PacketCapacity__Increment, PacketCapacity__Max)
-         && packet->sinkExpand(data, PacketCapacity__Increment, PacketCapacity__Max)
+            sinkPacketData(controlPrefix)
+         && sinkPacketData(data)
        )
     ) return Status::Status__Busy;
 
@@ -76,7 +76,7 @@ STATE_MACHINE__BEGIN(state);
 //    if( packet->is_full() && (!expandPacketCapacity()) ) 
 //      return Status::Status__Busy;
     if((!discardingPacket)
-       && (! packet->sinkExpand(controlPrefix, PacketCapacity__Increment, PacketCapacity__Max))
+       && (! sinkPacketData(controlPrefix))
     ) return Status::Status__Busy;
 
   // Does the opcode indicate a complete packet?
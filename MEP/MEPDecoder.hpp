@@ -34,6 +34,9 @@ private:
 // Allocation pool
   MemoryPool *memoryPool;
 
+// Max total packet size once the head is full, in bytes. 0 disables chained segments.
+  MAP::MAPPacket::TotalSize_t segmentedCapacityLimit;
+
 // Initial packet capacity, in bytes
   static const uint8_t PacketCapacity__Initial = 20;
 // Packet resizing increment, in bytes
@@ -48,7 +51,8 @@ public:
   : controlPrefix(new_controlPrefix),
     packetSink(new_packetSink),
     packet(NULL),
-    memoryPool(new_memoryPool)
+    memoryPool(new_memoryPool),
+    segmentedCapacityLimit(0)
   {
     assert(packetSink != NULL);
     assert(memoryPool != NULL);
@@ -58,6 +62,20 @@ public:
 // Accept MEP-encoded data to be decoded.
   Status::Status_t sinkData(const MEP::Data_t &data);
 
+// Allow packets larger than PacketCapacity__Max, up to new_limit bytes, by chaining
+// segments onto the packet once its head buffer is full.
+  void set_segmentedCapacityLimit(const MAP::MAPPacket::TotalSize_t new_limit){
+    segmentedCapacityLimit = new_limit;
+  }
+
+// Append a decoded byte to the current packet.
+  bool sinkPacketData(const MAP::Data_t data){
+    if(packet->is_contiguous() && packet->sinkExpand(data, PacketCapacity__Increment, PacketCapacity__Max))
+      return true;
+  // Head is at its limit; chain segments, if enabled.
+    return (packet->get_totalSize() < segmentedCapacityLimit) && packet->sinkSegmented(data);
+  }
+
 // Reset decoder.
   void reset(){
     STATE_MACHINE__RESET(state);
@@ -23,6 +23,7 @@ Status::Status_t MEP::MEPEncoder::sinkPacket(MAP::MAPPacket *new_packet, MAP::MA
   // Set packet status.
   offsetPacket.packet->sinkStatus(Status::Status__Busy);
   MAP::referencePacket(offsetPacket.packet);
+  signalReady();
 
   // Packet has been accepted.
   return Status::Status__Good;
@@ -42,12 +43,15 @@ STATE_MACHINE__BEGIN(state);
   controlCollisionInProgress = false;
   // Current packet position
   packetData = offsetPacket.packet->get_header(offsetPacket.headerOffset);
+  // Chained packets continue past the head buffer, one segment at a time.
+  packetDataEnd = offsetPacket.packet->back();
+  packetSegment = offsetPacket.packet->get_firstSegment();
 
 // Checkpoint: Transmitting data.
 STATE_MACHINE__AUTOCHECKPOINT(state);
 
     // Comparison is a little shifty...
-  while(packetData < offsetPacket.packet->back()){
+  while(packetData < packetDataEnd || nextPacketRun()){
     // Consecutive or terminating bytes that collide with the MEP control byte need to be encoded.
     // Check for a byte matching the MEP control prefix (masked) directly following a byte that
     // exactly matches the MEP control character (prefix).
@@ -58,7 +62,7 @@ STATE_MACHINE__AUTOCHECKPOINT(state);
       // Send the control sequence that encodes the control prefix as a data byte.
         // Check for outgoing buffer overflow, as indicated by a return value other than 0.
       if(outputSink->sinkData(controlPrefix | MEP::Opcode__SendControlPrefixAsData) != Status::Status__Good)
-        return Status::Status__Good;
+        return outputBlocked();
 
       controlCollisionInProgress = false;
     }
@@ -66,7 +70,7 @@ STATE_MACHINE__AUTOCHECKPOINT(state);
     // Send data byte.
       // Check for outgoing buffer overflow.
     if(outputSink->sinkData(*packetData) != Status::Status__Good)
-      return Status::Status__Good;
+      return outputBlocked();
       
     // Check for control prefix collision
     controlCollisionInProgress = (*packetData == controlPrefix);
@@ -81,7 +85,7 @@ STATE_MACHINE__AUTOCHECKPOINT(state);
   if(controlCollisionInProgress){
     // Attempt sink
     if(outputSink->sinkData(controlPrefix) != Status::Status__Good)
-      return Status::Status__Good;
+      return outputBlocked();
 
     controlCollisionInProgress = false;
   }
@@ -91,20 +95,22 @@ STATE_MACHINE__AUTOCHECKPOINT(state);
 
   // Sink control prefix
   if(outputSink->sinkData(controlPrefix) != Status::Status__Good)
-    return Status::Status__Good;
+    return outputBlocked();
 
 // Checkpoint: Control byte sent, preparing to send end packet
 STATE_MACHINE__AUTOCHECKPOINT(state);
 
   // Attempt to send end packet
   if(outputSink->sinkData(controlPrefix | MEP::Opcode__CompletePacket) != Status::Status__Good)
-    return Status::Status__Good;
+    return outputBlocked();
 
   // Indicate packet processing is complete.
   offsetPacket.packet->sinkStatus(Status::Status__Complete);
 
   // Reset encoder state.
   reset();
+  // Ready for the next packet.
+  signalUpstream();
 
   // All done for now.
   return Status::Status__Good;
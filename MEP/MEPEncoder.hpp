@@ -27,7 +27,11 @@ namespace MEP {
 typedef uint8_t OutputBufferCapacity_t;
 
 // Encode a packet to an outgoing bytestream.
-class MEPEncoder : public MAP::MAPPacketSink, public Process {
+// Under a ReadyScheduler, the encoder is run when a packet is sunk. If the output ring fills,
+// the encoder waits for the ring's consumer (e.g. the transmit interrupt) to call signalReady()
+// once it has drained bytes. The encoder signals its upstream (e.g. a MAPPacketBuffer) when it
+// finishes a packet and can accept another.
+class MEPEncoder : public MAP::MAPPacketSink, public Process, public ReadySignal, public SpaceSignal {
 private:
 // Current control prefix
   MAP::Data_t controlPrefix;
@@ -36,6 +40,9 @@ private:
   MAP::OffsetMAPPacket offsetPacket;
 // Current packet data
   MAP::Data_t *packetData;
+// End of the current run of packet data, and the chained segment that follows it (if any)
+  MAP::Data_t *packetDataEnd;
+  MAP::MAPPacketSegment *packetSegment;
 
 // State machine
   StateMachine state;
@@ -76,9 +83,25 @@ public:
     controlCollisionInProgress = false;
   }
 
+// Advance to the packet's next chained segment. Returns false if there is none.
+  bool nextPacketRun(){
+    if(packetSegment == NULL)
+      return false;
+    packetData = packetSegment->front();
+    packetDataEnd = packetSegment->back();
+    packetSegment = packetSegment->next;
+    return true;
+  }
+
   bool isBusy() const{
     return (offsetPacket.packet != NULL);
   }
+
+private:
+// Output buffer full: try again once the consumer signals.
+  Status::Status_t outputBlocked(){
+    return Status::Status__Good;
+  }
 };
 
 // End namespace: MEP
@@ -0,0 +1,162 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Address classifier
+//
+// Bit-vector packet classification of an AddressGraph edge table. Each edge is a column in a
+// set of bitmaps:
+//   - one row per address type, set where the edge's type condition holds for that type,
+//   - one row per address value byte, set where the edge's value condition holds,
+//   - a negate row, set for negated edges, and
+//   - an active row, set for edges that can match at all.
+// The edges matching a packet are then
+//   ((typeRow[type] & valueRow[value]) ^ negateRow) & activeRow
+// computed a word at a time: a fixed number of row lookups, however many rules are negated or
+// masked. Bits are in edge order, so walking the result delivers in the same order as a scan.
+//
+// Each row is as wide as the edge table, so classifying still costs O(edges / 32) word
+// operations per packet, not O(fields); it beats a scan by handling 32 edges per operation,
+// with no per-edge branches.
+//
+// Changing an edge rewrites its column; growing the table past the bitmap width recompiles it.
+//
+// Included by AddressGraph.hpp (after AddressFilter).
+
+#pragma once
+
+template <typename Edge_t = AddressFilter>
+class AddressClassifier {
+public:
+  typedef uint32_t Word_t;
+  typedef uint32_t EdgeIndex_t;
+
+  static const EdgeIndex_t NullIndex = (EdgeIndex_t) ~0;
+  static const uint8_t WordBits = 32;
+// Address types are 4 bits wide in the MAP header.
+  static const uint8_t TypeCount = MAP::AddressType_Mask + 1;
+  static const uint16_t ValueCount = 256;
+
+private:
+  static const uint16_t ValueRows = TypeCount;
+  static const uint16_t NegateRow = TypeCount + ValueCount;
+  static const uint16_t ActiveRow = NegateRow + 1;
+  static const uint16_t ResultRow = ActiveRow + 1;
+  static const uint16_t RowCount = ResultRow + 1;
+
+  DataStore::DynamicArrayBuffer<Word_t, uint32_t> rows;
+// Words per row
+  uint32_t rowWords;
+// False if an allocation failed; the classifier must then be recompiled before use.
+  bool valid;
+
+public:
+
+  AddressClassifier(MemoryPool* const new_memoryPool)
+  : rows(new_memoryPool), rowWords(0), valid(true)
+  {
+    assert(new_memoryPool != NULL);
+  }
+
+  inline bool is_valid() const{
+    return valid;
+  }
+
+// Build the bitmaps for a whole edge table.
+  bool compile(Edge_t* const edges, const EdgeIndex_t edgeCount){
+  // Leave room to grow.
+    uint32_t new_rowWords = (edgeCount + (edgeCount >> 1) + WordBits) / WordBits;
+    uint32_t new_size = new_rowWords * RowCount;
+    if(new_size > rows.get_capacity() && ! rows.set_capacity(new_size)){
+      valid = false;
+      return false;
+    }
+
+    rowWords = new_rowWords;
+    rows.set_size(new_size);
+    memset(rows.front(), 0, new_size * sizeof(Word_t));
+    for(EdgeIndex_t i = 0; i < edgeCount; i++)
+      setColumn(edges[i], i);
+
+    valid = true;
+    return true;
+  }
+
+// Rewrite edge i's column, after the edge has changed.
+  bool update(Edge_t* const edges, const EdgeIndex_t edgeCount, const EdgeIndex_t i){
+    if(! valid || i >= rowWords * WordBits)
+      return compile(edges, edgeCount);
+    setColumn(edges[i], i);
+    return true;
+  }
+
+// Find the edges matching a dest address. Walk the result with nextMatch.
+  void classify(const uint8_t addressType, const uint8_t addressValue){
+    const Word_t *typeRow = row((addressType < TypeCount)? addressType : NegateRow);
+    const Word_t *valueRow = row(ValueRows + addressValue);
+    const Word_t *negateRow = row(NegateRow);
+    const Word_t *activeRow = row(ActiveRow);
+    Word_t *resultRow = row(ResultRow);
+
+  // Types that can't appear in a header leave only negated edges to match.
+    Word_t typeMask = (addressType < TypeCount)? ~(Word_t) 0 : 0;
+    for(uint32_t w = 0; w < rowWords; w++)
+      resultRow[w] = (((typeRow[w] & typeMask) & valueRow[w]) ^ negateRow[w]) & activeRow[w];
+  }
+
+// Start loading the rows classify will read for a dest address.
+  inline void prefetch(const uint8_t addressType, const uint8_t addressValue) const{
+    if(addressType < TypeCount)
+      __builtin_prefetch(row(addressType));
+    __builtin_prefetch(row(ValueRows + addressValue));
+  }
+
+// First matching edge at or after from, or NullIndex.
+  EdgeIndex_t nextMatch(const EdgeIndex_t from) const{
+    const Word_t *resultRow = row(ResultRow);
+    uint32_t w = from / WordBits;
+    if(w >= rowWords)
+      return NullIndex;
+
+    Word_t word = resultRow[w] & (~(Word_t) 0 << (from % WordBits));
+    while(word == 0){
+      if(++w >= rowWords)
+        return NullIndex;
+      word = resultRow[w];
+    }
+    return w * WordBits + __builtin_ctzl(word);
+  }
+
+private:
+  inline Word_t* row(const uint16_t index) const{
+    return rows.front() + (uint32_t) index * rowWords;
+  }
+
+  void setColumn(const Edge_t &edge, const EdgeIndex_t i){
+    uint32_t w = i / WordBits;
+    Word_t bit = (Word_t) 1 << (i % WordBits);
+
+    AddressFilter::Mode_t opcode = edge.mode & AddressFilter::ModeMask__Opcode;
+    bool active = (opcode != AddressFilter::Mode__Inactive && opcode <= AddressFilter::Mode__MaskedAddressValue);
+
+    for(uint16_t type = 0; type < TypeCount; type++){
+      bool typeMatch = active && (opcode == AddressFilter::Mode__MatchAll || edge.addressType == type);
+      setBit(row(type)[w], bit, typeMatch);
+    }
+    for(uint16_t value = 0; value < ValueCount; value++){
+      bool valueMatch = active && (opcode != AddressFilter::Mode__MaskedAddressValue || (value & edge.addressValueMask) == edge.addressValue);
+      setBit(row(ValueRows + value)[w], bit, valueMatch);
+    }
+    setBit(row(NegateRow)[w], bit, active && (edge.mode & AddressFilter::ModeMask__Negate));
+    setBit(row(ActiveRow)[w], bit, active);
+  }
+
+  static inline void setBit(Word_t &word, const Word_t bit, const bool value){
+    if(value)
+      word |= bit;
+    else
+      word &= ~bit;
+  }
+};
+
@@ -0,0 +1,293 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Address edge index
+//
+// Compiled lookup structure for an AddressGraph edge table, so that routing a packet
+// costs in proportion to the edges it matches rather than to the size of the table.
+//
+// Each edge that can match is threaded onto exactly one list:
+//   - MatchAll edges onto the MatchAll list,
+//   - AddressType edges onto the list for their type,
+//   - MaskedAddressValue edges into a value group (one per distinct type/mask pair),
+//     on the list for their value,
+//   - negated edges of any mode onto the negated list (checked with isMatch).
+// Lists are linked through per-edge next links and kept in edge order, and lookup sorts the
+// collected matches back into edge order, so delivery order is exactly that of a full scan.
+//
+// Edge_t may be any edge layout with AddressFilter's mode, addressType, addressValue and
+// addressValueMask fields and isMatch method.
+//
+// Included by AddressGraph.hpp (after AddressFilter).
+
+#pragma once
+
+template <typename Index_t, typename Edge_t = AddressFilter>
+class AddressEdgeIndex {
+public:
+  static const Index_t NullIndex = (Index_t) ~0;
+// Address types are 4 bits wide in the MAP header.
+  static const uint8_t TypeCount = MAP::AddressType_Mask + 1;
+
+private:
+// Masked-value edges of one type that share a mask, listed by value.
+  struct ValueGroup {
+    ValueGroup *next;
+    uint8_t mask;
+    Index_t edgeCount;
+    Index_t heads[256];
+
+    ValueGroup(const uint8_t new_mask, ValueGroup* const new_next)
+    : next(new_next), mask(new_mask), edgeCount(0)
+    {
+      for(uint16_t i = 0; i < 256; i++)
+        heads[i] = NullIndex;
+    }
+  };
+
+  MemoryPool *memoryPool;
+
+  Index_t matchAllHead;
+  Index_t negatedHead;
+  Index_t typeHeads[TypeCount];
+  ValueGroup *valueGroups[TypeCount];
+
+// Next edge on the same list, by edge index.
+  DataStore::DynamicArrayBuffer<Index_t, Index_t> nextLinks;
+// Lookup results. Always has capacity for every indexed edge.
+  DataStore::DynamicArrayBuffer<Index_t, Index_t> matches;
+
+// False if an allocation failed; the index must then be rebuilt before use.
+  bool valid;
+
+public:
+
+  AddressEdgeIndex(MemoryPool* const new_memoryPool)
+  : memoryPool(new_memoryPool), nextLinks(new_memoryPool), matches(new_memoryPool), valid(true)
+  {
+    assert(new_memoryPool != NULL);
+    for(uint8_t type = 0; type < TypeCount; type++)
+      valueGroups[type] = NULL;
+    clear();
+  }
+
+  ~AddressEdgeIndex(){
+    clear();
+  }
+
+  inline bool is_valid() const{
+    return valid;
+  }
+
+// Drop all edges.
+  void clear(){
+    matchAllHead = NullIndex;
+    negatedHead = NullIndex;
+    for(uint8_t type = 0; type < TypeCount; type++){
+      typeHeads[type] = NullIndex;
+      while(valueGroups[type] != NULL)
+        freeGroup(type, valueGroups[type]);
+    }
+    nextLinks.set_size(0);
+    matches.set_size(0);
+    valid = true;
+  }
+
+// Index a whole edge table from scratch.
+  bool rebuild(Edge_t* const edges, const Index_t edgeCount){
+    clear();
+    for(Index_t i = 0; i < edgeCount; i++){
+      if(! insert(edges, i))
+        return false;
+    }
+    return true;
+  }
+
+// Index edge i, after it has been set.
+  bool insert(Edge_t* const edges, const Index_t i){
+    if(! valid)
+      return false;
+    if(! reserve(i)){
+      valid = false;
+      return false;
+    }
+
+    ValueGroup *group = NULL;
+    Index_t *link = listHead(edges[i], true, group);
+    if(link == NULL)
+      return valid;
+
+  // Keep the list in edge order.
+    while(*link != NullIndex && *link < i)
+      link = &(nextLinks.get(*link));
+    nextLinks.get(i) = *link;
+    *link = i;
+
+    if(group != NULL)
+      group->edgeCount++;
+    return true;
+  }
+
+// Unindex edge i, before it is changed or deactivated.
+  void remove(Edge_t* const edges, const Index_t i){
+    if((! valid) || i >= nextLinks.get_size())
+      return;
+
+    ValueGroup *group = NULL;
+    Index_t *link = listHead(edges[i], false, group);
+    if(link == NULL)
+      return;
+
+    while(*link != NullIndex && *link != i)
+      link = &(nextLinks.get(*link));
+    if(*link == NullIndex)
+      return;
+    *link = nextLinks.get(i);
+
+    if(group != NULL && --(group->edgeCount) == 0)
+      freeGroup(edges[i].addressType, group);
+  }
+
+// Find the edges matching a dest address, in edge order.
+// Returns the match count; the indices are then available through get_match().
+  Index_t lookup(Edge_t* const edges, const uint8_t addressType, uint8_t* const addressValue){
+    matches.set_size(0);
+  // Non-empty lists collected; at most one per match, so never more than the index can count.
+    Index_t runs = 0;
+
+    runs += collect(matchAllHead);
+    if(addressType < TypeCount){
+      runs += collect(typeHeads[addressType]);
+      for(ValueGroup *group = valueGroups[addressType]; group != NULL; group = group->next)
+        runs += collect(group->heads[*addressValue & group->mask]);
+    }
+
+  // Negated edges match nearly everything, so are simply checked one by one.
+    bool negatedMatch = false;
+    for(Index_t i = negatedHead; i != NullIndex; i = nextLinks.get(i)){
+      if(edges[i].isMatch(addressType, addressValue)){
+        matches.sinkData(i);
+        negatedMatch = true;
+      }
+    }
+    runs += negatedMatch;
+
+  // Each list is already in order; only interleaved lists need sorting.
+    if(runs > 1)
+      sortMatches();
+
+    return matches.get_size();
+  }
+
+  inline Index_t get_match(const Index_t position) const{
+    return matches.get(position);
+  }
+
+private:
+
+// Make sure the index has room for edge i.
+  bool reserve(const Index_t i){
+    if(i >= NullIndex)
+      return false;
+
+    if(i >= nextLinks.get_capacity()){
+    // Grow geometrically; the edge table may hold thousands of entries.
+      uint32_t new_capacity = (uint32_t) i + 1;
+      new_capacity += (new_capacity >> 1) + 4;
+      if(new_capacity > NullIndex)
+        new_capacity = NullIndex;
+      if(! (nextLinks.set_capacity(new_capacity) && matches.set_capacity(new_capacity)))
+        return false;
+    }
+
+    while(nextLinks.get_size() <= i)
+      nextLinks.sinkData((Index_t) NullIndex);
+    return true;
+  }
+
+// Find the list an edge belongs on, or NULL if it can never match.
+// Masked-value groups are created as necessary, if create is set.
+  Index_t* listHead(const Edge_t &edge, const bool create, ValueGroup*& group){
+    AddressFilter::Mode_t opcode = edge.mode & AddressFilter::ModeMask__Opcode;
+    if(opcode == AddressFilter::Mode__Inactive || opcode > AddressFilter::Mode__MaskedAddressValue)
+      return NULL;
+
+    if(edge.mode & AddressFilter::ModeMask__Negate)
+      return &negatedHead;
+    if(opcode == AddressFilter::Mode__MatchAll)
+      return &matchAllHead;
+
+  // Types that can't appear in a header never match.
+    if(edge.addressType >= TypeCount)
+      return NULL;
+    if(opcode == AddressFilter::Mode__AddressType)
+      return &typeHeads[edge.addressType];
+
+  // Values with bits outside the mask never match.
+    if(edge.addressValue & ~edge.addressValueMask)
+      return NULL;
+
+    group = findGroup(edge.addressType, edge.addressValueMask, create);
+    if(group == NULL)
+      return NULL;
+    return &(group->heads[edge.addressValue]);
+  }
+
+  ValueGroup* findGroup(const uint8_t addressType, const uint8_t mask, const bool create){
+    for(ValueGroup *group = valueGroups[addressType]; group != NULL; group = group->next){
+      if(group->mask == mask)
+        return group;
+    }
+    if(! create)
+      return NULL;
+
+    void *new_mem = memoryPool->malloc(sizeof(ValueGroup));
+    if(new_mem == NULL){
+      valid = false;
+      return NULL;
+    }
+    valueGroups[addressType] = new(new_mem) ValueGroup(mask, valueGroups[addressType]);
+    return valueGroups[addressType];
+  }
+
+  void freeGroup(const uint8_t addressType, ValueGroup* const group){
+    ValueGroup **link = &valueGroups[addressType];
+    while(*link != group)
+      link = &((*link)->next);
+    *link = group->next;
+
+    delete group;
+    memoryPool->deallocate(sizeof(ValueGroup));
+  }
+
+// Append a list to the matches. Returns true if it was nonempty.
+  bool collect(Index_t i){
+    if(i == NullIndex)
+      return false;
+    for(; i != NullIndex; i = nextLinks.get(i))
+      matches.sinkData(i);
+    return true;
+  }
+
+// Shell sort of the matches (no duplicates, as each edge is on one list).
+  void sortMatches(){
+    Index_t *match = matches.front();
+    Index_t count = matches.get_size();
+    Index_t gap = 1;
+    while(gap < count / 3)
+      gap = gap * 3 + 1;
+
+    for(; gap > 0; gap /= 3){
+      for(Index_t i = gap; i < count; i++){
+        Index_t value = match[i];
+        Index_t j = i;
+        for(; j >= gap && match[j - gap] > value; j -= gap)
+          match[j] = match[j - gap];
+        match[j] = value;
+      }
+    }
+  }
+};
+
@@ -0,0 +1,195 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Address flow cache
+//
+// Remembers where an AddressGraph sent packets for recent destinations, so that repeat
+// destinations are forwarded with one hash and one key compare instead of re-evaluating every
+// filter. Entries are keyed by (address type, whole dest address, header offset) and hold the
+// resolved (sink index, header offset adjustment) targets, in delivery order.
+//
+// The cache is set-associative: a key hashes to one set of Ways entries, replaced round-robin.
+// Every entry is stamped with the generation it was resolved in; bumping the generation
+// (whenever the routes change) invalidates the whole cache at once.
+//
+// Destinations with addresses longer than MaxAddressLength, or with more than MaxTargets
+// targets, are not cached.
+//
+// The cache pays off over a long scanned edge table with skewed traffic. A hit is not cheaper
+// than an edge index lookup on one-byte addresses, nor than a scan of a few edges; see
+// test/AddressFlowCacheBench.cpp.
+
+#pragma once
+
+#ifndef ADDRESS_FLOW_CACHE_SETS
+#define ADDRESS_FLOW_CACHE_SETS 16
+#endif
+#ifndef ADDRESS_FLOW_CACHE_WAYS
+#define ADDRESS_FLOW_CACHE_WAYS 4
+#endif
+#ifndef ADDRESS_FLOW_CACHE_MAX_ADDRESS_LENGTH
+#define ADDRESS_FLOW_CACHE_MAX_ADDRESS_LENGTH 8
+#endif
+#ifndef ADDRESS_FLOW_CACHE_MAX_TARGETS
+#define ADDRESS_FLOW_CACHE_MAX_TARGETS 4
+#endif
+
+#include <Upacket/MAP/MAP.hpp>
+
+class AddressFlowCache {
+public:
+  static const uint8_t SetCount = ADDRESS_FLOW_CACHE_SETS;
+  static const uint8_t Ways = ADDRESS_FLOW_CACHE_WAYS;
+  static const uint8_t MaxAddressLength = ADDRESS_FLOW_CACHE_MAX_ADDRESS_LENGTH;
+  static const uint8_t MaxTargets = ADDRESS_FLOW_CACHE_MAX_TARGETS;
+
+  typedef uint16_t Generation_t;
+// Never current, so marks an empty (or half-filled) entry.
+  static const Generation_t NullGeneration = 0;
+
+  struct Target {
+    uint8_t packetSinkIndex;
+    MAP::MAPPacket::HeaderOffset_t headerOffset;
+  };
+
+  struct Key {
+    uint8_t addressType;
+    MAP::MAPPacket::HeaderOffset_t headerOffset;
+    uint8_t addressLength;
+  // Unused bytes are cleared, so keys compare as a whole.
+    uint8_t address[MaxAddressLength];
+
+  // Returns false if the address is too long (or invalid) to cache.
+    bool set(const uint8_t new_addressType, const MAP::DataView &new_address, const MAP::MAPPacket::HeaderOffset_t new_headerOffset){
+      if((! new_address.is_valid()) || new_address.length > MaxAddressLength)
+        return false;
+
+      addressType = new_addressType;
+      headerOffset = new_headerOffset;
+      addressLength = new_address.length;
+      memcpy(address, new_address.data, addressLength);
+      memset(address + addressLength, 0, MaxAddressLength - addressLength);
+      return true;
+    }
+
+    inline uint32_t hash() const{
+      return MAP::DataView((const MAP::Data_t*) this, sizeof(Key)).hash();
+    }
+
+    inline bool operator==(const Key &cmpKey) const{
+      return (memcmp(this, &cmpKey, sizeof(Key)) == 0);
+    }
+  };
+
+  struct Entry {
+    Key key;
+    uint32_t hash;
+    Generation_t generation;
+    uint8_t targetCount;
+  // Set if more than MaxTargets targets were recorded.
+    bool overflow;
+    Target targets[MaxTargets];
+  };
+
+private:
+  Entry entries[SetCount][Ways];
+// Next entry to replace, per set.
+  uint8_t victims[SetCount];
+  Generation_t generation;
+
+  uint32_t hits;
+  uint32_t misses;
+
+public:
+
+  AddressFlowCache()
+  : generation(NullGeneration + 1), hits(0), misses(0)
+  {
+    clear();
+  }
+
+  inline uint32_t get_hits() const{
+    return hits;
+  }
+  inline uint32_t get_misses() const{
+    return misses;
+  }
+  void resetCounters(){
+    hits = 0;
+    misses = 0;
+  }
+
+  inline Generation_t get_generation() const{
+    return generation;
+  }
+
+// Drop every entry (by moving to a new generation).
+  void invalidate(){
+    generation++;
+  // On wrapping, actually clear the entries, so none from the last round can come back.
+    if(generation == NullGeneration){
+      clear();
+      generation++;
+    }
+  }
+
+// Find the current entry for a key, or NULL.
+  const Entry* lookup(const Key &key, const uint32_t hash){
+    Entry *set = entries[hash % SetCount];
+    for(uint8_t way = 0; way < Ways; way++){
+      if(set[way].generation == generation && set[way].hash == hash && set[way].key == key){
+        hits++;
+        return &set[way];
+      }
+    }
+    misses++;
+    return NULL;
+  }
+
+// Start loading the set a key hashes to, ahead of a lookup.
+  inline void prefetch(const uint32_t hash) const{
+    __builtin_prefetch(entries[hash % SetCount]);
+  }
+
+// Claim an entry for a key that missed, to be filled through addTarget and then commit.
+  Entry* claim(const Key &key, const uint32_t hash){
+    uint8_t setIndex = hash % SetCount;
+    Entry *entry = &entries[setIndex][victims[setIndex]];
+    victims[setIndex] = (victims[setIndex] + 1) % Ways;
+
+    entry->key = key;
+    entry->hash = hash;
+    entry->generation = NullGeneration;
+    entry->targetCount = 0;
+    entry->overflow = false;
+    return entry;
+  }
+
+  static void addTarget(Entry* const entry, const uint8_t packetSinkIndex, const MAP::MAPPacket::HeaderOffset_t headerOffset){
+    if(entry->targetCount >= MaxTargets){
+      entry->overflow = true;
+      return;
+    }
+    entry->targets[entry->targetCount].packetSinkIndex = packetSinkIndex;
+    entry->targets[entry->targetCount].headerOffset = headerOffset;
+    entry->targetCount++;
+  }
+
+// Make a filled entry current, unless it overflowed or the routes changed since it was claimed.
+  void commit(Entry* const entry, const Generation_t claimGeneration){
+    if((! entry->overflow) && claimGeneration == generation)
+      entry->generation = generation;
+  }
+
+private:
+  void clear(){
+    for(uint8_t set = 0; set < SetCount; set++){
+      victims[set] = 0;
+      for(uint8_t way = 0; way < Ways; way++)
+        entries[set][way].generation = NullGeneration;
+    }
+  }
+};
+
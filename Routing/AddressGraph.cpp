@@ -5,7 +5,8 @@
 
 #include "AddressGraph.hpp"
 
-bool AddressFilter::isMatch(const uint8_t cmp_addressType, uint8_t* cmp_addressValue){
+bool AddressFilter::isMatch(const Mode_t mode, const uint8_t addressType, const uint8_t addressValue, const uint8_t addressValueMask,
+                            const uint8_t cmp_addressType, uint8_t* cmp_addressValue){
   // Initialize, just for fun.
   bool matched = false;
 
@@ -55,20 +56,248 @@ Status::Status_t AddressGraph::sinkPacket(MAP::MAPPacket* const packet, MAP::MAP
     DEBUGprint_AG("AG::sP: cmd packet match\n");
     process_command_packet(packet, headerOffset);
     // Stop processing, to avoid loops.
-  }else{
-    for(AddressFilter *edge = addressEdges.front(); edge < addressEdges.back(); edge++){
-      if(edge->isMatch(destAddressType, destAddressValue) && (edge->packetSinkIndex < packetSinks->get_size())){
-        DEBUGprint_AG("AG::sP: acc: i%d h%d\n", edge->packetSinkIndex, edge->headerOffset);
-        packetSinks->get(edge->packetSinkIndex)->sinkPacket(packet, headerOffset + edge->headerOffset);
+  }else
+    deliver(packet, headerOffset, header, destAddressType, destAddressValue);
+
+  // Dereference
+  MAP::dereferencePacket(packet);
+  return Status::Status__Good;
+}
+
+uint16_t AddressGraph::sinkPackets(MAP::OffsetMAPPacket* const packets, const uint16_t count){
+  DeliveryBatch deliveries;
+  deliveries.count = 0;
+
+  for(uint16_t first = 0; first < count; first += BatchCapacity){
+    MAP::OffsetMAPPacket *chunk = packets + first;
+    uint16_t chunkSize = (count - first < BatchCapacity)? count - first : BatchCapacity;
+
+  // Parse every header first, prefetching the route entries each packet will need.
+    MAP::Data_t *headers[BatchCapacity];
+    MAP::Data_t *destAddressValues[BatchCapacity];
+    for(uint16_t i = 0; i < chunkSize; i++){
+      // Reference, in case receiver derefs
+      MAP::referencePacket(chunk[i].packet);
+      headers[i] = chunk[i].packet->get_header(chunk[i].headerOffset);
+      destAddressValues[i] = (headers[i] == NULL)? NULL : chunk[i].packet->get_destAddress(headers[i]);
+      if(destAddressValues[i] != NULL)
+        prefetchRoutes(chunk[i].packet, chunk[i].headerOffset, headers[i], MAP::get_addressType(*headers[i]), destAddressValues[i]);
+    }
+
+  // Then resolve them, deferring deliveries so that they can be grouped.
+    for(uint16_t i = 0; i < chunkSize; i++){
+      if(destAddressValues[i] == NULL)
+        continue;
+      MAP::Data_t destAddressType = MAP::get_addressType(*headers[i]);
+
+      if((destAddressType == localAddressType) && (*destAddressValues[i] == localAddressValue)){
+    // Changes routes, so must follow the deliveries of the packets before it.
+        flushBatch(deliveries);
+        process_command_packet(chunk[i].packet, chunk[i].headerOffset);
+      }else{
+        batch = &deliveries;
+        deliver(chunk[i].packet, chunk[i].headerOffset, headers[i], destAddressType, destAddressValues[i]);
+        batch = NULL;
       }
     }
+    flushBatch(deliveries);
+
+    // Dereference
+    for(uint16_t i = 0; i < chunkSize; i++)
+      MAP::dereferencePacket(chunk[i].packet);
   }
 
-  // Dereference
-  MAP::dereferencePacket(packet);
+  return count;
+}
+
+Status::Status_t AddressGraph::process(){
+  for(uint8_t i = 0; i < retryQueueCount && i < packetSinks->get_size(); i++)
+    retryQueues[i].process(packetSinks->get(i));
   return Status::Status__Good;
 }
 
+// Pass the deferred deliveries on, a sub-batch per sink, in order of each sink's first delivery.
+void AddressGraph::flushBatch(DeliveryBatch &deliveries){
+// Sinks may route packets back through the graph meanwhile; those are delivered immediately.
+  DeliveryBatch *resolving = batch;
+  batch = NULL;
+
+  MAP::OffsetMAPPacket group[BatchCapacity];
+  for(uint16_t i = 0; i < deliveries.count; i++){
+    uint8_t packetSinkIndex = deliveries.packetSinkIndices[i];
+    if(packetSinkIndex == NullSinkIndex)
+      continue;
+
+    uint16_t groupSize = 0;
+    for(uint16_t j = i; j < deliveries.count; j++){
+      if(deliveries.packetSinkIndices[j] == packetSinkIndex){
+        group[groupSize++] = deliveries.deliveries[j];
+        deliveries.packetSinkIndices[j] = NullSinkIndex;
+      }
+    }
+  // Recheck the sink, in case a sink has changed the sinks in the meantime.
+    if(packetSinkIndex >= packetSinks->get_size())
+      continue;
+    if(packetSinkIndex < retryQueueCount)
+      retryQueues[packetSinkIndex].sinkPackets(packetSinks->get(packetSinkIndex), group, groupSize);
+    else
+      packetSinks->get(packetSinkIndex)->sinkPackets(group, groupSize);
+  }
+  deliveries.count = 0;
+
+  batch = resolving;
+}
+
+// Prefetch whatever deliver will look up first for this packet.
+void AddressGraph::prefetchRoutes(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, MAP::Data_t* const header, uint8_t destAddressType, MAP::Data_t *destAddressValue){
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+  if(flowCache != NULL && ! flowCacheBusy){
+    AddressFlowCache::Key key;
+    if(key.set(destAddressType, packet->get_destAddressView(header), headerOffset)){
+      flowCache->prefetch(key.hash());
+      return;
+    }
+  }
+#endif
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+  if(classifier != NULL && classifier->is_valid()){
+    classifier->prefetch(destAddressType, *destAddressValue);
+    return;
+  }
+#endif
+  __builtin_prefetch(addressEdges.front());
+}
+
+void AddressGraph::deliver(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, MAP::Data_t* const header, uint8_t destAddressType, MAP::Data_t *destAddressValue){
+#if ADDRESS_GRAPH_USE_FLOW_CACHE || ADDRESS_GRAPH_USE_PREFIX_ROUTES
+  MAP::DataView destAddress = packet->get_destAddressView(header);
+#endif
+  AddressFlowCache::Entry *record = NULL;
+
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+  if(flowCache != NULL && (! flowCacheBusy) && deliverCached(packet, headerOffset, destAddress, destAddressType, record))
+    return;
+  AddressFlowCache::Generation_t claimGeneration = 0;
+  if(record != NULL){
+    claimGeneration = flowCache->get_generation();
+    flowCacheBusy = true;
+  }
+#endif
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+  if(classifier != NULL && classifier->is_valid() && (! classifierBusy))
+    deliverClassified(packet, headerOffset, destAddressType, destAddressValue, record);
+  else
+#endif
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+  if(edgeIndex != NULL && edgeIndex->is_valid() && (! edgeIndexBusy))
+    deliverIndexed(packet, headerOffset, destAddressType, destAddressValue, record);
+  else
+#endif
+    deliverScan(packet, headerOffset, destAddressType, destAddressValue, record);
+
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+  if(prefixRoutes != NULL)
+    deliverPrefix(packet, headerOffset, destAddress, destAddressType, record);
+#endif
+
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+  if(record != NULL){
+    flowCache->commit(record, claimGeneration);
+    flowCacheBusy = false;
+  }
+#endif
+}
+
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+// Deliver to a cached destination's targets.
+// On a miss, returns false with record set to a claimed cache entry (if the destination can be cached).
+bool AddressGraph::deliverCached(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const MAP::DataView &destAddress, uint8_t destAddressType, AddressFlowCache::Entry*& record){
+  AddressFlowCache::Key key;
+  if(! key.set(destAddressType, destAddress, headerOffset))
+    return false;
+
+  uint32_t hash = key.hash();
+  const AddressFlowCache::Entry *entry = flowCache->lookup(key, hash);
+  if(entry == NULL){
+    record = flowCache->claim(key, hash);
+    return false;
+  }
+
+  // Copy the targets, as sinks may themselves route packets through (and so refill) the cache.
+  AddressFlowCache::Target targets[AddressFlowCache::MaxTargets];
+  uint8_t targetCount = entry->targetCount;
+  memcpy(targets, entry->targets, targetCount * sizeof(AddressFlowCache::Target));
+
+  for(uint8_t i = 0; i < targetCount; i++)
+    forward(packet, headerOffset, targets[i].packetSinkIndex, targets[i].headerOffset, NULL);
+  return true;
+}
+#endif
+
+// Deliver to each matching edge, checking every edge in turn.
+void AddressGraph::deliverScan(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record){
+  for(AddressFilter *edge = addressEdges.front(); edge < addressEdges.back(); edge++){
+    if(edge->isMatch(destAddressType, destAddressValue))
+      forward(packet, headerOffset, edge->packetSinkIndex, edge->headerOffset, record);
+  }
+}
+
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+// Deliver along the longest prefix route matching the whole dest address, if any.
+void AddressGraph::deliverPrefix(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const MAP::DataView &destAddress, uint8_t destAddressType, AddressFlowCache::Entry *record){
+  if(! destAddress.is_valid())
+    return;
+
+  const AddressPrefixRoute *route = prefixRoutes->lookup(destAddressType, destAddress.data, destAddress.length);
+  if(route != NULL)
+    forward(packet, headerOffset, route->packetSinkIndex, route->headerOffset, record);
+}
+#endif
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+// Deliver to each matching edge, as found by the classifier.
+// Delivery order is the same as deliverScan.
+void AddressGraph::deliverClassified(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record){
+  classifierBusy = true;
+  classifier->classify(destAddressType, *destAddressValue);
+  for(Classifier::EdgeIndex_t i = classifier->nextMatch(0); i != Classifier::NullIndex; i = classifier->nextMatch(i + 1)){
+  // Recheck the edge, in case a sink has changed the edges in the meantime.
+    if(i >= addressEdges.get_size())
+      break;
+    AddressFilter *edge = addressEdges.front() + i;
+    if(edge->isMatch(destAddressType, destAddressValue))
+      forward(packet, headerOffset, edge->packetSinkIndex, edge->headerOffset, record);
+  }
+  classifierBusy = false;
+
+  if(classifierStale){
+    classifierStale = false;
+    classifier->compile(addressEdges.front(), addressEdges.get_size());
+  }
+}
+#endif
+
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+// Deliver to each matching edge, as found by the edge index.
+// Delivery order is the same as deliverScan.
+void AddressGraph::deliverIndexed(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record){
+  edgeIndexBusy = true;
+  EdgeIndex_t matchCount = edgeIndex->lookup(addressEdges.front(), destAddressType, destAddressValue);
+  for(EdgeIndex_t position = 0; position < matchCount; position++){
+  // Recheck the edge, in case a sink has changed the edges in the meantime.
+    EdgeIndex_t i = edgeIndex->get_match(position);
+    if(i >= addressEdges.get_size())
+      continue;
+    AddressFilter *edge = addressEdges.front() + i;
+    if(edge->isMatch(destAddressType, destAddressValue))
+      forward(packet, headerOffset, edge->packetSinkIndex, edge->headerOffset, record);
+  }
+  edgeIndexBusy = false;
+}
+#endif
+
 void AddressGraph::command_add(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr){
   DEBUGprint_AG("cmd_add() st\n");
   AddressFilter newEdge;
@@ -196,6 +425,47 @@ void AddressGraph::command_remove(MAP::MAPPacket* const packet, MAP::Data_t *dat
   return;
 }
 
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+// Add/remove a prefix route.
+// Add: sinkIndex headerOffset addressType prefixBits(C78) prefix(C78String)
+// Remove: addressType prefixBits(C78) prefix(C78String)
+void AddressGraph::command_prefix(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr, const bool add){
+  if(prefixRoutes == NULL) return;
+
+  AddressPrefixRoute route;
+  if(add){
+  // Read sinkIndex
+    if(data_ptr >= packet->back() || (*data_ptr & 0x80)) return;
+    route.packetSinkIndex = *data_ptr;
+    data_ptr++;
+
+  // Read headerOffset
+    if(data_ptr >= packet->back() || (*data_ptr & 0x80)) return;
+    route.headerOffset = *data_ptr;
+    data_ptr++;
+  }
+
+  // Read addressType
+  if(data_ptr >= packet->back() || (*data_ptr & 0x80)) return;
+  uint8_t addressType = *data_ptr;
+  data_ptr++;
+
+  // Read prefix length (in bits), and the prefix itself
+  uint32_t prefixBits;
+  if(! packet->sourceC78(prefixBits, data_ptr)) return;
+  data_ptr++;
+  MAP::DataView prefix;
+  if(! packet->sourceC78StringView(prefix, data_ptr)) return;
+  if(prefixBits > AddressPrefixTrie::MaxPrefixBits || prefixBits > (uint32_t) prefix.length * 8) return;
+
+  if(add)
+    prefixRoutes->insert(addressType, prefix.data, prefixBits, route);
+  else
+    prefixRoutes->remove(addressType, prefix.data, prefixBits);
+  routesChanged();
+}
+#endif
+
 void AddressGraph::process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
   MAP::Data_t *data_ptr = packet->get_data(packet->get_header(headerOffset));
   if(data_ptr == NULL) return;
@@ -211,6 +481,10 @@ void AddressGraph::process_command_packet(MAP::MAPPacket* const packet, MAP::MAP
     clearEdges();
   else if(opcode == Opcode__Remove)
     command_remove(packet, data_ptr);
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+  else if(opcode == Opcode__AddPrefix || opcode == Opcode__RemovePrefix)
+    command_prefix(packet, data_ptr, (opcode == Opcode__AddPrefix));
+#endif
 
   return;
 }
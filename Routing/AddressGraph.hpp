@@ -17,6 +17,37 @@
 
 #include <Upacket/MAP/MAP.hpp>
 
+// Edge index width, and edge table limits.
+// For large edge tables, widen the index (e.g. uint16_t) and attach an AddressEdgeIndex.
+#ifndef ADDRESS_GRAPH_EDGE_INDEX_T
+#define ADDRESS_GRAPH_EDGE_INDEX_T uint8_t
+#endif
+#ifndef ADDRESS_GRAPH_MAX_EDGES
+#define ADDRESS_GRAPH_MAX_EDGES 16
+#endif
+#ifndef ADDRESS_GRAPH_CAPACITY_INCREMENT
+#define ADDRESS_GRAPH_CAPACITY_INCREMENT 4
+#endif
+// Packets parsed, and deliveries grouped, at a time by sinkPackets (on the stack).
+#ifndef ADDRESS_GRAPH_BATCH_CAPACITY
+#define ADDRESS_GRAPH_BATCH_CAPACITY 8
+#endif
+// Optional lookup structures, compiled in unless switched off (set to 0). Each is only used once
+// attached, but its code is in every delivery. The AVR build (arch/avr/AddressGraph.hpp) leaves
+// them out.
+#ifndef ADDRESS_GRAPH_USE_EDGE_INDEX
+#define ADDRESS_GRAPH_USE_EDGE_INDEX 1
+#endif
+#ifndef ADDRESS_GRAPH_USE_PREFIX_ROUTES
+#define ADDRESS_GRAPH_USE_PREFIX_ROUTES 1
+#endif
+#ifndef ADDRESS_GRAPH_USE_FLOW_CACHE
+#define ADDRESS_GRAPH_USE_FLOW_CACHE 1
+#endif
+#ifndef ADDRESS_GRAPH_USE_CLASSIFIER
+#define ADDRESS_GRAPH_USE_CLASSIFIER 1
+#endif
+
 struct AddressFilter {
 public:
   typedef uint8_t Mode_t;
@@ -56,7 +87,12 @@ public:
     addressType(new_addressType), addressValue(new_addressValue), addressValueMask(new_addressValueMask)
   { }
   
-  bool isMatch(const uint8_t cmp_addressType, uint8_t* cmp_addressValue);
+  bool isMatch(const uint8_t cmp_addressType, uint8_t* cmp_addressValue){
+    return isMatch(mode, addressType, addressValue, addressValueMask, cmp_addressType, cmp_addressValue);
+  }
+  // Shared with other edge layouts using the same modes.
+  static bool isMatch(const Mode_t mode, const uint8_t addressType, const uint8_t addressValue, const uint8_t addressValueMask,
+                      const uint8_t cmp_addressType, uint8_t* cmp_addressValue);
 
   bool operator==(const AddressFilter &cmpFilter) const{
     return (memcmp(this, &cmpFilter, sizeof(cmpFilter)) == 0);
@@ -68,38 +104,170 @@ public:
   }
 };
 
-class AddressGraph : public MAP::MAPPacketSink {
+#include "AddressEdgeIndex.hpp"
+#include "AddressClassifier.hpp"
+#include "AddressPrefixTrie.hpp"
+#include "AddressFlowCache.hpp"
+#include "SinkRetryQueue.hpp"
+
+class AddressGraph : public MAP::MAPPacketSink, public Process {
+public:
+  typedef ADDRESS_GRAPH_EDGE_INDEX_T EdgeIndex_t;
+  typedef AddressEdgeIndex<EdgeIndex_t> EdgeIndex;
+  typedef AddressClassifier<AddressFilter> Classifier;
+
 private:
   uint8_t localAddressType;
   uint8_t localAddressValue;
   
   DataStore::ArrayBuffer<MAPPacketSink*, uint8_t> *packetSinks;
-  DataStore::DynamicArrayBuffer<AddressFilter,uint8_t> addressEdges;
+  DataStore::DynamicArrayBuffer<AddressFilter,EdgeIndex_t> addressEdges;
 
-  static const uint8_t DefaultInitialCapacity = 0;
-  static const uint8_t DefaultCapacityIncrement = 4;
-  static const uint8_t DefaultMaxCapacity = 16;
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+// Optional compiled lookup structure; NULL to scan the edges linearly.
+  EdgeIndex *edgeIndex;
+// Set while delivering indexed matches (the index's results are not reentrant).
+  bool edgeIndexBusy;
+#endif
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+// Optional bit-vector classifier (used in preference to the edge index); NULL if none.
+  Classifier *classifier;
+  bool classifierBusy;
+// Edges changed while classifierBusy; the classifier is recompiled once the delivery is done.
+  bool classifierStale;
+#endif
+
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+// Optional longest-prefix-match routes on whole dest addresses; NULL if none.
+  AddressPrefixTrie *prefixRoutes;
+#endif
+
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+// Optional cache of resolved destinations; NULL if none.
+  AddressFlowCache *flowCache;
+// Set while resolving a destination for the cache (nested packets bypass the cache).
+  bool flowCacheBusy;
+#endif
+
+// Optional retry queues, one per sink index (from 0); sinks beyond retryQueueCount have none.
+  SinkRetryQueue *retryQueues;
+  uint8_t retryQueueCount;
+
+  static const EdgeIndex_t DefaultInitialCapacity = 0;
+  static const EdgeIndex_t DefaultCapacityIncrement = ADDRESS_GRAPH_CAPACITY_INCREMENT;
+  static const EdgeIndex_t DefaultMaxCapacity = ADDRESS_GRAPH_MAX_EDGES;
+
+  static const uint16_t BatchCapacity = ADDRESS_GRAPH_BATCH_CAPACITY;
+// Never a valid sink index (there are at most 255 sinks).
+  static const uint8_t NullSinkIndex = 0xFF;
+
+// Deliveries resolved for a batch of packets, awaiting grouping by sink.
+  struct DeliveryBatch {
+    uint16_t count;
+    uint8_t packetSinkIndices[BatchCapacity];
+    MAP::OffsetMAPPacket deliveries[BatchCapacity];
+  };
+// Set while resolving packets for sinkPackets; forward then defers deliveries into it.
+  DeliveryBatch *batch;
 
   typedef uint8_t Opcode_t;
   static const Opcode_t Opcode__Add = 1;
   static const Opcode_t Opcode__Remove = 2;
   static const Opcode_t Opcode__RemoveAll = 3;
+  static const Opcode_t Opcode__AddPrefix = 4;
+  static const Opcode_t Opcode__RemovePrefix = 5;
 
 public:
 
 // HEAP
   AddressGraph(uint8_t new_localAddressType, uint8_t new_localAddressValue, 
                DataStore::ArrayBuffer<MAPPacketSink*, uint8_t> *new_packetSinks,
-               MemoryPool *new_memoryPool, uint8_t initial_capacity = DefaultInitialCapacity)
+               MemoryPool *new_memoryPool, EdgeIndex_t initial_capacity = DefaultInitialCapacity)
   : localAddressType(new_localAddressType), localAddressValue(new_localAddressValue),
     packetSinks(new_packetSinks),
-    addressEdges(new_memoryPool, initial_capacity)
+    addressEdges(new_memoryPool, initial_capacity),
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+    edgeIndex(NULL), edgeIndexBusy(false),
+#endif
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+    classifier(NULL), classifierBusy(false), classifierStale(false),
+#endif
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+    prefixRoutes(NULL),
+#endif
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+    flowCache(NULL), flowCacheBusy(false),
+#endif
+    retryQueues(NULL), retryQueueCount(0),
+    batch(NULL)
   {
     assert(new_packetSinks != NULL);
     assert(new_memoryPool != NULL);
   }
 
   Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+// Headers are parsed (and route entries prefetched) for several packets at a time, and
+// deliveries are then passed on grouped by sink. Each sink receives its packets in order.
+// Command packets are processed in order, after delivering the packets before them.
+  uint16_t sinkPackets(MAP::OffsetMAPPacket* const packets, const uint16_t count);
+
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+// Attach (or, with NULL, detach) an edge index. The index is built from the current edges,
+// and kept up to date as edges are added and removed.
+  void set_edgeIndex(EdgeIndex* const new_edgeIndex){
+    edgeIndex = new_edgeIndex;
+    if(edgeIndex != NULL)
+      edgeIndex->rebuild(addressEdges.front(), addressEdges.get_size());
+  }
+#endif
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+// Attach (or, with NULL, detach) a classifier. It is compiled from the current edges,
+// and kept up to date as edges are added and removed.
+  void set_classifier(Classifier* const new_classifier){
+    classifier = new_classifier;
+    if(classifier != NULL)
+      classifier->compile(addressEdges.front(), addressEdges.get_size());
+  }
+#endif
+
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+// Attach (or, with NULL, detach) a prefix route table.
+// Packets not addressed to the graph itself are forwarded along the longest matching prefix
+// route (if any), in addition to any matching edges.
+  void set_prefixRoutes(AddressPrefixTrie* const new_prefixRoutes){
+    prefixRoutes = new_prefixRoutes;
+    routesChanged();
+  }
+#endif
+
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+// Attach (or, with NULL, detach) a flow cache.
+  void set_flowCache(AddressFlowCache* const new_flowCache){
+    flowCache = new_flowCache;
+    routesChanged();
+  }
+#endif
+
+// Attach (or, with NULL, detach) retry queues for the first count sinks.
+// Packets refused as Busy by those sinks are queued, and retried from process().
+  void set_retryQueues(SinkRetryQueue* const new_retryQueues, const uint8_t count){
+    retryQueues = new_retryQueues;
+    retryQueueCount = (new_retryQueues == NULL)? 0 : count;
+  }
+
+// Retry queued packets.
+  Status::Status_t process();
+
+// Invalidate cached destinations. Called whenever the graph changes its own routes;
+// call it after changing the attached prefix routes directly.
+  void routesChanged(){
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+    if(flowCache != NULL)
+      flowCache->invalidate();
+#endif
+  }
 
   // Note that edge is copied by value.
   bool sinkEdge(const AddressFilter &newEdge){
@@ -115,28 +283,133 @@ public:
       if(filter->mode == AddressFilter::Mode__Inactive){
         DEBUGprint_AG("scs (rplc)\n");
         *filter = newEdge;
+        edgeChanged(filter - addressEdges.front());
+        routesChanged();
         return true;
       }
     }
 
     bool skExp = addressEdges.sinkExpand(newEdge, DefaultCapacityIncrement, DefaultMaxCapacity);
     DEBUGprint_AG("skExp: %d\n", (skExp? 1 : 0));
+    if(skExp){
+      edgeChanged(addressEdges.get_size() - 1);
+      routesChanged();
+    }
     return skExp;
   }
 
   void removeEdge(AddressFilter &edge){
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+    if(edgeIndex != NULL)
+      edgeIndex->remove(addressEdges.front(), &edge - addressEdges.front());
+#endif
 // Mark edge as inactive
     edge.mode = AddressFilter::Mode__Inactive;
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+    if(classifier != NULL)
+      classifierChanged(&edge - addressEdges.front());
+#endif
+    routesChanged();
   }
 
   void clearEdges(){
     addressEdges.set_size(0);
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+    if(edgeIndex != NULL)
+      edgeIndex->clear();
+#endif
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+    if(classifier != NULL){
+      if(classifierBusy)
+        classifierStale = true;
+      else
+        classifier->compile(addressEdges.front(), 0);
+    }
+#endif
+    routesChanged();
   }
   
+private:
+// Add a newly set edge to the index and classifier, if any.
+  void edgeChanged(const EdgeIndex_t i){
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+    if(classifier != NULL)
+      classifierChanged(i);
+#endif
+
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+    if(edgeIndex == NULL)
+      return;
+  // An index that ran out of memory is rebuilt once memory allows.
+    if(! edgeIndex->is_valid())
+      edgeIndex->rebuild(addressEdges.front(), addressEdges.get_size());
+    else
+      edgeIndex->insert(addressEdges.front(), i);
+#endif
+  }
+
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+// Rewrite edge i's classifier column. While a delivery is walking the classifier's result, the
+// classifier is left alone (an update may grow it, clearing the result), and recompiled after.
+  void classifierChanged(const EdgeIndex_t i){
+    if(classifierBusy)
+      classifierStale = true;
+    else
+      classifier->update(addressEdges.front(), addressEdges.get_size(), i);
+  }
+#endif
+
+// Forward a packet not addressed to the graph itself.
+  void deliver(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, MAP::Data_t* const header, uint8_t destAddressType, MAP::Data_t *destAddressValue);
+  void prefetchRoutes(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, MAP::Data_t* const header, uint8_t destAddressType, MAP::Data_t *destAddressValue);
+  void flushBatch(DeliveryBatch &deliveries);
+
+// Resolved destinations are recorded into record, unless NULL.
+  void deliverScan(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record);
+#if ADDRESS_GRAPH_USE_EDGE_INDEX
+  void deliverIndexed(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record);
+#endif
+#if ADDRESS_GRAPH_USE_CLASSIFIER
+  void deliverClassified(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t destAddressType, MAP::Data_t *destAddressValue, AddressFlowCache::Entry *record);
+#endif
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+  void deliverPrefix(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const MAP::DataView &destAddress, uint8_t destAddressType, AddressFlowCache::Entry *record);
+#endif
+#if ADDRESS_GRAPH_USE_FLOW_CACHE
+  bool deliverCached(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const MAP::DataView &destAddress, uint8_t destAddressType, AddressFlowCache::Entry*& record);
+#endif
+
+  inline void forward(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, uint8_t packetSinkIndex, MAP::MAPPacket::HeaderOffset_t headerOffsetAdjustment, AddressFlowCache::Entry *record){
+  // Recorded even if the sink is not there (yet), as sinks may be added without invalidating the cache.
+    if(record != NULL)
+      AddressFlowCache::addTarget(record, packetSinkIndex, headerOffsetAdjustment);
+    if(packetSinkIndex >= packetSinks->get_size())
+      return;
+    DEBUGprint_AG("AG::sP: acc: i%d h%d\n", packetSinkIndex, headerOffsetAdjustment);
+
+    if(batch == NULL){
+      if(packetSinkIndex < retryQueueCount)
+        retryQueues[packetSinkIndex].sinkPacket(packetSinks->get(packetSinkIndex), packet, headerOffset + headerOffsetAdjustment);
+      else
+        packetSinks->get(packetSinkIndex)->sinkPacket(packet, headerOffset + headerOffsetAdjustment);
+      return;
+    }
+    if(batch->count >= BatchCapacity)
+      flushBatch(*batch);
+    batch->packetSinkIndices[batch->count] = packetSinkIndex;
+    batch->deliveries[batch->count] = MAP::OffsetMAPPacket(packet, headerOffset + headerOffsetAdjustment);
+    batch->count++;
+  }
+
+public:
   void process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
   void command_add(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr);
   void command_remove(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr);
+#if ADDRESS_GRAPH_USE_PREFIX_ROUTES
+  void command_prefix(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr, const bool add);
+#endif
 
   friend class EepromAddressGraph;
+  friend class SnapshotAddressGraph;
 };
 
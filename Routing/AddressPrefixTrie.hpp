@@ -0,0 +1,267 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Address prefix trie
+//
+// Longest-prefix-match routes on whole addresses, for hierarchical (LAN/IP/DNS-style)
+// addressing. An address is the complete C78 address field, as raw bytes; a prefix is any
+// number of leading bits of it, up to MaxPrefixLength bytes.
+//
+// Each address type has its own path-compressed binary (Patricia) trie. Nodes exist only
+// where a route is set or where two routes diverge, so a lookup visits at most one node per
+// branching point along the address, comparing only the bits between nodes: lookup cost
+// grows with the address length, not with the number of routes.
+
+#pragma once
+
+#ifndef ADDRESS_PREFIX_MAX_LENGTH
+#define ADDRESS_PREFIX_MAX_LENGTH 16
+#endif
+
+#include <Upacket/MAP/MAP.hpp>
+
+// Where packets matching a prefix are sent.
+struct AddressPrefixRoute {
+  uint8_t packetSinkIndex;
+  MAP::MAPPacket::HeaderOffset_t headerOffset;
+
+  AddressPrefixRoute(uint8_t new_packetSinkIndex = 0, MAP::MAPPacket::HeaderOffset_t new_headerOffset = 0)
+  : packetSinkIndex(new_packetSinkIndex), headerOffset(new_headerOffset)
+  { }
+};
+
+class AddressPrefixTrie {
+public:
+  typedef uint16_t PrefixBits_t;
+
+  static const uint8_t MaxPrefixLength = ADDRESS_PREFIX_MAX_LENGTH;
+  static const PrefixBits_t MaxPrefixBits = (PrefixBits_t) MaxPrefixLength * 8;
+// Address types are 4 bits wide in the MAP header.
+  static const uint8_t TypeCount = MAP::AddressType_Mask + 1;
+
+private:
+  struct Node {
+    Node *children[2];
+  // Length of this node's prefix, in bits.
+    PrefixBits_t bitLength;
+    bool hasRoute;
+    AddressPrefixRoute route;
+  // Prefix bits (any bits past bitLength are clear).
+    uint8_t key[MaxPrefixLength];
+  };
+
+  MemoryPool *memoryPool;
+  Node *roots[TypeCount];
+  uint16_t routeCount;
+
+public:
+
+  AddressPrefixTrie(MemoryPool* const new_memoryPool)
+  : memoryPool(new_memoryPool), routeCount(0)
+  {
+    assert(new_memoryPool != NULL);
+    for(uint8_t type = 0; type < TypeCount; type++)
+      roots[type] = NULL;
+  }
+
+  ~AddressPrefixTrie(){
+    clear();
+  }
+
+  inline uint16_t get_routeCount() const{
+    return routeCount;
+  }
+
+// Set the route for a prefix, replacing any existing route for exactly that prefix.
+  bool insert(const uint8_t addressType, const uint8_t *prefix, const PrefixBits_t prefixBits, const AddressPrefixRoute &route){
+    if(addressType >= TypeCount || prefixBits > MaxPrefixBits)
+      return false;
+
+    Node **link = &roots[addressType];
+    PrefixBits_t matched = 0;
+    while(*link != NULL){
+      Node *node = *link;
+      PrefixBits_t limit = (node->bitLength < prefixBits)? node->bitLength : prefixBits;
+      PrefixBits_t common = commonBits(node->key, prefix, matched, limit);
+
+      if(common < node->bitLength){
+    // The new prefix diverges from (or ends within) this node: split it.
+        Node *split = newNode(prefix, common);
+        if(split == NULL)
+          return false;
+        split->children[get_bit(node->key, common)] = node;
+
+        if(common == prefixBits){
+          split->hasRoute = true;
+          split->route = route;
+        }else{
+          Node *leaf = newNode(prefix, prefixBits);
+          if(leaf == NULL){
+            freeNode(split);
+            return false;
+          }
+          leaf->hasRoute = true;
+          leaf->route = route;
+          split->children[get_bit(prefix, common)] = leaf;
+        }
+
+        *link = split;
+        routeCount++;
+        return true;
+      }
+
+    // This node's prefix is a prefix of the new one.
+      if(node->bitLength == prefixBits){
+        if(! node->hasRoute)
+          routeCount++;
+        node->hasRoute = true;
+        node->route = route;
+        return true;
+      }
+
+      matched = node->bitLength;
+      link = &(node->children[get_bit(prefix, matched)]);
+    }
+
+    Node *leaf = newNode(prefix, prefixBits);
+    if(leaf == NULL)
+      return false;
+    leaf->hasRoute = true;
+    leaf->route = route;
+    *link = leaf;
+    routeCount++;
+    return true;
+  }
+
+// Remove the route for exactly this prefix. Returns false if there was none.
+  bool remove(const uint8_t addressType, const uint8_t *prefix, const PrefixBits_t prefixBits){
+    if(addressType >= TypeCount || prefixBits > MaxPrefixBits)
+      return false;
+
+    Node **link = &roots[addressType];
+    Node **parentLink = NULL;
+    PrefixBits_t matched = 0;
+    while(*link != NULL){
+      Node *node = *link;
+      if(node->bitLength > prefixBits || commonBits(node->key, prefix, matched, node->bitLength) < node->bitLength)
+        return false;
+      if(node->bitLength == prefixBits)
+        break;
+
+      matched = node->bitLength;
+      parentLink = link;
+      link = &(node->children[get_bit(prefix, matched)]);
+    }
+
+    if(*link == NULL || ! (*link)->hasRoute)
+      return false;
+
+    (*link)->hasRoute = false;
+    routeCount--;
+
+  // Drop the node if it no longer distinguishes anything, and then possibly its parent.
+    compact(link);
+    if(parentLink != NULL)
+      compact(parentLink);
+    return true;
+  }
+
+// Find the route with the longest prefix of the address, or NULL.
+  const AddressPrefixRoute* lookup(const uint8_t addressType, const uint8_t *address, const uint16_t addressLength) const{
+    if(addressType >= TypeCount)
+      return NULL;
+
+  // Prefixes are never longer than MaxPrefixBits.
+    PrefixBits_t addressBits = (addressLength < MaxPrefixLength)? addressLength * 8 : MaxPrefixBits;
+
+    const AddressPrefixRoute *bestRoute = NULL;
+    PrefixBits_t matched = 0;
+    for(const Node *node = roots[addressType]; node != NULL; node = node->children[get_bit(address, matched)]){
+      if(node->bitLength > addressBits || commonBits(node->key, address, matched, node->bitLength) < node->bitLength)
+        break;
+
+      if(node->hasRoute)
+        bestRoute = &(node->route);
+
+      matched = node->bitLength;
+      if(matched == addressBits)
+        break;
+    }
+
+    return bestRoute;
+  }
+
+  void clear(){
+    for(uint8_t type = 0; type < TypeCount; type++){
+    // Free each subtrie by repeatedly unlinking its leftmost-deepest node.
+      while(roots[type] != NULL){
+        Node **link = &roots[type];
+        while((*link)->children[0] != NULL || (*link)->children[1] != NULL)
+          link = &((*link)->children[((*link)->children[0] != NULL)? 0 : 1]);
+        freeNode(*link);
+        *link = NULL;
+      }
+    }
+    routeCount = 0;
+  }
+
+private:
+  static inline bool get_bit(const uint8_t *key, const PrefixBits_t bit){
+    return (key[bit >> 3] >> (7 - (bit & 0x07))) & 0x01;
+  }
+
+// Index of the first bit in [from, limit) at which a and b differ, or limit if none do.
+  static PrefixBits_t commonBits(const uint8_t *a, const uint8_t *b, PrefixBits_t from, const PrefixBits_t limit){
+    while(from < limit){
+      PrefixBits_t byteIndex = from >> 3;
+    // Ignore bits before from, in the first byte.
+      uint8_t diff = (a[byteIndex] ^ b[byteIndex]) & (0xFF >> (from & 0x07));
+      if(diff != 0){
+        PrefixBits_t bit = (byteIndex << 3);
+        for(; ! (diff & 0x80); diff <<= 1)
+          bit++;
+        return (bit < limit)? bit : limit;
+      }
+      from = (byteIndex + 1) << 3;
+    }
+    return limit;
+  }
+
+  Node* newNode(const uint8_t *key, const PrefixBits_t bitLength){
+    void *new_mem = memoryPool->malloc(sizeof(Node));
+    if(new_mem == NULL)
+      return NULL;
+    Node *node = new(new_mem) Node;
+
+    node->children[0] = NULL;
+    node->children[1] = NULL;
+    node->bitLength = bitLength;
+    node->hasRoute = false;
+
+    uint8_t keyLength = (bitLength + 7) >> 3;
+    if(keyLength > 0)
+      memcpy(node->key, key, keyLength);
+    memset(node->key + keyLength, 0, MaxPrefixLength - keyLength);
+    if(bitLength & 0x07)
+      node->key[keyLength - 1] &= (uint8_t) (0xFF << (8 - (bitLength & 0x07)));
+    return node;
+  }
+
+  void freeNode(Node* const node){
+    delete node;
+    memoryPool->deallocate(sizeof(Node));
+  }
+
+// Remove a routeless node with fewer than two children, splicing in its child (if any).
+  void compact(Node** const link){
+    Node *node = *link;
+    if(node == NULL || node->hasRoute || (node->children[0] != NULL && node->children[1] != NULL))
+      return;
+
+    *link = (node->children[0] != NULL)? node->children[0] : node->children[1];
+    freeNode(node);
+  }
+};
+
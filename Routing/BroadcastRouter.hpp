@@ -12,34 +12,50 @@
 #include <Upacket/MAP/MAP.hpp>
 #include <MapOS/TimedScheduler/TimedScheduler.hpp>
 #include <ATcommon//DataStore/Buffer.hpp>
+#include "SinkRetryQueue.hpp"
 
 // Router which broadcasts received packets to all configured sinks.
-class BroadcastRouter : public MAP::MAPPacketSink {
+class BroadcastRouter : public MAP::MAPPacketSink, public Process {
 private:
 // Max of 255 sinks
   typedef uint8_t Capacity_t;
 
 // Static
-  DataStore::ArrayBuffer<MAPPacketSink*, Capacity_t> sinks;
+  DataStore::ArrayBuffer<MAP::MAPPacketSink*, Capacity_t> sinks;
+
+// Optional retry queues, one per sink (in the order added); sinks beyond retryQueueCount have none.
+  SinkRetryQueue *retryQueues;
+  Capacity_t retryQueueCount;
 
 public:
 
-  BroadcastRouter(MAPPacketSink** const sinks_buffer, const Capacity_t sinks_buffer_capacity)
-  : sinks(sinks_buffer, sinks_buffer_capacity)
+  BroadcastRouter(MAP::MAPPacketSink** const sinks_buffer, const Capacity_t sinks_buffer_capacity)
+  : sinks(sinks_buffer, sinks_buffer_capacity),
+    retryQueues(NULL), retryQueueCount(0)
   { }
 
-  Status::Status_t addSink(MAPPacketSink* const &new_sink){
+  Status::Status_t addSink(MAP::MAPPacketSink* const &new_sink){
     return sinks.sinkData(new_sink);
   }
 
+// Attach (or, with NULL, detach) retry queues for the first count sinks.
+// Packets refused as Busy by those sinks are queued, and retried from process().
+  void set_retryQueues(SinkRetryQueue* const new_retryQueues, const Capacity_t count){
+    retryQueues = new_retryQueues;
+    retryQueueCount = (new_retryQueues == NULL)? 0 : count;
+  }
+
 // Signal/slot style broadcasting.
-  Status::Status_t sinkPacket(MAP::MAPPacket *packet, Offset_t headerOffset){
+  Status::Status_t sinkPacket(MAP::MAPPacket *packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
   // Note packet in use.
     MAP::referencePacket(packet);
 
   // Does not stop after an acceptance.
-    for(MAPPacketSink **packetSink = sinks.front(); packetSink < sinks.back(); packetSink++){
-      (*packetSink)->sinkPacket(packet, headerOffset);
+    for(Capacity_t i = 0; i < sinks.get_size(); i++){
+      if(i < retryQueueCount)
+        retryQueues[i].sinkPacket(sinks.get(i), packet, headerOffset);
+      else
+        sinks.get(i)->sinkPacket(packet, headerOffset);
     }
 
   // Free packet.
@@ -47,5 +63,32 @@ public:
 
     return Status::Status__Good;
   }
+
+// Each sink receives the whole batch at once, rather than a packet at a time.
+  uint16_t sinkPackets(MAP::OffsetMAPPacket* const packets, const uint16_t count){
+  // Note packets in use.
+    for(uint16_t i = 0; i < count; i++)
+      MAP::referencePacket(packets[i].packet);
+
+    for(Capacity_t i = 0; i < sinks.get_size(); i++){
+      if(i < retryQueueCount)
+        retryQueues[i].sinkPackets(sinks.get(i), packets, count);
+      else
+        sinks.get(i)->sinkPackets(packets, count);
+    }
+
+  // Free packets.
+    for(uint16_t i = 0; i < count; i++)
+      MAP::dereferencePacket(packets[i].packet);
+
+    return count;
+  }
+
+// Retry queued packets.
+  Status::Status_t process(){
+    for(Capacity_t i = 0; i < retryQueueCount && i < sinks.get_size(); i++)
+      retryQueues[i].process(sinks.get(i));
+    return Status::Status__Good;
+  }
 };
 
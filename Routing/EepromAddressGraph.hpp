@@ -83,7 +83,7 @@ public:
     DEBUGprint_EEP("EepAG: LdState, edg2Cp: %d\n", edgesToCopy);
 
   // Wipe out existing edges
-    addressGraph->addressEdges.set_size(0);
+    addressGraph->clearEdges();
   // Preset available capacity, to avoid reallocating repeatedly.
 //    if(addressGraph->addressEdges.get_availableCapacity() < edgesToCopy)
     addressGraph->addressEdges.set_availableCapacity(edgesToCopy);
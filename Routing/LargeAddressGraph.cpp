@@ -0,0 +1,300 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include "LargeAddressGraph.hpp"
+
+// Is processed immediately.
+Status::Status_t LargeAddressGraph::sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return Status::Status__Bad;
+
+  MAP::Data_t destAddressType = MAP::get_addressType(*header);
+  MAP::Data_t *destAddressValue = packet->get_destAddress(header);
+  if(destAddressValue == NULL)
+    return Status::Status__Bad;
+
+  // Reference, in case receiver derefs
+  MAP::referencePacket(packet);
+  if((destAddressType == localAddressType) && (*destAddressValue == localAddressValue)){
+    DEBUGprint_LAG("LAG::sP: cmd packet match\n");
+    process_command_packet(packet, headerOffset);
+    // Stop processing, to avoid loops.
+  }else if(edgeIndex != NULL && edgeIndex->is_valid() && (! edgeIndexBusy)){
+    edgeIndexBusy = true;
+    EdgeIndex_t matchCount = edgeIndex->lookup(addressEdges.front(), destAddressType, destAddressValue);
+    for(EdgeIndex_t position = 0; position < matchCount; position++){
+  // Recheck the edge, in case a sink has changed the edges in the meantime.
+      EdgeIndex_t i = edgeIndex->get_match(position);
+      if(i < addressEdges.get_size() && addressEdges.get(i).isMatch(destAddressType, destAddressValue))
+        deliver(packet, headerOffset, addressEdges.get(i));
+    }
+    edgeIndexBusy = false;
+  }else{
+    for(PackedAddressEdge *edge = addressEdges.front(); edge < addressEdges.back(); edge++){
+      if(edge->isMatch(destAddressType, destAddressValue))
+        deliver(packet, headerOffset, *edge);
+    }
+  }
+
+  // Dereference
+  MAP::dereferencePacket(packet);
+  return Status::Status__Good;
+}
+
+void LargeAddressGraph::deliver(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const PackedAddressEdge &edge){
+  uint32_t packetSinkIndex = edge.get_packetSinkIndex();
+  if(packetSinkIndex < packetSinks->get_size())
+    packetSinks->get(packetSinkIndex)->sinkPacket(packet, headerOffset + edge.get_headerOffset());
+}
+
+bool LargeAddressGraph::sinkEdge(const PackedAddressEdge &newEdge){
+// Inactive edges are never stored.
+  if(newEdge.mode == AddressFilter::Mode__Inactive)
+    return true;
+// Check for an existing edge that matches exactly
+  if(findEdge(newEdge) != NullIndex)
+    return true;
+
+  EdgeIndex_t i = allocateEdge();
+  if(i == NullIndex)
+    return false;
+  addressEdges.get(i) = newEdge;
+
+  if(! hashEdge(i)){
+  // Back out
+    addressEdges.get(i).mode = AddressFilter::Mode__Inactive;
+    addressEdges.get(i).sinkAndOffset = freeHead;
+    freeHead = i;
+    return false;
+  }
+  activeEdgeCount++;
+
+  indexEdge(i);
+  return true;
+}
+
+// Take an edge off the free list, or append one.
+LargeAddressGraph::EdgeIndex_t LargeAddressGraph::allocateEdge(){
+  if(freeHead != NullIndex){
+    EdgeIndex_t i = freeHead;
+    freeHead = addressEdges.get(i).sinkAndOffset & PackedAddressEdge::SinkIndexMask;
+    return i;
+  }
+
+  EdgeIndex_t size = addressEdges.get_size();
+  if(size >= maxCapacity)
+    return NullIndex;
+  if(size >= addressEdges.get_capacity()){
+  // Grow geometrically, for O(1) amortised appends.
+    EdgeIndex_t increment = size >> 1;
+    if(increment < MinCapacityIncrement)
+      increment = MinCapacityIncrement;
+    EdgeIndex_t new_capacity = (increment > maxCapacity - size)? maxCapacity : size + increment;
+    if(! addressEdges.set_capacity(new_capacity))
+      return NullIndex;
+  }
+
+  addressEdges.sinkData(PackedAddressEdge());
+  return size;
+}
+
+bool LargeAddressGraph::removeEdge(const PackedAddressEdge &edge){
+  EdgeIndex_t i = findEdge(edge);
+  if(i == NullIndex)
+    return false;
+  removeEdge(i);
+  return true;
+}
+
+void LargeAddressGraph::removeEdge(const EdgeIndex_t i){
+  if(i >= addressEdges.get_size())
+    return;
+  PackedAddressEdge &edge = addressEdges.get(i);
+  if(edge.mode == AddressFilter::Mode__Inactive)
+    return;
+
+  if(edgeIndex != NULL)
+    edgeIndex->remove(addressEdges.front(), i);
+  unhashEdge(i);
+  activeEdgeCount--;
+
+// Mark edge as inactive, and chain it onto the free list.
+  edge.mode = AddressFilter::Mode__Inactive;
+  edge.sinkAndOffset = freeHead;
+  freeHead = i;
+}
+
+void LargeAddressGraph::clearEdges(){
+  addressEdges.set_size(0);
+  freeHead = NullIndex;
+  activeEdgeCount = 0;
+  for(EdgeIndex_t *slot = edgeSlots.front(); slot < edgeSlots.back(); slot++)
+    *slot = NullIndex;
+  if(edgeIndex != NULL)
+    edgeIndex->clear();
+}
+
+LargeAddressGraph::EdgeIndex_t LargeAddressGraph::findEdge(const PackedAddressEdge &edge) const{
+  if(edgeSlots.get_size() == 0)
+    return NullIndex;
+  EdgeIndex_t slotMask = edgeSlots.get_size() - 1;
+
+  for(EdgeIndex_t slot = edge.hash() & slotMask; ; slot = (slot + 1) & slotMask){
+    EdgeIndex_t i = edgeSlots.get(slot);
+    if(i == NullIndex)
+      return NullIndex;
+    if(addressEdges.get(i) == edge)
+      return i;
+  }
+}
+
+bool LargeAddressGraph::hashEdge(const EdgeIndex_t i){
+// Keep the load factor at most one half.
+  if((uint64_t) (activeEdgeCount + 1) * 2 > edgeSlots.get_size()){
+    EdgeIndex_t new_capacity = (edgeSlots.get_size() == 0)? MinSlotCapacity : edgeSlots.get_size() * 2;
+  // Edge i is already set, so is rehashed along with the rest.
+    return resizeSlots(new_capacity);
+  }
+
+  EdgeIndex_t slotMask = edgeSlots.get_size() - 1;
+  EdgeIndex_t slot = addressEdges.get(i).hash() & slotMask;
+  while(edgeSlots.get(slot) != NullIndex)
+    slot = (slot + 1) & slotMask;
+  edgeSlots.get(slot) = i;
+  return true;
+}
+
+// Remove edge i from the hash table (backward-shift deletion, so no tombstones are needed).
+void LargeAddressGraph::unhashEdge(const EdgeIndex_t i){
+  EdgeIndex_t slotMask = edgeSlots.get_size() - 1;
+  EdgeIndex_t slot = addressEdges.get(i).hash() & slotMask;
+  while(edgeSlots.get(slot) != i){
+    if(edgeSlots.get(slot) == NullIndex)
+      return;
+    slot = (slot + 1) & slotMask;
+  }
+
+  EdgeIndex_t hole = slot;
+  for(slot = (slot + 1) & slotMask; edgeSlots.get(slot) != NullIndex; slot = (slot + 1) & slotMask){
+  // Move the entry back into the hole, unless its home lies cyclically within (hole, slot].
+    EdgeIndex_t home = addressEdges.get(edgeSlots.get(slot)).hash() & slotMask;
+    if(((slot - home) & slotMask) >= ((slot - hole) & slotMask)){
+      edgeSlots.get(hole) = edgeSlots.get(slot);
+      hole = slot;
+    }
+  }
+  edgeSlots.get(hole) = NullIndex;
+}
+
+// Resize the hash table, rehashing every active edge.
+bool LargeAddressGraph::resizeSlots(const EdgeIndex_t new_capacity){
+  if(! edgeSlots.set_capacity(new_capacity))
+    return false;
+  edgeSlots.set_size(new_capacity);
+  for(EdgeIndex_t *slot = edgeSlots.front(); slot < edgeSlots.back(); slot++)
+    *slot = NullIndex;
+
+  EdgeIndex_t slotMask = new_capacity - 1;
+  for(EdgeIndex_t i = 0; i < addressEdges.get_size(); i++){
+    if(addressEdges.get(i).mode == AddressFilter::Mode__Inactive)
+      continue;
+    EdgeIndex_t slot = addressEdges.get(i).hash() & slotMask;
+    while(edgeSlots.get(slot) != NullIndex)
+      slot = (slot + 1) & slotMask;
+    edgeSlots.get(slot) = i;
+  }
+  return true;
+}
+
+void LargeAddressGraph::command_add(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr){
+  uint32_t sinkIndex, headerOffset, mode, addressType = 0, addressValue = 0, addressValueMask = 0xFF;
+
+  // Read sinkIndex, headerOffset, mode
+  if(! packet->sourceC78(sinkIndex, data_ptr)) return;
+  data_ptr++;
+  if(! packet->sourceC78(headerOffset, data_ptr)) return;
+  data_ptr++;
+  if(! packet->sourceC78(mode, data_ptr)) return;
+  data_ptr++;
+
+  if(sinkIndex >= PackedAddressEdge::NullLink || headerOffset > 0xFF || mode > 0xFF) return;
+
+  uint8_t opcode = mode & AddressFilter::ModeMask__Opcode;
+  if(opcode != AddressFilter::Mode__MatchAll){
+  // Read addressType
+    if(! packet->sourceC78(addressType, data_ptr)) return;
+    data_ptr++;
+
+    if(opcode != AddressFilter::Mode__AddressType){
+  // Sanity check
+      if(opcode != AddressFilter::Mode__MaskedAddressValue) return;
+  // Read addressValue, addressValueMask
+      if(! packet->sourceC78(addressValue, data_ptr)) return;
+      data_ptr++;
+      if(! packet->sourceC78(addressValueMask, data_ptr)) return;
+    }
+  }
+
+  if(addressType > 0xFF || addressValue > 0xFF || addressValueMask > 0xFF) return;
+
+  DEBUGprint_LAG("LAG: cmd_add: i%lu m%lu\n", (unsigned long) sinkIndex, (unsigned long) mode);
+  sinkEdge(PackedAddressEdge(mode, sinkIndex, addressType, addressValue, addressValueMask, headerOffset));
+}
+
+void LargeAddressGraph::command_remove(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr){
+// Fields, in order: sinkIndex, headerOffset, mode, addressType, addressValue, addressValueMask.
+  static const uint8_t FieldCount = 6;
+  uint32_t fields[FieldCount] = { 0, 0, 0, 0, 0, 0xFF };
+
+  uint8_t fieldsRead = 0;
+  for(; fieldsRead < FieldCount && data_ptr < packet->back(); fieldsRead++){
+    if(! packet->sourceC78(fields[fieldsRead], data_ptr)) return;
+    if(fields[fieldsRead] > ((fieldsRead == 0)? PackedAddressEdge::NullLink - 1 : 0xFF)) return;
+    data_ptr++;
+  }
+  if(fieldsRead == 0) return;
+
+  PackedAddressEdge edge(fields[2], fields[0], fields[3], fields[4], fields[5], fields[1]);
+
+// Fields making up a complete edge, for this mode.
+  uint8_t opcode = edge.mode & AddressFilter::ModeMask__Opcode;
+  uint8_t edgeFields = (opcode == AddressFilter::Mode__MatchAll)? 3 : (opcode == AddressFilter::Mode__AddressType)? 4 : 6;
+  if(fieldsRead >= 3 && fieldsRead == edgeFields){
+    removeEdge(edge);
+    return;
+  }
+
+// Remove everything matching the fields given.
+  for(EdgeIndex_t i = 0; i < addressEdges.get_size(); i++){
+    const PackedAddressEdge &cmpEdge = addressEdges.get(i);
+    if(cmpEdge.mode == AddressFilter::Mode__Inactive) continue;
+    if(cmpEdge.get_packetSinkIndex() != edge.get_packetSinkIndex()) continue;
+    if(fieldsRead > 1 && cmpEdge.get_headerOffset() != edge.get_headerOffset()) continue;
+    if(fieldsRead > 2 && cmpEdge.mode != edge.mode) continue;
+    if(fieldsRead > 3 && cmpEdge.addressType != edge.addressType) continue;
+    if(fieldsRead > 4 && cmpEdge.addressValue != edge.addressValue) continue;
+    if(fieldsRead > 5 && cmpEdge.addressValueMask != edge.addressValueMask) continue;
+    removeEdge(i);
+  }
+}
+
+void LargeAddressGraph::process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *data_ptr = packet->get_data(packet->get_header(headerOffset));
+  if(data_ptr == NULL) return;
+
+  // Read opcode
+  uint32_t opcode;
+  if(! packet->sourceC78(opcode, data_ptr)) return;
+  data_ptr++;
+
+  if(opcode == Opcode__Add)
+    command_add(packet, data_ptr);
+  else if(opcode == Opcode__RemoveAll)
+    clearEdges();
+  else if(opcode == Opcode__Remove)
+    command_remove(packet, data_ptr);
+}
+
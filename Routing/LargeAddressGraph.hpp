@@ -0,0 +1,191 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Large address graph
+//
+// AddressGraph for large route tables: 32-bit edge and sink capacities, edges packed into
+// 8 bytes (eight per 64-byte cache line), and O(1) amortised edge add/remove.
+//
+// Removed edges are tombstoned (Inactive) and chained onto a free list through their sink
+// index field, to be reused by the next added edge. Exact duplicate edges are found through
+// an open-addressing hash table of edge indices, rather than by scanning the table.
+//
+// The command opcodes are those of AddressGraph, with every field C78-encoded. Add takes
+// AddressGraph's fields, but Remove takes the same fields, in the same order, as Add (AddressGraph's
+// Remove has no headerOffset, and takes mode straight after sinkIndex):
+//   Add:       opcode(1) sinkIndex headerOffset mode [addressType [addressValue addressValueMask]]
+//   Remove:    opcode(2) sinkIndex [headerOffset [mode [addressType [addressValue [addressValueMask]]]]]
+//   RemoveAll: opcode(3)
+// A Remove giving every field the equivalent Add would removes that one edge (in O(1));
+// otherwise every edge matching the given fields is removed, by a scan of the whole table.
+//
+// With an edge index attached, each add or remove also walks the edge's index list (kept in edge
+// order) to insert or unlink it, so costs in proportion to the edges sharing that list, rather
+// than O(1).
+
+#pragma once
+
+#ifndef DEBUGprint_LAG
+#define DEBUGprint_LAG(...)
+#endif
+
+#include "AddressGraph.hpp"
+
+// Compact edge layout, with the same modes as AddressFilter.
+struct PackedAddressEdge {
+public:
+  static const uint32_t SinkIndexMask = 0x00FFFFFFUL;
+  static const uint8_t HeaderOffsetShift = 24;
+// Also the largest sink index, and the free-list terminator.
+  static const uint32_t NullLink = SinkIndexMask;
+
+  // Sink index (low 24 bits) and header offset (high 8 bits).
+  // Inactive edges hold the next free edge index instead.
+  uint32_t sinkAndOffset;
+  AddressFilter::Mode_t mode;
+  uint8_t addressType;
+  uint8_t addressValue;
+  uint8_t addressValueMask;
+
+  PackedAddressEdge(AddressFilter::Mode_t new_mode = AddressFilter::Mode__Inactive, uint32_t new_packetSinkIndex = 0,
+                    const uint8_t new_addressType = 0x00, const uint8_t new_addressValue = 0x00, const uint8_t new_addressValueMask = 0xFF,
+                    const MAP::MAPPacket::HeaderOffset_t new_headerOffset = 0)
+  : sinkAndOffset((new_packetSinkIndex & SinkIndexMask) | ((uint32_t) new_headerOffset << HeaderOffsetShift)),
+    mode(new_mode), addressType(new_addressType), addressValue(new_addressValue), addressValueMask(new_addressValueMask)
+  { }
+
+  inline uint32_t get_packetSinkIndex() const{
+    return sinkAndOffset & SinkIndexMask;
+  }
+  inline MAP::MAPPacket::HeaderOffset_t get_headerOffset() const{
+    return sinkAndOffset >> HeaderOffsetShift;
+  }
+
+  inline bool isMatch(const uint8_t cmp_addressType, uint8_t* cmp_addressValue) const{
+    return AddressFilter::isMatch(mode, addressType, addressValue, addressValueMask, cmp_addressType, cmp_addressValue);
+  }
+
+  bool operator==(const PackedAddressEdge &cmpEdge) const{
+    return (sinkAndOffset == cmpEdge.sinkAndOffset) && (mode == cmpEdge.mode) && (addressType == cmpEdge.addressType)
+           && (addressValue == cmpEdge.addressValue) && (addressValueMask == cmpEdge.addressValueMask);
+  }
+
+  uint32_t hash() const{
+    uint64_t key = ((uint64_t) sinkAndOffset << 32) | ((uint32_t) mode << 24) | ((uint32_t) addressType << 16)
+                   | ((uint32_t) addressValue << 8) | addressValueMask;
+  // 64-bit finalizer (MurmurHash3)
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t) key;
+  }
+};
+
+class LargeAddressGraph : public MAP::MAPPacketSink {
+public:
+  typedef uint32_t EdgeIndex_t;
+  typedef AddressEdgeIndex<EdgeIndex_t, PackedAddressEdge> EdgeIndex;
+  typedef DataStore::ArrayBuffer<MAPPacketSink*, uint32_t> PacketSinks_t;
+
+  static const EdgeIndex_t NullIndex = PackedAddressEdge::NullLink;
+
+private:
+  uint8_t localAddressType;
+  uint8_t localAddressValue;
+
+  PacketSinks_t *packetSinks;
+  DataStore::DynamicArrayBuffer<PackedAddressEdge, EdgeIndex_t> addressEdges;
+
+// Most recently removed edge, chaining through the other removed edges.
+  EdgeIndex_t freeHead;
+  EdgeIndex_t activeEdgeCount;
+
+// Open-addressing (linear probing) hash table of active edge indices.
+// Capacity is a power of two, kept at least twice the active edge count.
+  DataStore::DynamicArrayBuffer<EdgeIndex_t, EdgeIndex_t> edgeSlots;
+
+// Optional compiled lookup structure; NULL to scan the edges linearly.
+  EdgeIndex *edgeIndex;
+  bool edgeIndexBusy;
+
+  EdgeIndex_t maxCapacity;
+
+  static const EdgeIndex_t DefaultInitialCapacity = 0;
+  static const EdgeIndex_t MinCapacityIncrement = 16;
+  static const EdgeIndex_t MinSlotCapacity = 16;
+
+  typedef uint8_t Opcode_t;
+  static const Opcode_t Opcode__Add = 1;
+  static const Opcode_t Opcode__Remove = 2;
+  static const Opcode_t Opcode__RemoveAll = 3;
+
+public:
+
+// HEAP
+  LargeAddressGraph(uint8_t new_localAddressType, uint8_t new_localAddressValue,
+                    PacketSinks_t *new_packetSinks, MemoryPool *new_memoryPool,
+                    EdgeIndex_t initial_capacity = DefaultInitialCapacity, EdgeIndex_t new_maxCapacity = NullIndex)
+  : localAddressType(new_localAddressType), localAddressValue(new_localAddressValue),
+    packetSinks(new_packetSinks),
+    addressEdges(new_memoryPool, initial_capacity),
+    freeHead(NullIndex), activeEdgeCount(0),
+    edgeSlots(new_memoryPool),
+    edgeIndex(NULL), edgeIndexBusy(false),
+    maxCapacity((new_maxCapacity > NullIndex)? NullIndex : new_maxCapacity)
+  {
+    assert(new_packetSinks != NULL);
+    assert(new_memoryPool != NULL);
+  }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+  inline EdgeIndex_t get_activeEdgeCount() const{
+    return activeEdgeCount;
+  }
+
+// Attach (or, with NULL, detach) an edge index, as AddressGraph::set_edgeIndex.
+  void set_edgeIndex(EdgeIndex* const new_edgeIndex){
+    edgeIndex = new_edgeIndex;
+    if(edgeIndex != NULL)
+      edgeIndex->rebuild(addressEdges.front(), addressEdges.get_size());
+  }
+
+  // Note that edge is copied by value.
+  // Sinks with indices above PackedAddressEdge::NullLink can't be addressed.
+  bool sinkEdge(const PackedAddressEdge &newEdge);
+
+  // Remove the edge exactly equal to edge, if any.
+  bool removeEdge(const PackedAddressEdge &edge);
+  // Remove the edge at index i, if active.
+  void removeEdge(const EdgeIndex_t i);
+
+  void clearEdges();
+
+  void process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+  void command_add(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr);
+  void command_remove(MAP::MAPPacket* const packet, MAP::Data_t *data_ptr);
+
+private:
+// Index of the active edge equal to edge, or NullIndex.
+  EdgeIndex_t findEdge(const PackedAddressEdge &edge) const;
+  bool hashEdge(const EdgeIndex_t i);
+  void unhashEdge(const EdgeIndex_t i);
+  bool resizeSlots(const EdgeIndex_t new_capacity);
+  EdgeIndex_t allocateEdge();
+
+  void indexEdge(const EdgeIndex_t i){
+    if(edgeIndex == NULL)
+      return;
+    if(! edgeIndex->is_valid())
+      edgeIndex->rebuild(addressEdges.front(), addressEdges.get_size());
+    else
+      edgeIndex->insert(addressEdges.front(), i);
+  }
+
+  void deliver(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset, const PackedAddressEdge &edge);
+};
+
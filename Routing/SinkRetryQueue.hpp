@@ -0,0 +1,123 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Sink retry queue
+//
+// Bounded queue of packets refused (Busy) by one downstream sink of a router, to be retried
+// from the router's process(). Once a packet is queued, later packets for the same sink are
+// queued behind it, so the sink still receives its packets in order.
+//
+// When the queue is full, either the new packet (DropPolicy__Newest) or the oldest queued
+// packet (DropPolicy__Oldest) is dropped, and counted. (The oldest packet is never dropped while
+// it is being retried, e.g. if the sink routes a packet back in; the new one is dropped instead.)
+
+#pragma once
+
+#include <Upacket/MAP/MAP.hpp>
+
+class SinkRetryQueue {
+public:
+  typedef uint8_t Capacity_t;
+
+  typedef uint8_t DropPolicy_t;
+  static const DropPolicy_t DropPolicy__Newest = 0;
+  static const DropPolicy_t DropPolicy__Oldest = 1;
+
+private:
+  DataStore::RingBuffer<MAP::OffsetMAPPacket, Capacity_t> packetBuffer;
+  DropPolicy_t dropPolicy;
+  uint32_t dropCount;
+// The oldest packet is being passed to the sink, by process().
+  bool retrying;
+
+public:
+
+  SinkRetryQueue(MAP::OffsetMAPPacket* raw_packet_buffer, Capacity_t buffer_capacity, DropPolicy_t new_dropPolicy = DropPolicy__Newest)
+  : packetBuffer(raw_packet_buffer, buffer_capacity),
+    dropPolicy(new_dropPolicy), dropCount(0), retrying(false)
+  {
+    assert(buffer_capacity > 0);
+  }
+
+  ~SinkRetryQueue(){
+    clear();
+  }
+
+  inline bool is_empty() const{
+    return packetBuffer.is_empty();
+  }
+  inline Capacity_t get_size() const{
+    return packetBuffer.get_size();
+  }
+
+// Packets dropped since the last reset.
+  inline uint32_t get_dropCount() const{
+    return dropCount;
+  }
+  void resetDropCount(){
+    dropCount = 0;
+  }
+
+// Pass a packet to the sink, or queue it if the sink is busy (or already has packets queued).
+  void sinkPacket(MAP::MAPPacketSink* const packetSink, MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+    if(packetBuffer.is_empty() && packetSink->sinkPacket(packet, headerOffset) != Status::Status__Busy)
+      return;
+    enqueue(packet, headerOffset);
+  }
+
+// Pass a batch to the sink, queueing whatever it doesn't accept.
+  void sinkPackets(MAP::MAPPacketSink* const packetSink, MAP::OffsetMAPPacket* const packets, const uint16_t count){
+    uint16_t sunk = 0;
+    if(packetBuffer.is_empty())
+      sunk = packetSink->sinkPackets(packets, count);
+    for(; sunk < count; sunk++)
+      enqueue(packets[sunk].packet, packets[sunk].headerOffset);
+  }
+
+// Retry queued packets, in order, until the sink is busy again.
+// Returns true if the queue was emptied.
+  bool process(MAP::MAPPacketSink* const packetSink){
+    while(! packetBuffer.is_empty()){
+    // Temporarily pop a packet. If the sink does not return Busy, permanently remove it.
+      MAP::OffsetMAPPacket offsetPacket = packetBuffer.get_in_place();
+      retrying = true;
+      Status::Status_t sinkStatus = packetSink->sinkPacket(offsetPacket.packet, offsetPacket.headerOffset);
+      retrying = false;
+      if(sinkStatus == Status::Status__Busy)
+        return false;
+      packetBuffer.increment_read_position();
+    // Dereference the packet (which we referenced upon queueing).
+      MAP::dereferencePacket(offsetPacket.packet);
+    }
+    return true;
+  }
+
+// Drop every queued packet (without counting them).
+  void clear(){
+    while(! packetBuffer.is_empty())
+      dropOldest();
+  }
+
+private:
+  void enqueue(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+    if(packetBuffer.is_full()){
+      dropCount++;
+      if(dropPolicy == DropPolicy__Newest || retrying)
+        return;
+      dropOldest();
+    }
+
+  // Reference the packet, until it is retried successfully (or dropped).
+    MAP::referencePacket(packet);
+    packetBuffer.sinkData(MAP::OffsetMAPPacket(packet, headerOffset));
+  }
+
+  void dropOldest(){
+    MAP::MAPPacket *packet = packetBuffer.get_in_place().packet;
+    packetBuffer.increment_read_position();
+    MAP::dereferencePacket(packet);
+  }
+};
+
@@ -0,0 +1,364 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include "TopicRouter.hpp"
+
+// Is processed immediately.
+Status::Status_t TopicRouter::sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return Status::Status__Bad;
+
+  MAP::Data_t destAddressType = MAP::get_addressType(*header);
+  MAP::Data_t *destAddressValue = packet->get_destAddress(header);
+  if(destAddressValue == NULL)
+    return Status::Status__Bad;
+
+  // Reference, in case receiver derefs
+  MAP::referencePacket(packet);
+  if((destAddressType == localAddressType) && (*destAddressValue == localAddressValue)){
+    DEBUGprint_TOPIC("TR::sP: cmd packet match\n");
+    process_command_packet(packet, headerOffset);
+  }else if(destAddressType == MAP::AddressType__Topic){
+    TopicId_t topicId;
+    if(packet->sourceC78(topicId, destAddressValue))
+      publish(topicId, packet, headerOffset);
+  }
+
+  // Dereference
+  MAP::dereferencePacket(packet);
+  return Status::Status__Good;
+}
+
+void TopicRouter::publish(const TopicId_t topicId, MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  Topic *topic = findTopic(topicId);
+  if(topic == NULL)
+    return;
+
+  MAP::referencePacket(packet);
+  publishDepth++;
+// The subscriber array may be grown (and moved) by a sink, so is re-read for each subscriber.
+// Subscribers removed meanwhile stay in place, marked, so none are skipped.
+  for(Capacity_t position = 0; position < topic->subscribers.get_size(); position++){
+    TopicSubscriber subscriber = topic->subscribers.get(position);
+    if(subscriber.packetSinkIndex < packetSinks->get_size())
+      packetSinks->get(subscriber.packetSinkIndex)->sinkPacket(packet, headerOffset + subscriber.headerOffset);
+  }
+  publishDepth--;
+
+  if(publishDepth == 0 && compactPending)
+    compactTopics();
+  MAP::dereferencePacket(packet);
+}
+
+bool TopicRouter::subscribe(const TopicId_t topicId, const uint32_t packetSinkIndex, const MAP::MAPPacket::HeaderOffset_t headerOffset){
+// Reserved to mark removed subscribers.
+  if(packetSinkIndex == RemovedSinkIndex)
+    return false;
+
+  SubscriptionSlot *slot = findSubscription(topicId, packetSinkIndex);
+  if(slot != NULL){
+    findTopic(topicId)->subscribers.get(slot->position).headerOffset = headerOffset;
+    return true;
+  }
+
+// Keep the subscription table at most half full.
+  if((uint64_t) (subscriptionCount + 1) * 2 > subscriptionSlots.get_size()){
+    Capacity_t new_capacity = (subscriptionSlots.get_size() == 0)? MinSlotCapacity : subscriptionSlots.get_size() * 2;
+    if(new_capacity == 0 || ! resizeSubscriptionSlots(new_capacity))
+      return false;
+  }
+
+  Topic *topic = findTopic(topicId);
+  if(topic == NULL){
+    topic = newTopic(topicId);
+    if(topic == NULL)
+      return false;
+  }
+
+  if(! reserve(topic->subscribers)){
+  // Back out
+    if(topic->subscribers.get_size() == 0){
+      if(publishDepth == 0)
+        freeTopic(topic);
+      else
+        compactPending = true;
+    }
+    return false;
+  }
+
+  hashSubscription(topicId, packetSinkIndex, topic->subscribers.get_size());
+  topic->subscribers.sinkData(TopicSubscriber(packetSinkIndex, headerOffset));
+  subscriptionCount++;
+  return true;
+}
+
+bool TopicRouter::unsubscribe(const TopicId_t topicId, const uint32_t packetSinkIndex){
+  SubscriptionSlot *slot = findSubscription(topicId, packetSinkIndex);
+  if(slot == NULL)
+    return false;
+
+  Topic *topic = findTopic(topicId);
+  Capacity_t position = slot->position;
+  unhashSubscription(slot);
+  subscriptionCount--;
+
+// A publish may be walking the subscribers; leave the gap, for compactTopics.
+  if(publishDepth > 0){
+    topic->subscribers.get(position).packetSinkIndex = RemovedSinkIndex;
+    topic->removedCount++;
+    compactPending = true;
+    return true;
+  }
+
+// Move the last subscriber into the gap.
+  Capacity_t last = topic->subscribers.get_size() - 1;
+  if(position != last){
+    TopicSubscriber &moved = topic->subscribers.get(position);
+    moved = topic->subscribers.get(last);
+    findSubscription(topicId, moved.packetSinkIndex)->position = position;
+  }
+  topic->subscribers.set_size(last);
+
+  if(last == 0)
+    freeTopic(topic);
+  return true;
+}
+
+void TopicRouter::clear(){
+  for(SubscriptionSlot *slot = subscriptionSlots.front(); slot < subscriptionSlots.back(); slot++)
+    slot->position = NullPosition;
+  subscriptionCount = 0;
+
+// Topics may still be in use by a publish, in which case they are only emptied.
+  if(publishDepth > 0){
+    for(Topic **topic = topics.front(); topic < topics.back(); topic++){
+      (*topic)->subscribers.set_size(0);
+      (*topic)->removedCount = 0;
+    }
+    compactPending = true;
+    return;
+  }
+  compactPending = false;
+
+  for(Topic **topic = topics.front(); topic < topics.back(); topic++){
+    delete *topic;
+    memoryPool->deallocate(sizeof(Topic));
+  }
+  topics.set_size(0);
+  for(Topic **slot = topicSlots.front(); slot < topicSlots.back(); slot++)
+    *slot = NULL;
+}
+
+TopicRouter::Topic* TopicRouter::findTopic(const TopicId_t topicId) const{
+  if(topicSlots.get_size() == 0)
+    return NULL;
+  Capacity_t slotMask = topicSlots.get_size() - 1;
+
+  for(Capacity_t slot = hash(topicId) & slotMask; ; slot = (slot + 1) & slotMask){
+    Topic *topic = topicSlots.get(slot);
+    if(topic == NULL || topic->topicId == topicId)
+      return topic;
+  }
+}
+
+TopicRouter::Topic* TopicRouter::newTopic(const TopicId_t topicId){
+// Keep the topic table at most half full.
+  if((uint64_t) (topics.get_size() + 1) * 2 > topicSlots.get_size()){
+    Capacity_t new_capacity = (topicSlots.get_size() == 0)? MinSlotCapacity : topicSlots.get_size() * 2;
+    if(new_capacity == 0 || ! resizeTopicSlots(new_capacity))
+      return NULL;
+  }
+  if(! reserve(topics))
+    return NULL;
+
+  void *new_mem = memoryPool->malloc(sizeof(Topic));
+  if(new_mem == NULL)
+    return NULL;
+  Topic *topic = new(new_mem) Topic(topicId, topics.get_size(), memoryPool);
+
+  topics.sinkData(topic);
+  hashTopic(topic);
+  return topic;
+}
+
+void TopicRouter::freeTopic(Topic* const topic){
+// Remove from the hash table (backward-shift deletion, so no tombstones are needed).
+  Capacity_t slotMask = topicSlots.get_size() - 1;
+  Capacity_t slot = hash(topic->topicId) & slotMask;
+  while(topicSlots.get(slot) != topic)
+    slot = (slot + 1) & slotMask;
+
+  Capacity_t hole = slot;
+  for(slot = (slot + 1) & slotMask; topicSlots.get(slot) != NULL; slot = (slot + 1) & slotMask){
+  // Move the entry back into the hole, unless its home lies cyclically within (hole, slot].
+    Capacity_t home = hash(topicSlots.get(slot)->topicId) & slotMask;
+    if(((slot - home) & slotMask) >= ((slot - hole) & slotMask)){
+      topicSlots.get(hole) = topicSlots.get(slot);
+      hole = slot;
+    }
+  }
+  topicSlots.get(hole) = NULL;
+
+// Move the last topic into the gap.
+  Topic *moved = topics.get(topics.get_size() - 1);
+  moved->index = topic->index;
+  topics.get(topic->index) = moved;
+  topics.set_size(topics.get_size() - 1);
+
+  delete topic;
+  memoryPool->deallocate(sizeof(Topic));
+}
+
+// Drop the subscribers removed during a publish (keeping the order of the rest), and free the
+// topics left empty.
+void TopicRouter::compactTopics(){
+  compactPending = false;
+
+  Capacity_t index = 0;
+  while(index < topics.get_size()){
+    Topic *topic = topics.get(index);
+    if(topic->removedCount > 0){
+      Capacity_t kept = 0;
+      for(Capacity_t position = 0; position < topic->subscribers.get_size(); position++){
+        TopicSubscriber &subscriber = topic->subscribers.get(position);
+        if(subscriber.packetSinkIndex == RemovedSinkIndex)
+          continue;
+        if(kept != position){
+          topic->subscribers.get(kept) = subscriber;
+          findSubscription(topic->topicId, subscriber.packetSinkIndex)->position = kept;
+        }
+        kept++;
+      }
+      topic->subscribers.set_size(kept);
+      topic->removedCount = 0;
+    }
+
+  // freeTopic moves the last topic into this index.
+    if(topic->subscribers.get_size() == 0)
+      freeTopic(topic);
+    else
+      index++;
+  }
+}
+
+void TopicRouter::hashTopic(Topic* const topic){
+  Capacity_t slotMask = topicSlots.get_size() - 1;
+  Capacity_t slot = hash(topic->topicId) & slotMask;
+  while(topicSlots.get(slot) != NULL)
+    slot = (slot + 1) & slotMask;
+  topicSlots.get(slot) = topic;
+}
+
+// Resize the topic table, rehashing every topic.
+bool TopicRouter::resizeTopicSlots(const Capacity_t new_capacity){
+  if(! topicSlots.set_capacity(new_capacity))
+    return false;
+  topicSlots.set_size(new_capacity);
+  for(Topic **slot = topicSlots.front(); slot < topicSlots.back(); slot++)
+    *slot = NULL;
+
+  for(Topic **topic = topics.front(); topic < topics.back(); topic++)
+    hashTopic(*topic);
+  return true;
+}
+
+TopicRouter::SubscriptionSlot* TopicRouter::findSubscription(const TopicId_t topicId, const uint32_t packetSinkIndex) const{
+  if(subscriptionSlots.get_size() == 0)
+    return NULL;
+  Capacity_t slotMask = subscriptionSlots.get_size() - 1;
+
+  for(Capacity_t slot = subscriptionHash(topicId, packetSinkIndex) & slotMask; ; slot = (slot + 1) & slotMask){
+    SubscriptionSlot *subscription = &subscriptionSlots.get(slot);
+    if(subscription->position == NullPosition)
+      return NULL;
+    if(subscription->topicId == topicId && subscription->packetSinkIndex == packetSinkIndex)
+      return subscription;
+  }
+}
+
+void TopicRouter::hashSubscription(const TopicId_t topicId, const uint32_t packetSinkIndex, const Capacity_t position){
+  Capacity_t slotMask = subscriptionSlots.get_size() - 1;
+  Capacity_t slot = subscriptionHash(topicId, packetSinkIndex) & slotMask;
+  while(subscriptionSlots.get(slot).position != NullPosition)
+    slot = (slot + 1) & slotMask;
+
+  SubscriptionSlot &subscription = subscriptionSlots.get(slot);
+  subscription.topicId = topicId;
+  subscription.packetSinkIndex = packetSinkIndex;
+  subscription.position = position;
+}
+
+// Backward-shift deletion, as freeTopic.
+void TopicRouter::unhashSubscription(SubscriptionSlot* const subscription){
+  Capacity_t slotMask = subscriptionSlots.get_size() - 1;
+  Capacity_t hole = subscription - subscriptionSlots.front();
+  for(Capacity_t slot = (hole + 1) & slotMask; subscriptionSlots.get(slot).position != NullPosition; slot = (slot + 1) & slotMask){
+    const SubscriptionSlot &entry = subscriptionSlots.get(slot);
+    Capacity_t home = subscriptionHash(entry.topicId, entry.packetSinkIndex) & slotMask;
+    if(((slot - home) & slotMask) >= ((slot - hole) & slotMask)){
+      subscriptionSlots.get(hole) = entry;
+      hole = slot;
+    }
+  }
+  subscriptionSlots.get(hole).position = NullPosition;
+}
+
+// Resize the subscription table, rehashing every subscriber of every topic.
+bool TopicRouter::resizeSubscriptionSlots(const Capacity_t new_capacity){
+  if(! subscriptionSlots.set_capacity(new_capacity))
+    return false;
+  subscriptionSlots.set_size(new_capacity);
+  for(SubscriptionSlot *slot = subscriptionSlots.front(); slot < subscriptionSlots.back(); slot++)
+    slot->position = NullPosition;
+
+  for(Topic **topic = topics.front(); topic < topics.back(); topic++){
+    for(Capacity_t position = 0; position < (*topic)->subscribers.get_size(); position++){
+      uint32_t packetSinkIndex = (*topic)->subscribers.get(position).packetSinkIndex;
+    // Subscribers removed during a publish are no longer subscribed.
+      if(packetSinkIndex != RemovedSinkIndex)
+        hashSubscription((*topic)->topicId, packetSinkIndex, position);
+    }
+  }
+  return true;
+}
+
+void TopicRouter::process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *data_ptr = packet->get_data(packet->get_header(headerOffset));
+  if(data_ptr == NULL) return;
+
+  // Read opcode
+  uint32_t opcode;
+  if(! packet->sourceC78(opcode, data_ptr)) return;
+  data_ptr++;
+
+  if(opcode == Opcode__RemoveAll){
+    clear();
+    return;
+  }
+  if(opcode != Opcode__Subscribe && opcode != Opcode__Unsubscribe) return;
+
+  // Read topicId, sinkIndex
+  uint32_t topicId, sinkIndex, subscriberOffset = 0;
+  if(! packet->sourceC78(topicId, data_ptr)) return;
+  data_ptr++;
+  if(! packet->sourceC78(sinkIndex, data_ptr)) return;
+  data_ptr++;
+  if(sinkIndex == RemovedSinkIndex) return;
+
+  if(opcode == Opcode__Unsubscribe){
+    DEBUGprint_TOPIC("TR: cmd_unsub: t%lu i%lu\n", (unsigned long) topicId, (unsigned long) sinkIndex);
+    unsubscribe(topicId, sinkIndex);
+    return;
+  }
+
+  // Optional headerOffset
+  if(data_ptr < packet->back() && ! packet->sourceC78(subscriberOffset, data_ptr)) return;
+  if(subscriberOffset > 0xFF) return;
+
+  DEBUGprint_TOPIC("TR: cmd_sub: t%lu i%lu\n", (unsigned long) topicId, (unsigned long) sinkIndex);
+  subscribe(topicId, sinkIndex, subscriberOffset);
+}
+
@@ -0,0 +1,182 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Topic router
+//
+// Multicast delivery for AddressType__Topic packets. The topic ID is the whole C78-decoded
+// dest address; each topic keeps a compact array of its subscribers, which a published packet
+// is fanned out to under a single packet reference.
+//
+// Topics are found through an open-addressing hash table of topic ID. A second table maps each
+// (topic ID, sink index) subscription to its position in the topic's subscriber array, so
+// that a subscriber is removed in O(1) by moving the topic's last subscriber into its place.
+// (During a publish, subscribers are instead marked removed, and the topics compacted once the
+// outermost publish is done, so that a fan-out in progress neither skips nor repeats a sink.)
+// Both tables are kept at most half full, and never shrink.
+//
+// Command packets (sent to the local address) are, with every field C78-encoded:
+//   Subscribe:    opcode(1) topicId sinkIndex [headerOffset]
+//   Unsubscribe:  opcode(2) topicId sinkIndex
+//   RemoveAll:    opcode(3)
+
+#pragma once
+
+#ifndef DEBUGprint_TOPIC
+#define DEBUGprint_TOPIC(...)
+#endif
+
+#include <Upacket/MAP/MAP.hpp>
+
+// A sink subscribed to a topic.
+struct TopicSubscriber {
+  uint32_t packetSinkIndex;
+  MAP::MAPPacket::HeaderOffset_t headerOffset;
+
+  TopicSubscriber(uint32_t new_packetSinkIndex = 0, MAP::MAPPacket::HeaderOffset_t new_headerOffset = 0)
+  : packetSinkIndex(new_packetSinkIndex), headerOffset(new_headerOffset)
+  { }
+};
+
+class TopicRouter : public MAP::MAPPacketSink {
+public:
+  typedef uint32_t TopicId_t;
+  typedef uint32_t Capacity_t;
+  typedef DataStore::ArrayBuffer<MAPPacketSink*, uint32_t> PacketSinks_t;
+
+private:
+  struct Topic {
+    TopicId_t topicId;
+  // Position in the topics array.
+    Capacity_t index;
+    DataStore::DynamicArrayBuffer<TopicSubscriber, Capacity_t> subscribers;
+  // Subscribers marked removed (RemovedSinkIndex), pending compaction.
+    Capacity_t removedCount;
+
+    Topic(const TopicId_t new_topicId, const Capacity_t new_index, MemoryPool* const new_memoryPool)
+    : topicId(new_topicId), index(new_index), subscribers(new_memoryPool), removedCount(0)
+    { }
+  };
+
+// Position of a subscription in its topic's subscriber array.
+  struct SubscriptionSlot {
+    TopicId_t topicId;
+    uint32_t packetSinkIndex;
+  // NullPosition if the slot is empty.
+    Capacity_t position;
+  };
+  static const Capacity_t NullPosition = ~(Capacity_t) 0;
+// Sink index of a subscriber removed during a publish.
+  static const uint32_t RemovedSinkIndex = ~(uint32_t) 0;
+
+  uint8_t localAddressType;
+  uint8_t localAddressValue;
+
+  PacketSinks_t *packetSinks;
+  MemoryPool *memoryPool;
+
+// Every topic, in no particular order. The hash tables are rebuilt from this when they grow.
+  DataStore::DynamicArrayBuffer<Topic*, Capacity_t> topics;
+
+// Capacities are powers of two.
+  DataStore::DynamicArrayBuffer<Topic*, Capacity_t> topicSlots;
+  DataStore::DynamicArrayBuffer<SubscriptionSlot, Capacity_t> subscriptionSlots;
+
+  Capacity_t subscriptionCount;
+
+// Nesting depth of publishes in progress (sinks may publish, or change subscriptions).
+  uint8_t publishDepth;
+// Subscribers were removed (or topics emptied) during a publish.
+  bool compactPending;
+
+  static const Capacity_t MinSlotCapacity = 16;
+  static const Capacity_t MinCapacityIncrement = 4;
+
+  typedef uint8_t Opcode_t;
+  static const Opcode_t Opcode__Subscribe = 1;
+  static const Opcode_t Opcode__Unsubscribe = 2;
+  static const Opcode_t Opcode__RemoveAll = 3;
+
+public:
+
+// HEAP
+  TopicRouter(uint8_t new_localAddressType, uint8_t new_localAddressValue,
+              PacketSinks_t *new_packetSinks, MemoryPool *new_memoryPool)
+  : localAddressType(new_localAddressType), localAddressValue(new_localAddressValue),
+    packetSinks(new_packetSinks), memoryPool(new_memoryPool),
+    topics(new_memoryPool), topicSlots(new_memoryPool), subscriptionSlots(new_memoryPool),
+    subscriptionCount(0),
+    publishDepth(0), compactPending(false)
+  {
+    assert(new_packetSinks != NULL);
+    assert(new_memoryPool != NULL);
+  }
+
+  ~TopicRouter(){
+    clear();
+  }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+  inline Capacity_t get_topicCount() const{
+    return topics.get_size();
+  }
+  inline Capacity_t get_subscriptionCount() const{
+    return subscriptionCount;
+  }
+  Capacity_t get_subscriberCount(const TopicId_t topicId) const{
+    Topic *topic = findTopic(topicId);
+    return (topic == NULL)? 0 : topic->subscribers.get_size() - topic->removedCount;
+  }
+
+// Subscribe a sink to a topic, or update the header offset of an existing subscription.
+// Sink index ~0 is reserved, and refused.
+  bool subscribe(const TopicId_t topicId, const uint32_t packetSinkIndex, const MAP::MAPPacket::HeaderOffset_t headerOffset = 0);
+// Returns false if the sink was not subscribed.
+  bool unsubscribe(const TopicId_t topicId, const uint32_t packetSinkIndex);
+// Deliver a packet to every subscriber of a topic.
+  void publish(const TopicId_t topicId, MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+  void clear();
+
+  void process_command_packet(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+private:
+// 64-bit finalizer (MurmurHash3)
+  static inline uint32_t hash(uint64_t key){
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return (uint32_t) key;
+  }
+  static inline uint32_t subscriptionHash(const TopicId_t topicId, const uint32_t packetSinkIndex){
+    return hash(((uint64_t) topicId << 32) | packetSinkIndex);
+  }
+
+  Topic* findTopic(const TopicId_t topicId) const;
+  Topic* newTopic(const TopicId_t topicId);
+  void freeTopic(Topic* const topic);
+  void compactTopics();
+  void hashTopic(Topic* const topic);
+  bool resizeTopicSlots(const Capacity_t new_capacity);
+
+  SubscriptionSlot* findSubscription(const TopicId_t topicId, const uint32_t packetSinkIndex) const;
+  void hashSubscription(const TopicId_t topicId, const uint32_t packetSinkIndex, const Capacity_t position);
+  void unhashSubscription(SubscriptionSlot* const slot);
+  bool resizeSubscriptionSlots(const Capacity_t new_capacity);
+
+// Make room to append one more element, growing geometrically for O(1) amortised appends.
+  template <typename Data_t>
+  static bool reserve(DataStore::DynamicArrayBuffer<Data_t, Capacity_t> &buffer){
+    Capacity_t size = buffer.get_size();
+    if(size < buffer.get_capacity())
+      return true;
+    Capacity_t increment = size >> 1;
+    if(increment < MinCapacityIncrement)
+      increment = MinCapacityIncrement;
+    return buffer.set_capacity(size + increment);
+  }
+};
+
@@ -0,0 +1 @@
+../../AddressClassifier.hpp
\ No newline at end of file
@@ -1,3 +1,17 @@
 #include <ATcommon/arch/avr/avr.hpp>
+
+// Leave out the optional lookup structures (see AddressGraph.hpp), to save code space.
+#ifndef ADDRESS_GRAPH_USE_EDGE_INDEX
+#define ADDRESS_GRAPH_USE_EDGE_INDEX 0
+#endif
+#ifndef ADDRESS_GRAPH_USE_PREFIX_ROUTES
+#define ADDRESS_GRAPH_USE_PREFIX_ROUTES 0
+#endif
+#ifndef ADDRESS_GRAPH_USE_FLOW_CACHE
+#define ADDRESS_GRAPH_USE_FLOW_CACHE 0
+#endif
+#ifndef ADDRESS_GRAPH_USE_CLASSIFIER
+#define ADDRESS_GRAPH_USE_CLASSIFIER 0
+#endif
 #include "../../AddressGraph.hpp"
 
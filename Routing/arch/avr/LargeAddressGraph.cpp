@@ -0,0 +1 @@
+../../LargeAddressGraph.cpp
\ No newline at end of file
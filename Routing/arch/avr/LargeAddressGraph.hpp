@@ -0,0 +1 @@
+../../LargeAddressGraph.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../SinkRetryQueue.hpp
\ No newline at end of file
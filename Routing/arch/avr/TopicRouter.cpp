@@ -0,0 +1 @@
+../../TopicRouter.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../TopicRouter.hpp
\ No newline at end of file
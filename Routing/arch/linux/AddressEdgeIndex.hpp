@@ -0,0 +1 @@
+../../AddressEdgeIndex.hpp
\ No newline at end of file
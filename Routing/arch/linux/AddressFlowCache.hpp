@@ -0,0 +1 @@
+../../AddressFlowCache.hpp
\ No newline at end of file
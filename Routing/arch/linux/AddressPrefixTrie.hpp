@@ -0,0 +1 @@
+../../AddressPrefixTrie.hpp
\ No newline at end of file
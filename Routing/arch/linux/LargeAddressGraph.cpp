@@ -0,0 +1,3 @@
+#include <ATcommon/arch/linux/linux.hpp>
+#include "../../LargeAddressGraph.cpp"
+
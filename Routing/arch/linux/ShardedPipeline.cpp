@@ -0,0 +1,244 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include "ShardedPipeline.hpp"
+
+/* ShardDispatcher */
+
+ShardIndex_t ShardDispatcher::selectShard(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return defaultShard;
+
+  MAP::DataView srcAddress = packet->get_srcAddressView(header);
+  if(! srcAddress.is_valid())
+    return defaultShard;
+
+// Mix in the address type, so equal values of different types spread independently.
+  return scaleHash(srcAddress.hash() ^ (MAP::get_addressType(*header) * 0x9e3779b9UL), shards.get_size());
+}
+
+bool ShardDispatcher::is_command(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset){
+  if(! commandAddressSet)
+    return false;
+  MAP::Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return false;
+  MAP::Data_t *destAddressValue = packet->get_destAddress(header);
+  return (destAddressValue != NULL && MAP::get_addressType(*header) == commandAddressType && *destAddressValue == commandAddressValue);
+}
+
+Status::Status_t ShardDispatcher::broadcastCommand(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset){
+// Commands are rare, and sinking to an ingress never blocks, so a spin lock will do.
+  while(__atomic_test_and_set(&commandLock, __ATOMIC_ACQUIRE))
+    ;
+
+  Status::Status_t status = Status::Status__Good;
+  if(pendingCommand != NULL && pendingCommand != packet){
+    status = Status::Status__Busy;
+  }else{
+    if(pendingCommand == NULL)
+      memset(commandShards, 0, sizeof(commandShards));
+
+    for(ShardIndex_t shard = 0; shard < shards.get_size(); shard++){
+      uint32_t bit = (uint32_t) 1 << (shard % 32);
+      if(commandShards[shard / 32] & bit)
+        continue;
+      if(shards.get(shard)->sinkPacket(packet, headerOffset) == Status::Status__Busy)
+        status = Status::Status__Busy;
+      else
+        commandShards[shard / 32] |= bit;
+    }
+
+  // Hold on to a partly broadcast command until retried.
+    if(status == Status::Status__Busy && pendingCommand == NULL){
+      MAP::referencePacket(packet);
+      pendingCommand = packet;
+    }else if(status != Status::Status__Busy && pendingCommand != NULL){
+      MAP::dereferencePacket(pendingCommand);
+      pendingCommand = NULL;
+    }
+  }
+
+  __atomic_clear(&commandLock, __ATOMIC_RELEASE);
+  return status;
+}
+
+Status::Status_t ShardDispatcher::sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  if(shards.is_empty())
+    return Status::Status__Bad;
+  if(is_command(packet, headerOffset))
+    return broadcastCommand(packet, headerOffset);
+  return shards.get(selectShard(packet, headerOffset))->sinkPacket(packet, headerOffset);
+}
+
+uint16_t ShardDispatcher::sinkPackets(MAP::OffsetMAPPacket* const packets, const uint16_t count){
+  if(shards.is_empty() || count == 0)
+    return 0;
+
+  uint16_t runStart = 0;
+  ShardIndex_t runShard = 0;
+  for(uint16_t i = 0; i <= count; i++){
+    bool command = (i < count && is_command(packets[i].packet, packets[i].headerOffset));
+    ShardIndex_t shard = runShard;
+    if(i < count && ! command)
+      shard = selectShard(packets[i].packet, packets[i].headerOffset);
+    if(i < count && ! command && (i == runStart || shard == runShard)){
+      runShard = shard;
+      continue;
+    }
+
+  // Pass on the run; stop at the first packet refused.
+    uint16_t runSize = i - runStart;
+    if(runSize > 0){
+      uint16_t sunk = shards.get(runShard)->sinkPackets(packets + runStart, runSize);
+      if(sunk < runSize)
+        return runStart + sunk;
+    }
+
+  // Commands follow the packets before them, and precede those after.
+    if(command){
+      if(broadcastCommand(packets[i].packet, packets[i].headerOffset) == Status::Status__Busy)
+        return i;
+      runStart = i + 1;
+    }else{
+      runStart = i;
+      runShard = shard;
+    }
+  }
+  return count;
+}
+
+/* ShardedPipeline */
+
+ShardedPipeline::ShardedPipeline(const ShardIndex_t shard_count, const ProcessGroup::Capacity_t processes_per_shard, const MAP::MpscMAPPacketBuffer::Capacity_t ingress_capacity, const uint16_t max_egress_links)
+: shards(NULL), shardCount(shard_count),
+  groups(NULL), executor(NULL),
+  ingresses(NULL), dispatcher(NULL, 0),
+  ingressCapacity(ingress_capacity),
+  handoffs(NULL, 0)
+{
+  assert(shard_count > 0);
+  allShards.pipeline = this;
+  handoffSpaceSignal.set_readyTarget(&allShards, 0);
+
+  shards = (Shard*) malloc(shard_count * sizeof(Shard));
+  groups = (ProcessGroup**) malloc(shard_count * sizeof(ProcessGroup*));
+  ingresses = (MAP::MAPPacketSink**) malloc(shard_count * sizeof(MAP::MAPPacketSink*));
+  MAP::MpscMAPPacketBuffer **handoffs_buffer = (MAP::MpscMAPPacketBuffer**) malloc(max_egress_links * sizeof(MAP::MpscMAPPacketBuffer*));
+  assert(shards != NULL && groups != NULL && ingresses != NULL && (handoffs_buffer != NULL || max_egress_links == 0));
+  dispatcher = ShardDispatcher(ingresses, shard_count);
+  handoffs = DataStore::ArrayBuffer<MAP::MpscMAPPacketBuffer*, uint16_t>(handoffs_buffer, max_egress_links);
+
+  for(ShardIndex_t i = 0; i < shard_count; i++){
+    Shard &shard = shards[i];
+    shard.processes = (Process**) malloc(processes_per_shard * sizeof(Process*));
+    assert(shard.processes != NULL);
+    shard.group = new ProcessGroup(shard.processes, processes_per_shard);
+    shard.ingress = NULL;
+  }
+
+// One worker per shard.
+  executor = new ProcessExecutor(groups, shard_count, shard_count);
+}
+
+ShardedPipeline::~ShardedPipeline(){
+  stop();
+  delete executor;
+
+  for(ShardIndex_t i = 0; i < shardCount; i++){
+    deleteBuffer(shards[i].ingress);
+    delete shards[i].group;
+    free(shards[i].processes);
+  }
+  for(MAP::MpscMAPPacketBuffer **handoff = handoffs.front(); handoff < handoffs.back(); handoff++)
+    deleteBuffer(*handoff);
+
+  free(handoffs.front());
+  free(ingresses);
+  free(groups);
+  free(shards);
+}
+
+Status::Status_t ShardedPipeline::set_router(const ShardIndex_t shard, MAP::MAPPacketSink* const router){
+  if(shard >= shardCount || shards[shard].ingress != NULL)
+    return Status::Status__Bad;
+
+  MAP::MpscMAPPacketBuffer *ingress = newBuffer(router, ingressCapacity);
+  if(ingress == NULL)
+    return Status::Status__Bad;
+  Status::Status_t status = shards[shard].group->addProcess(ingress, ingress);
+  if(status != Status::Status__Good){
+    deleteBuffer(ingress);
+    return status;
+  }
+  shards[shard].ingress = ingress;
+  return Status::Status__Good;
+}
+
+Status::Status_t ShardedPipeline::addProcess(const ShardIndex_t shard, Process* const new_process, ReadySignal* const ready_signal){
+  if(shard >= shardCount)
+    return Status::Status__Bad;
+  return shards[shard].group->addProcess(new_process, ready_signal);
+}
+
+MAP::MAPPacketSink* ShardedPipeline::addEgressLink(const ShardIndex_t shard, MAP::MAPPacketSink* const link, const MAP::MpscMAPPacketBuffer::Capacity_t handoff_capacity){
+  if(shard >= shardCount || handoffs.is_full())
+    return NULL;
+
+  MAP::MpscMAPPacketBuffer *handoff = newBuffer(link, handoff_capacity);
+  if(handoff == NULL)
+    return NULL;
+  if(shards[shard].group->addProcess(handoff, handoff) != Status::Status__Good){
+    deleteBuffer(handoff);
+    return NULL;
+  }
+  handoff->set_upstreamSignal(&handoffSpaceSignal);
+  handoffs.sinkData(handoff);
+  return handoff;
+}
+
+bool ShardedPipeline::start(const bool pin_shards){
+// The executor and dispatcher take the shards in order, the first time.
+  if(dispatcher.get_shardCount() == 0){
+    for(ShardIndex_t i = 0; i < shardCount; i++){
+      if(shards[i].ingress == NULL)
+        return false;
+    }
+    for(ShardIndex_t i = 0; i < shardCount; i++){
+      executor->addGroup(shards[i].group);
+      dispatcher.addShard(shards[i].ingress);
+    }
+  }
+
+  if(pin_shards)
+    executor->pinWorkers();
+  return executor->start();
+}
+
+void ShardedPipeline::stop(){
+  executor->stop();
+}
+
+void ShardedPipeline::AllShardsTarget::markReady(const uint8_t){
+  for(ShardIndex_t i = 0; i < pipeline->shardCount; i++)
+    pipeline->shards[i].group->markReady(0);
+}
+
+MAP::MpscMAPPacketBuffer* ShardedPipeline::newBuffer(MAP::MAPPacketSink* const packetSink, const MAP::MpscMAPPacketBuffer::Capacity_t capacity){
+  void *new_mem;
+  if(posix_memalign(&new_mem, __alignof__(MAP::MpscMAPPacketBuffer), sizeof(MAP::MpscMAPPacketBuffer)) != 0)
+    return NULL;
+  return new(new_mem) MAP::MpscMAPPacketBuffer(packetSink, capacity);
+}
+
+void ShardedPipeline::deleteBuffer(MAP::MpscMAPPacketBuffer* const buffer){
+  if(buffer == NULL)
+    return;
+  buffer->~MpscMAPPacketBuffer();
+  free(buffer);
+}
+
@@ -0,0 +1,202 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Sharded pipeline (linux)
+//
+// Runs N independent routing pipelines (decode -> PacketValidator -> AddressGraph -> encode),
+// one per shard, each on its own worker thread (and, when pinned, its own core).
+//
+// Each shard has an ingress buffer feeding its router. Packets reach a shard either directly,
+// from the links (decoders) running on that shard, or through a ShardDispatcher, which spreads
+// flows across the shards by hashing each packet's source address (as in receive-side scaling),
+// so that every packet of a flow is routed, in order, by the same shard. Links can likewise be
+// assigned to shards by link ID (ShardDispatcher::selectLinkShard).
+//
+// Each shard's router keeps its own routes. So that a route command (e.g. an AddressGraph Add or
+// Remove) reaches every shard, the dispatcher broadcasts packets addressed to the routers' local
+// (command) address, once set, to every shard. Commands sunk straight to a shard's ingress only
+// change that shard's routes.
+//
+// Each egress link (e.g. a MEPEncoder) lives on one shard, behind a handoff buffer. The routers
+// of every shard send to the handoff buffer, rather than to the link itself; packets routed on
+// another shard are handed off there, and passed on to the link from its own shard. A router
+// refused by a full handoff buffer leaves its packets in its ingress; the handoff buffer wakes
+// every shard when it frees space, since any of their routers may be waiting on it.
+//
+// Packets cross threads, so MAP_THREADSAFE_REFERENCES must be defined (for every translation
+// unit). Each shard may allocate from its own memory pool, but packets handed off are freed on
+// another shard, so the pools must be thread-safe.
+
+#pragma once
+
+#include <stdlib.h>
+
+#include <Upacket/MAP/MAP.hpp>
+#include <Upacket/MAP/arch/linux/ConcurrentMAPPacketBuffer.hpp>
+#include <Upacket/Scheduling/arch/linux/ProcessExecutor.hpp>
+
+// Max of 255 shards
+typedef uint8_t ShardIndex_t;
+
+// Spreads packets across shards, by source address, and broadcasts command packets.
+//
+// A command refused (Busy) by some shard's ingress makes the dispatcher return Busy; the caller's
+// retry of the same packet then goes only to the shards that have not yet accepted it. One
+// command is retried at a time; other commands are refused as Busy meanwhile, so the caller must
+// retry refused commands (e.g. from a MAPPacketBuffer).
+class ShardDispatcher : public MAP::MAPPacketSink {
+private:
+// Static; the ingress of each shard.
+  DataStore::ArrayBuffer<MAP::MAPPacketSink*, ShardIndex_t> shards;
+// Shard for packets without a source address.
+  ShardIndex_t defaultShard;
+
+// Routers' local address, for commands to be broadcast.
+  bool commandAddressSet;
+  uint8_t commandAddressType;
+  uint8_t commandAddressValue;
+
+// Command partly broadcast (referenced until done), and the shards that have accepted it.
+  bool commandLock;
+  MAP::MAPPacket *pendingCommand;
+  uint32_t commandShards[256 / 32];
+
+  Status::Status_t broadcastCommand(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+public:
+
+  ShardDispatcher(MAP::MAPPacketSink** const shards_buffer, const ShardIndex_t shards_buffer_capacity)
+  : shards(shards_buffer, shards_buffer_capacity),
+    defaultShard(0),
+    commandAddressSet(false), commandAddressType(0), commandAddressValue(0),
+    commandLock(false), pendingCommand(NULL)
+  { }
+// Drops the partly broadcast command, if any.
+  ~ShardDispatcher(){
+    if(pendingCommand != NULL)
+      MAP::dereferencePacket(pendingCommand);
+  }
+
+  Status::Status_t addShard(MAP::MAPPacketSink* const &new_shard){
+    return shards.sinkData(new_shard);
+  }
+  void set_defaultShard(const ShardIndex_t new_defaultShard){
+    defaultShard = new_defaultShard;
+  }
+// Broadcast packets to this dest address (that of the routers' commands, as passed to
+// AddressGraph) to every shard. Set before packets are dispatched.
+  void set_commandAddress(const uint8_t new_commandAddressType, const uint8_t new_commandAddressValue){
+    commandAddressType = new_commandAddressType;
+    commandAddressValue = new_commandAddressValue;
+    commandAddressSet = true;
+  }
+  inline ShardIndex_t get_shardCount() const{
+    return shards.get_size();
+  }
+
+// Mix a 32-bit key (or weak hash), and scale it to a shard (by its top bits, without a division).
+  static inline ShardIndex_t scaleHash(uint32_t key, const ShardIndex_t shard_count){
+    key ^= key >> 16;
+    key *= 0x85ebca6bUL;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35UL;
+    key ^= key >> 16;
+    return (ShardIndex_t) (((uint64_t) key * shard_count) >> 32);
+  }
+// Shard for a link, by link ID.
+  static inline ShardIndex_t selectLinkShard(const uint32_t linkId, const ShardIndex_t shard_count){
+    return scaleHash(linkId, shard_count);
+  }
+
+// Shard for a packet, by source address (and address type).
+  ShardIndex_t selectShard(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset);
+// Addressed to the routers' local address (if set)?
+  bool is_command(MAP::MAPPacket* const packet, const MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+// Passes each run of consecutive packets bound for the same shard on together.
+  uint16_t sinkPackets(MAP::OffsetMAPPacket* const packets, const uint16_t count);
+};
+
+class ShardedPipeline {
+private:
+  class Shard {
+  public:
+    Process **processes;
+    ProcessGroup *group;
+    MAP::MpscMAPPacketBuffer *ingress;
+  };
+
+  Shard *shards;
+  ShardIndex_t shardCount;
+
+// Signals every shard's group.
+  class AllShardsTarget : public ReadyTarget {
+  public:
+    ShardedPipeline *pipeline;
+    void markReady(const uint8_t);
+  };
+  AllShardsTarget allShards;
+// Signalled by the handoff buffers when they free space.
+  ReadySignal handoffSpaceSignal;
+
+  ProcessGroup **groups;
+  ProcessExecutor *executor;
+
+  MAP::MAPPacketSink **ingresses;
+  ShardDispatcher dispatcher;
+
+  MAP::MpscMAPPacketBuffer::Capacity_t ingressCapacity;
+
+// Handoff buffers, owned by the pipeline.
+  DataStore::ArrayBuffer<MAP::MpscMAPPacketBuffer*, uint16_t> handoffs;
+
+// Buffers are cache-line aligned, which plain new does not guarantee (before C++17).
+  static MAP::MpscMAPPacketBuffer* newBuffer(MAP::MAPPacketSink* const packetSink, const MAP::MpscMAPPacketBuffer::Capacity_t capacity);
+  static void deleteBuffer(MAP::MpscMAPPacketBuffer* const buffer);
+
+public:
+
+// processes_per_shard includes the shard's ingress and handoff buffers.
+  ShardedPipeline(const ShardIndex_t shard_count, const ProcessGroup::Capacity_t processes_per_shard, const MAP::MpscMAPPacketBuffer::Capacity_t ingress_capacity, const uint16_t max_egress_links);
+// Stops the pipeline, if running. Packets still buffered are dereferenced.
+  ~ShardedPipeline();
+
+// The rest of the pipeline may only be set up while stopped.
+
+// Set the shard's router (e.g. a PacketValidator in front of the shard's AddressGraph),
+// fed from the shard's ingress buffer.
+  Status::Status_t set_router(const ShardIndex_t shard, MAP::MAPPacketSink* const router);
+// Add one of the shard's processes (e.g. its links' decoders), signalled by ready_signal, or
+// polled if NULL. Processes added to a shard are only ever run on that shard.
+  Status::Status_t addProcess(const ShardIndex_t shard, Process* const new_process, ReadySignal* const ready_signal = NULL);
+// Put an egress link (e.g. a MEPEncoder, or a buffer in front of one) on a shard, behind a
+// handoff buffer. Returns the handoff buffer, to be used as the link's sink by every shard's
+// router; NULL on failure. The link's own process (if any) must be added to the same shard.
+  MAP::MAPPacketSink* addEgressLink(const ShardIndex_t shard, MAP::MAPPacketSink* const link, const MAP::MpscMAPPacketBuffer::Capacity_t handoff_capacity);
+
+  inline ShardIndex_t get_shardCount() const{
+    return shardCount;
+  }
+// Packets sunk here are routed by the shard (from any thread).
+  inline MAP::MAPPacketSink* get_ingress(const ShardIndex_t shard) const{
+    return shards[shard].ingress;
+  }
+// Packets sunk here are routed by the shard their source address hashes to (from any thread,
+// once started). Set its command address to broadcast route commands to every shard.
+  inline ShardDispatcher* get_dispatcher(){
+    return &dispatcher;
+  }
+// For per-worker utilization stats. Worker i starts out with shard i (and keeps it, unless idle
+// workers steal it).
+  inline ProcessExecutor* get_executor() const{
+    return executor;
+  }
+
+// Every shard must have a router.
+  bool start(const bool pin_shards = true);
+  void stop();
+};
+
@@ -0,0 +1,216 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include "SnapshotAddressGraph.hpp"
+
+#include <sched.h>
+
+__thread SnapshotAddressGraph::ThreadReader SnapshotAddressGraph::threadReaders[SnapshotAddressGraph::MaxNestedGraphs];
+
+SnapshotAddressGraph::SnapshotAddressGraph(uint8_t new_localAddressType, uint8_t new_localAddressValue,
+                                           DataStore::ArrayBuffer<MAPPacketSink*, uint8_t> *new_packetSinks,
+                                           MemoryPool *new_memoryPool)
+: localAddressType(new_localAddressType), localAddressValue(new_localAddressValue),
+  packetSinks(new_packetSinks),
+  globalEpoch(0), snapshot(NULL),
+  master(new_localAddressType, new_localAddressValue, new_packetSinks, new_memoryPool),
+  retired(NULL)
+{
+  assert(new_packetSinks != NULL);
+  for(uint8_t slot = 0; slot < MaxReaders; slot++)
+    readerSlots[slot].epoch = Epoch__Idle;
+  pthread_mutex_init(&writerMutex, NULL);
+
+  snapshot = newSnapshot(0);
+  assert(snapshot != NULL);
+}
+
+// No readers may remain.
+SnapshotAddressGraph::~SnapshotAddressGraph(){
+  free(snapshot);
+  while(retired != NULL){
+    RouteSnapshot *next = retired->nextRetired;
+    free(retired);
+    retired = next;
+  }
+  pthread_mutex_destroy(&writerMutex);
+}
+
+Status::Status_t SnapshotAddressGraph::sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *header = packet->get_header(headerOffset);
+  if(header == NULL)
+    return Status::Status__Bad;
+
+  MAP::Data_t destAddressType = MAP::get_addressType(*header);
+  MAP::Data_t *destAddressValue = packet->get_destAddress(header);
+  if(destAddressValue == NULL)
+    return Status::Status__Bad;
+
+  // Reference, in case receiver derefs
+  MAP::referencePacket(packet);
+  if((destAddressType == localAddressType) && (*destAddressValue == localAddressValue)){
+    // Commands are applied to the master, and published (except those for prefix routes,
+    // which are not snapshotted).
+    if(is_prefixCommand(packet, headerOffset)){
+      DEBUGprint_AG("SAG::sP: prefix cmd refused\n");
+    }else{
+      beginUpdate()->process_command_packet(packet, headerOffset);
+      endUpdate();
+    }
+  }else{
+    uint8_t slot = enterReader();
+    if(slot == NullSlot){
+    // Undo the reference, without freeing: a refused packet stays the sender's.
+      packet->decrementReferenceCount();
+      return Status::Status__Busy;
+    }
+    RouteSnapshot *current = __atomic_load_n(&snapshot, __ATOMIC_SEQ_CST);
+
+    AddressFilter *edges = current->get_edges();
+    for(AddressGraph::EdgeIndex_t i = 0; i < current->edgeCount; i++){
+      AddressFilter *edge = edges + i;
+      if(edge->isMatch(destAddressType, destAddressValue) && (edge->packetSinkIndex < packetSinks->get_size()))
+        packetSinks->get(edge->packetSinkIndex)->sinkPacket(packet, headerOffset + edge->headerOffset);
+    }
+
+    leaveReader(slot);
+  }
+
+  // Dereference
+  MAP::dereferencePacket(packet);
+  return Status::Status__Good;
+}
+
+uint32_t SnapshotAddressGraph::get_version(){
+  uint8_t slot = enterReader();
+// No reader slot free: the writer mutex also keeps the snapshot from being freed.
+  if(slot == NullSlot){
+    pthread_mutex_lock(&writerMutex);
+    uint32_t version = snapshot->version;
+    pthread_mutex_unlock(&writerMutex);
+    return version;
+  }
+  uint32_t version = __atomic_load_n(&snapshot, __ATOMIC_SEQ_CST)->version;
+  leaveReader(slot);
+  return version;
+}
+
+bool SnapshotAddressGraph::is_prefixCommand(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  MAP::Data_t *data_ptr = packet->get_data(packet->get_header(headerOffset));
+  return data_ptr != NULL && data_ptr < packet->back()
+    && (*data_ptr == AddressGraph::Opcode__AddPrefix || *data_ptr == AddressGraph::Opcode__RemovePrefix);
+}
+
+// Pin the current epoch in a free reader slot, or reuse the slot this thread already holds
+// (whose older epoch also protects any newer snapshot).
+// The snapshot pointer must be loaded only after this returns.
+uint8_t SnapshotAddressGraph::enterReader(){
+  ThreadReader *reader = NULL;
+  for(uint8_t i = 0; i < MaxNestedGraphs; i++){
+    if(threadReaders[i].graph == this){
+      threadReaders[i].depth++;
+      return threadReaders[i].slot;
+    }
+    if(reader == NULL && threadReaders[i].graph == NULL)
+      reader = &threadReaders[i];
+  }
+  assert(reader != NULL);
+  if(reader == NULL)
+    return NullSlot;
+
+// Slots are held only briefly, so one should come free unless over MaxReaders threads are reading.
+  for(uint8_t attempt = 0; attempt < EnterAttempts; attempt++){
+    for(uint8_t slot = 0; slot < MaxReaders; slot++){
+      uint64_t idle = Epoch__Idle;
+      uint64_t epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+    // A stale epoch is merely conservative.
+      if(__atomic_load_n(&readerSlots[slot].epoch, __ATOMIC_RELAXED) == Epoch__Idle
+         && __atomic_compare_exchange_n(&readerSlots[slot].epoch, &idle, epoch, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)){
+        reader->graph = this;
+        reader->slot = slot;
+        reader->depth = 1;
+        return slot;
+      }
+    }
+    sched_yield();
+  }
+  return NullSlot;
+}
+
+void SnapshotAddressGraph::leaveReader(const uint8_t slot){
+  for(uint8_t i = 0; i < MaxNestedGraphs; i++){
+    ThreadReader &reader = threadReaders[i];
+    if(reader.graph != this)
+      continue;
+  // Still in use by an outer read?
+    if(--reader.depth > 0)
+      return;
+    reader.graph = NULL;
+    break;
+  }
+  __atomic_store_n(&readerSlots[slot].epoch, Epoch__Idle, __ATOMIC_RELEASE);
+}
+
+// Copy the master's active edges into a new snapshot.
+RouteSnapshot* SnapshotAddressGraph::newSnapshot(const uint32_t version){
+  AddressGraph::EdgeIndex_t edgeCount = 0;
+  for(AddressFilter *edge = master.addressEdges.front(); edge < master.addressEdges.back(); edge++){
+    if(edge->mode != AddressFilter::Mode__Inactive)
+      edgeCount++;
+  }
+
+  RouteSnapshot *new_snapshot = (RouteSnapshot*) malloc(sizeof(RouteSnapshot) + edgeCount * sizeof(AddressFilter));
+  if(new_snapshot == NULL)
+    return NULL;
+  new_snapshot->version = version;
+  new_snapshot->edgeCount = edgeCount;
+  new_snapshot->retireEpoch = 0;
+  new_snapshot->nextRetired = NULL;
+
+  AddressFilter *edges = new_snapshot->get_edges();
+  for(AddressFilter *edge = master.addressEdges.front(); edge < master.addressEdges.back(); edge++){
+    if(edge->mode != AddressFilter::Mode__Inactive)
+      *(edges++) = *edge;
+  }
+  return new_snapshot;
+}
+
+// Publish the master's edges (under the writer mutex).
+void SnapshotAddressGraph::publish(){
+  RouteSnapshot *new_snapshot = newSnapshot(snapshot->version + 1);
+// Out of memory: keep forwarding on the old routes. The next publish will catch up.
+  if(new_snapshot == NULL)
+    return;
+
+  RouteSnapshot *old_snapshot = __atomic_exchange_n(&snapshot, new_snapshot, __ATOMIC_SEQ_CST);
+// Readers pinned at or before this epoch may still hold the old snapshot.
+  old_snapshot->retireEpoch = __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+  old_snapshot->nextRetired = retired;
+  retired = old_snapshot;
+
+  reclaim();
+}
+
+// Free retired snapshots that no reader can still hold (under the writer mutex).
+void SnapshotAddressGraph::reclaim(){
+  uint64_t oldestEpoch = Epoch__Idle;
+  for(uint8_t slot = 0; slot < MaxReaders; slot++){
+    uint64_t epoch = __atomic_load_n(&readerSlots[slot].epoch, __ATOMIC_SEQ_CST);
+    if(epoch < oldestEpoch)
+      oldestEpoch = epoch;
+  }
+
+  RouteSnapshot **link = &retired;
+  while(*link != NULL){
+    if((*link)->retireEpoch < oldestEpoch){
+      RouteSnapshot *freed = *link;
+      *link = freed->nextRetired;
+      free(freed);
+    }else
+      link = &((*link)->nextRetired);
+  }
+}
+
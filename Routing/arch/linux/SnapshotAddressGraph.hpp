@@ -0,0 +1,143 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Snapshot address graph (linux)
+//
+// AddressGraph for many forwarding threads. Packets are forwarded against an immutable
+// snapshot of the edge table, with no locks taken; route changes (command packets, or edits
+// between beginUpdate and endUpdate) are made to a private master AddressGraph under a writer
+// mutex, and then published as a new snapshot with a single atomic pointer exchange.
+//
+// Superseded snapshots are reclaimed by epoch: each forwarding thread pins the current epoch
+// in a reader slot for the duration of a packet, and a snapshot retired in epoch E is freed
+// once no reader remains pinned at or before E.
+//
+// Only the master's edge list is snapshotted, and readers scan it linearly. An edge index,
+// classifier, prefix routes, flow cache or retry queues attached to the master (through
+// beginUpdate) are not used for forwarding, and the prefix route commands (AddPrefix,
+// RemovePrefix) are refused.
+//
+// A thread takes one reader slot per graph, however deeply nested its reads (e.g. a sink routing
+// a packet back into the graph). If more than MaxReaders threads read at once, the excess threads
+// find no slot free, and their packets are refused (Busy).
+
+#pragma once
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "AddressGraph.hpp"
+
+#ifndef SNAPSHOT_ADDRESS_GRAPH_READERS
+#define SNAPSHOT_ADDRESS_GRAPH_READERS 64
+#endif
+// Graphs a thread may be reading at once (nested).
+#ifndef SNAPSHOT_ADDRESS_GRAPH_NESTED_GRAPHS
+#define SNAPSHOT_ADDRESS_GRAPH_NESTED_GRAPHS 4
+#endif
+// Passes over the reader slots before giving up on finding one free.
+#ifndef SNAPSHOT_ADDRESS_GRAPH_ENTER_ATTEMPTS
+#define SNAPSHOT_ADDRESS_GRAPH_ENTER_ATTEMPTS 16
+#endif
+
+// An immutable copy of the active edges, in edge order.
+struct RouteSnapshot {
+  uint32_t version;
+  AddressGraph::EdgeIndex_t edgeCount;
+// Epoch in which it was superseded, and the next retired snapshot.
+  uint64_t retireEpoch;
+  RouteSnapshot *nextRetired;
+
+// Edges are stored immediately after the snapshot.
+  inline AddressFilter* get_edges(){
+    return (AddressFilter*) (this + 1);
+  }
+};
+
+class SnapshotAddressGraph : public MAP::MAPPacketSink {
+public:
+  static const uint8_t MaxReaders = SNAPSHOT_ADDRESS_GRAPH_READERS;
+
+private:
+  static const uint64_t Epoch__Idle = ~(uint64_t) 0;
+  static const uint8_t NullSlot = 0xFF;
+  static const uint8_t MaxNestedGraphs = SNAPSHOT_ADDRESS_GRAPH_NESTED_GRAPHS;
+  static const uint8_t EnterAttempts = SNAPSHOT_ADDRESS_GRAPH_ENTER_ATTEMPTS;
+
+// One cache line per slot, so readers don't contend.
+  struct ReaderSlot {
+    uint64_t epoch;
+    uint8_t padding[64 - sizeof(uint64_t)];
+  } __attribute__((aligned(64)));
+
+// The slot this thread holds in a graph, and how many reads are using it.
+  struct ThreadReader {
+    const SnapshotAddressGraph *graph;
+    uint8_t slot;
+    uint32_t depth;
+  };
+  static __thread ThreadReader threadReaders[MaxNestedGraphs];
+
+  uint8_t localAddressType;
+  uint8_t localAddressValue;
+  DataStore::ArrayBuffer<MAPPacketSink*, uint8_t> *packetSinks;
+
+  ReaderSlot readerSlots[MaxReaders];
+  uint64_t globalEpoch;
+  RouteSnapshot *snapshot;
+
+// Writer state (under writerMutex)
+  pthread_mutex_t writerMutex;
+  AddressGraph master;
+  RouteSnapshot *retired;
+
+public:
+
+// The memory pool is used only by the master graph, and only under the writer mutex.
+  SnapshotAddressGraph(uint8_t new_localAddressType, uint8_t new_localAddressValue,
+                       DataStore::ArrayBuffer<MAPPacketSink*, uint8_t> *new_packetSinks,
+                       MemoryPool *new_memoryPool);
+  ~SnapshotAddressGraph();
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+// Lock the master graph for editing. Forwarding continues against the current snapshot
+// until endUpdate publishes the changes. For example:
+//   EepromAddressGraph eepromGraph(graph.beginUpdate(), ...);   // loads state
+//   graph.endUpdate();
+  AddressGraph* beginUpdate(){
+    pthread_mutex_lock(&writerMutex);
+    return &master;
+  }
+  void endUpdate(){
+    publish();
+    pthread_mutex_unlock(&writerMutex);
+  }
+
+  bool sinkEdge(const AddressFilter &newEdge){
+    bool sunk = beginUpdate()->sinkEdge(newEdge);
+    endUpdate();
+    return sunk;
+  }
+  void clearEdges(){
+    beginUpdate()->clearEdges();
+    endUpdate();
+  }
+
+// Version of the current snapshot (incremented on each publish).
+  uint32_t get_version();
+
+private:
+// Returns NullSlot if no reader slot is free.
+  uint8_t enterReader();
+  void leaveReader(const uint8_t slot);
+
+  static bool is_prefixCommand(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+  RouteSnapshot* newSnapshot(const uint32_t version);
+  void publish();
+  void reclaim();
+};
+
@@ -0,0 +1,122 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include "ThreadedBroadcastRouter.hpp"
+
+BroadcastWorker::BroadcastWorker(MAP::MAPPacketSink** const sinks_buffer, const uint8_t sinks_buffer_capacity, QueueCapacity_t queue_capacity)
+: sinks(sinks_buffer, sinks_buffer_capacity),
+  queue(NULL), queueMask(0),
+  readPosition(0), writePosition(0),
+  dropCount(0),
+  sleeping(false), running(false)
+{
+  QueueCapacity_t capacity = 1;
+  while(capacity < queue_capacity)
+    capacity <<= 1;
+  queue = (MAP::OffsetMAPPacket*) malloc(capacity * sizeof(MAP::OffsetMAPPacket));
+  assert(queue != NULL);
+  queueMask = capacity - 1;
+
+  pthread_mutex_init(&wakeMutex, NULL);
+  pthread_cond_init(&wakeCondition, NULL);
+}
+
+BroadcastWorker::~BroadcastWorker(){
+  stop();
+  free(queue);
+  pthread_cond_destroy(&wakeCondition);
+  pthread_mutex_destroy(&wakeMutex);
+}
+
+bool BroadcastWorker::start(){
+  if(running)
+    return true;
+  running = true;
+  if(pthread_create(&thread, NULL, run, this) != 0){
+    running = false;
+    return false;
+  }
+  return true;
+}
+
+void BroadcastWorker::stop(){
+  if(running){
+    pthread_mutex_lock(&wakeMutex);
+    __atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&wakeCondition);
+    pthread_mutex_unlock(&wakeMutex);
+    pthread_join(thread, NULL);
+  }
+
+// Deliver anything queued after the worker last looked (or queued before it was ever started),
+// so that no queued packet keeps its reference.
+  deliver();
+}
+
+bool BroadcastWorker::enqueue(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  QueueCapacity_t position = writePosition;
+  if(position - __atomic_load_n(&readPosition, __ATOMIC_ACQUIRE) > queueMask){
+    __atomic_add_fetch(&dropCount, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+// Reference the packet until the worker has delivered it.
+  MAP::referencePacket(packet);
+  queue[position & queueMask] = MAP::OffsetMAPPacket(packet, headerOffset);
+  __atomic_store_n(&writePosition, position + 1, __ATOMIC_SEQ_CST);
+
+// Wake the worker, if it is (or is about to be) asleep.
+  if(__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&wakeMutex);
+    pthread_cond_signal(&wakeCondition);
+    pthread_mutex_unlock(&wakeMutex);
+  }
+  return true;
+}
+
+uint16_t BroadcastWorker::dequeue(MAP::OffsetMAPPacket* const packets){
+  QueueCapacity_t position = readPosition;
+  QueueCapacity_t available = __atomic_load_n(&writePosition, __ATOMIC_ACQUIRE) - position;
+  uint16_t count = (available < BatchCapacity)? available : BatchCapacity;
+
+  for(uint16_t i = 0; i < count; i++)
+    packets[i] = queue[(position + i) & queueMask];
+  __atomic_store_n(&readPosition, position + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+// Deliver everything queued, a batch at a time.
+void BroadcastWorker::deliver(){
+  MAP::OffsetMAPPacket packets[BatchCapacity];
+  uint16_t count;
+  while((count = dequeue(packets)) > 0){
+    for(MAP::MAPPacketSink **packetSink = sinks.front(); packetSink < sinks.back(); packetSink++)
+      (*packetSink)->sinkPackets(packets, count);
+
+    for(uint16_t i = 0; i < count; i++)
+      MAP::dereferencePacket(packets[i].packet);
+  }
+}
+
+void* BroadcastWorker::run(void* const worker_ptr){
+  BroadcastWorker *worker = (BroadcastWorker*) worker_ptr;
+
+  while(__atomic_load_n(&worker->running, __ATOMIC_SEQ_CST)){
+    worker->deliver();
+
+  // Sleep until more packets are queued. The queue is rechecked after announcing the sleep,
+  // so that a packet queued meanwhile is not missed.
+    pthread_mutex_lock(&worker->wakeMutex);
+    __atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&worker->writePosition, __ATOMIC_SEQ_CST) == worker->readPosition
+       && __atomic_load_n(&worker->running, __ATOMIC_SEQ_CST))
+      pthread_cond_wait(&worker->wakeCondition, &worker->wakeMutex);
+    __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&worker->wakeMutex);
+  }
+  return NULL;
+}
+
@@ -0,0 +1,124 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Threaded broadcast router (linux)
+//
+// BroadcastRouter whose sinks are bound to worker threads, so that a slow sink delays only the
+// other sinks on its own worker. The router enqueues one packet reference per worker, onto the
+// worker's lock-free single-producer/single-consumer queue; each worker passes the packets it
+// dequeues to each of its sinks in turn (in batches, when several are waiting). Every sink is on
+// exactly one worker, and so receives its packets in order.
+//
+// A worker whose queue is full drops the packet (for its sinks only), and counts the drop.
+//
+// Packets are shared between threads, so MAP_THREADSAFE_REFERENCES must be defined (for every
+// translation unit), and the packets' memory pools must be thread-safe. Sinks must not modify
+// the packets they receive, and the router's sinkPacket must be called from one thread at a time.
+
+#pragma once
+
+#ifndef MAP_THREADSAFE_REFERENCES
+#error ThreadedBroadcastRouter requires MAP_THREADSAFE_REFERENCES.
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <Upacket/MAP/MAP.hpp>
+
+#ifndef BROADCAST_WORKER_BATCH_CAPACITY
+#define BROADCAST_WORKER_BATCH_CAPACITY 16
+#endif
+
+class BroadcastWorker {
+public:
+  typedef uint32_t QueueCapacity_t;
+  static const uint16_t BatchCapacity = BROADCAST_WORKER_BATCH_CAPACITY;
+
+private:
+// Max of 255 sinks per worker
+  DataStore::ArrayBuffer<MAP::MAPPacketSink*, uint8_t> sinks;
+
+// Ring of queued packets; capacity is a power of two.
+  MAP::OffsetMAPPacket *queue;
+  QueueCapacity_t queueMask;
+// Consumer and producer positions (free-running), on separate cache lines.
+  QueueCapacity_t readPosition __attribute__((aligned(64)));
+  QueueCapacity_t writePosition __attribute__((aligned(64)));
+
+  uint32_t dropCount;
+
+// The worker sleeps on wakeCondition when its queue is empty.
+  pthread_mutex_t wakeMutex;
+  pthread_cond_t wakeCondition;
+  bool sleeping;
+  bool running;
+  pthread_t thread;
+
+public:
+
+// queue_capacity is rounded up to a power of two.
+  BroadcastWorker(MAP::MAPPacketSink** const sinks_buffer, const uint8_t sinks_buffer_capacity, QueueCapacity_t queue_capacity);
+// Stops the worker, as stop().
+  ~BroadcastWorker();
+
+// Sinks may only be added while the worker is stopped.
+  Status::Status_t addSink(MAP::MAPPacketSink* const &new_sink){
+    return sinks.sinkData(new_sink);
+  }
+
+  bool start();
+// Wait for the worker to deliver everything already queued, and stop it. Packets queued while
+// the worker is not running are delivered from the calling thread.
+  void stop();
+
+// Queue a packet for the worker's sinks (from the producer thread only).
+// Returns false (and counts a drop) if the queue is full.
+  bool enqueue(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+
+  inline uint32_t get_dropCount() const{
+    return __atomic_load_n(&dropCount, __ATOMIC_RELAXED);
+  }
+
+private:
+  static void* run(void* const worker);
+  void deliver();
+// Dequeue up to BatchCapacity packets; returns the number dequeued.
+  uint16_t dequeue(MAP::OffsetMAPPacket* const packets);
+};
+
+class ThreadedBroadcastRouter : public MAP::MAPPacketSink {
+private:
+// Max of 255 workers
+  typedef uint8_t Capacity_t;
+
+// Static
+  DataStore::ArrayBuffer<BroadcastWorker*, Capacity_t> workers;
+
+public:
+
+  ThreadedBroadcastRouter(BroadcastWorker** const workers_buffer, const Capacity_t workers_buffer_capacity)
+  : workers(workers_buffer, workers_buffer_capacity)
+  { }
+
+  Status::Status_t addWorker(BroadcastWorker* const &new_worker){
+    return workers.sinkData(new_worker);
+  }
+
+// Queued to every worker; does not wait for delivery.
+  Status::Status_t sinkPacket(MAP::MAPPacket *packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  // Note packet in use (a worker may otherwise free it while it is still being enqueued).
+    MAP::referencePacket(packet);
+
+    for(BroadcastWorker **worker = workers.front(); worker < workers.back(); worker++)
+      (*worker)->enqueue(packet, headerOffset);
+
+  // Free packet (if no worker took it).
+    MAP::dereferencePacket(packet);
+
+    return Status::Status__Good;
+  }
+};
+
@@ -0,0 +1,2 @@
+#include <ATcommon/arch/linux/linux.hpp>
+#include "../../TopicRouter.cpp"
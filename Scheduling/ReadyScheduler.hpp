@@ -0,0 +1,176 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Process scheduling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Ready scheduler
+//
+// Runs processes only when they have work, rather than polling every process() on every loop.
+// A process that derives from ReadySignal calls signalReady() when work arrives (e.g. a packet
+// is sunk to it), and is queued to run once; it is not run again until it signals again. A
+// process that stops with work left only because it used up its own budget signals again from
+// its own process(). A process that stops because its output was full (refused as Busy) does
+// not: it waits for the output to signal it when space frees up (see SpaceSignal), rather than
+// spinning.
+//
+// Processes added without a ReadySignal are polled on every run, as before.
+//
+// The scheduler is itself a Process; its process() returns Complete when nothing was run, so
+// that the main loop can sleep until the next interrupt (or event).
+//
+// Signals must come from the scheduling thread, or with interrupts disabled.
+
+#pragma once
+
+#include <ATcommon/DataStore/Buffer.hpp>
+#include <ATcommon/DataStore/RingBuffer.hpp>
+#include <ATcommon/Status/Status.hpp>
+#include <MapOS/TimedScheduler/TimedScheduler.hpp>
+
+// Anything that can be signalled: a ReadyScheduler, or another scheduler's unit of work.
+class ReadyTarget {
+public:
+// Targets may be deleted through this base (e.g. ProcessExecutor's groups).
+  virtual ~ReadyTarget(){ }
+
+  virtual void markReady(const uint8_t index) = 0;
+};
+
+class ReadySignal {
+// Max of 255 processes per scheduler
+  typedef uint8_t Index_t;
+
+  ReadyTarget *readyTarget;
+  Index_t readyIndex;
+
+public:
+
+  ReadySignal()
+  : readyTarget(NULL), readyIndex(0)
+  { }
+
+// Set by the scheduler, when the process is added.
+  void set_readyTarget(ReadyTarget* const new_readyTarget, const Index_t new_readyIndex){
+    readyTarget = new_readyTarget;
+    readyIndex = new_readyIndex;
+  }
+
+// Queue the process to run (once). Does nothing if not scheduled.
+  inline void signalReady(){
+    if(readyTarget != NULL)
+      readyTarget->markReady(readyIndex);
+  }
+};
+
+// Held by a sink that can refuse its input: signals the process feeding it (e.g. the
+// MAPPacketBuffer retrying the packets it refused) when space frees up. Does nothing if no
+// upstream is set.
+class SpaceSignal {
+  ReadySignal *upstreamSignal;
+
+public:
+
+  SpaceSignal()
+  : upstreamSignal(NULL)
+  { }
+
+  void set_upstreamSignal(ReadySignal* const new_upstreamSignal){
+    upstreamSignal = new_upstreamSignal;
+  }
+
+  inline void signalUpstream(){
+    if(upstreamSignal != NULL)
+      upstreamSignal->signalReady();
+  }
+};
+
+class ReadyScheduler : public Process, public ReadyTarget {
+public:
+// Max of 255 processes
+  typedef uint8_t Index_t;
+
+  class Entry {
+  public:
+    Process *process;
+  // Polled entries run every time.
+    bool polled;
+  // Already in the ready queue?
+    bool queued;
+  };
+
+private:
+// Static
+  DataStore::ArrayBuffer<Entry, Index_t> entries;
+// Indices of the queued entries. Each entry is queued at most once, so this never overflows.
+  DataStore::RingBuffer<Index_t, Index_t> readyQueue;
+
+public:
+
+// ready_buffer must have the same capacity as entries_buffer.
+  ReadyScheduler(Entry* const entries_buffer, Index_t* const ready_buffer, const Index_t buffer_capacity)
+  : entries(entries_buffer, buffer_capacity),
+    readyQueue(ready_buffer, buffer_capacity)
+  { }
+
+// Add a process, signalled by ready_signal (usually the process itself), or polled if NULL.
+// Signalled processes are queued to run once initially.
+  Status::Status_t addProcess(Process* const new_process, ReadySignal* const ready_signal = NULL){
+    Entry entry;
+    entry.process = new_process;
+    entry.polled = (ready_signal == NULL);
+    entry.queued = false;
+    if(! entries.sinkData(entry))
+      return Status::Status__Busy;
+
+    if(ready_signal != NULL){
+      ready_signal->set_readyTarget(this, entries.get_size() - 1);
+      markReady(entries.get_size() - 1);
+    }
+    return Status::Status__Good;
+  }
+
+  void markReady(const Index_t index){
+    Entry &entry = entries.get(index);
+    if(entry.queued)
+      return;
+    entry.queued = true;
+    readyQueue.sinkData(index);
+  }
+
+// Nothing queued, and nothing polled?
+  bool is_idle() const{
+    if(! readyQueue.is_empty())
+      return false;
+    for(Entry *entry = entries.front(); entry < entries.back(); entry++){
+      if(entry->polled)
+        return false;
+    }
+    return true;
+  }
+
+// Run every polled process, and every process queued as of the call (once each). Processes
+// that signal while running are run on the next call, so that none can starve the others.
+// Returns Complete if nothing was run.
+  Status::Status_t process(){
+    bool ran = false;
+    for(Entry *entry = entries.front(); entry < entries.back(); entry++){
+      if(entry->polled){
+        entry->process->process();
+        ran = true;
+      }
+    }
+
+    for(Index_t count = readyQueue.get_size(); count > 0; count--){
+      Index_t index = readyQueue.get_in_place();
+      readyQueue.increment_read_position();
+    // Clear the flag first, so the process can queue itself again.
+      Entry &entry = entries.get(index);
+      entry.queued = false;
+      entry.process->process();
+      ran = true;
+    }
+
+    return ran? Status::Status__Good : Status::Status__Complete;
+  }
+};
+
@@ -0,0 +1,276 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Process scheduling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include <unistd.h>
+#include <sched.h>
+#include "ProcessExecutor.hpp"
+
+__thread ProcessExecutor::Worker *ProcessExecutor::currentWorker = NULL;
+
+/* ProcessGroup */
+
+void ProcessGroup::markReady(const uint8_t){
+  State_t expected = __atomic_load_n(&state, __ATOMIC_ACQUIRE);
+  State_t desired;
+  do{
+    if(expected == State__Idle)
+      desired = State__Queued;
+    else if(expected == State__Running)
+      desired = State__RunningSignalled;
+    else
+    // Already queued (or to be requeued).
+      return;
+  }while(! __atomic_compare_exchange_n(&state, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+// The worker running the group requeues it itself.
+  if(desired == State__Queued && executor != NULL)
+    executor->enqueue(this, NULL);
+}
+
+/* ProcessExecutor */
+
+ProcessExecutor::ProcessExecutor(ProcessGroup** const groups_buffer, const GroupIndex_t groups_buffer_capacity, const WorkerIndex_t worker_count)
+: workers(NULL), workerCount(worker_count),
+  groups(groups_buffer, groups_buffer_capacity),
+  queuedCount(0), sleepingCount(0),
+  running(false), startTime(0), stopTime(0)
+{
+  assert(worker_count > 0);
+  workers = (Worker*) malloc(worker_count * sizeof(Worker));
+  assert(workers != NULL);
+
+  for(WorkerIndex_t i = 0; i < worker_count; i++){
+    Worker &worker = workers[i];
+    worker.executor = this;
+    worker.index = i;
+    worker.cpu = -1;
+  // Each group is queued at most once, so no deque can hold more than every group.
+    pthread_mutex_init(&worker.dequeMutex, NULL);
+    worker.deque = (ProcessGroup**) malloc(groups_buffer_capacity * sizeof(ProcessGroup*));
+    assert(worker.deque != NULL);
+    worker.dequeFront = 0;
+    worker.dequeSize = 0;
+    worker.runCount = 0;
+    worker.stealCount = 0;
+    worker.busyTime = 0;
+  }
+
+  pthread_mutex_init(&idleMutex, NULL);
+  pthread_cond_init(&idleCondition, NULL);
+}
+
+ProcessExecutor::~ProcessExecutor(){
+  stop();
+  for(WorkerIndex_t i = 0; i < workerCount; i++){
+    free(workers[i].deque);
+    pthread_mutex_destroy(&workers[i].dequeMutex);
+  }
+  free(workers);
+  pthread_cond_destroy(&idleCondition);
+  pthread_mutex_destroy(&idleMutex);
+}
+
+Status::Status_t ProcessExecutor::addGroup(ProcessGroup* const new_group){
+  if(running)
+    return Status::Status__Bad;
+  if(! groups.sinkData(new_group))
+    return Status::Status__Busy;
+
+  new_group->executor = this;
+  new_group->homeWorker = (groups.get_size() - 1) % workerCount;
+  return Status::Status__Good;
+}
+
+void ProcessExecutor::pinWorker(const WorkerIndex_t worker, const int cpu){
+  workers[worker].cpu = cpu;
+}
+
+void ProcessExecutor::pinWorkers(){
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cpuCount < 1)
+    cpuCount = 1;
+  for(WorkerIndex_t i = 0; i < workerCount; i++)
+    workers[i].cpu = i % cpuCount;
+}
+
+bool ProcessExecutor::start(){
+  if(running)
+    return true;
+
+// Queue every group once, on its home worker.
+  queuedCount = 0;
+  for(WorkerIndex_t i = 0; i < workerCount; i++)
+    workers[i].dequeSize = 0;
+  for(ProcessGroup **group = groups.front(); group < groups.back(); group++){
+    (*group)->state = ProcessGroup::State__Queued;
+    Worker &worker = workers[(*group)->homeWorker];
+    worker.deque[(worker.dequeFront + worker.dequeSize) % groups.get_capacity()] = *group;
+    worker.dequeSize++;
+    queuedCount++;
+  }
+
+  for(WorkerIndex_t i = 0; i < workerCount; i++){
+    workers[i].runCount = 0;
+    workers[i].stealCount = 0;
+    workers[i].busyTime = 0;
+  }
+
+  running = true;
+  startTime = get_time();
+  for(WorkerIndex_t i = 0; i < workerCount; i++){
+    if(pthread_create(&workers[i].thread, NULL, run, &workers[i]) != 0){
+    // Stop the workers already started.
+      joinWorkers(i);
+      return false;
+    }
+
+    if(workers[i].cpu >= 0){
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(workers[i].cpu, &cpus);
+      pthread_setaffinity_np(workers[i].thread, sizeof(cpus), &cpus);
+    }
+  }
+  return true;
+}
+
+void ProcessExecutor::stop(){
+  if(! running)
+    return;
+  joinWorkers(workerCount);
+}
+
+// Stop the first count workers.
+void ProcessExecutor::joinWorkers(const WorkerIndex_t count){
+  pthread_mutex_lock(&idleMutex);
+  __atomic_store_n(&running, false, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&idleCondition);
+  pthread_mutex_unlock(&idleMutex);
+
+  for(WorkerIndex_t i = 0; i < count; i++)
+    pthread_join(workers[i].thread, NULL);
+  stopTime = get_time();
+}
+
+ProcessExecutor::WorkerStats ProcessExecutor::get_workerStats(const WorkerIndex_t worker) const{
+  WorkerStats stats;
+  stats.runCount = __atomic_load_n(&workers[worker].runCount, __ATOMIC_RELAXED);
+  stats.stealCount = __atomic_load_n(&workers[worker].stealCount, __ATOMIC_RELAXED);
+  stats.busyTime = __atomic_load_n(&workers[worker].busyTime, __ATOMIC_RELAXED);
+  stats.elapsedTime = (__atomic_load_n(&running, __ATOMIC_RELAXED)? get_time() : stopTime) - startTime;
+  return stats;
+}
+
+// Queue a group on the given worker; or, if NULL, on the current thread's worker (if it is
+// one of ours), or else on the group's home worker.
+void ProcessExecutor::enqueue(ProcessGroup* const group, Worker* worker){
+  if(worker == NULL){
+    worker = currentWorker;
+    if(worker == NULL || worker->executor != this)
+      worker = &workers[__atomic_load_n(&group->homeWorker, __ATOMIC_RELAXED)];
+  }
+
+  pthread_mutex_lock(&worker->dequeMutex);
+  worker->deque[(worker->dequeFront + worker->dequeSize) % groups.get_capacity()] = group;
+  worker->dequeSize++;
+  __atomic_add_fetch(&queuedCount, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&worker->dequeMutex);
+
+// Wake a sleeping worker, if any. Pairs with the recheck in sleep().
+  if(__atomic_load_n(&sleepingCount, __ATOMIC_SEQ_CST) > 0){
+    pthread_mutex_lock(&idleMutex);
+    pthread_cond_signal(&idleCondition);
+    pthread_mutex_unlock(&idleMutex);
+  }
+}
+
+// Pop the least recently queued group from the worker's own deque, so that polled groups
+// take turns.
+ProcessGroup* ProcessExecutor::dequeue(Worker* const worker){
+  ProcessGroup *group = NULL;
+  pthread_mutex_lock(&worker->dequeMutex);
+  if(worker->dequeSize > 0){
+    group = worker->deque[worker->dequeFront];
+    worker->dequeFront = (worker->dequeFront + 1) % groups.get_capacity();
+    worker->dequeSize--;
+    __atomic_sub_fetch(&queuedCount, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&worker->dequeMutex);
+  return group;
+}
+
+// Take the most recently queued group from another worker's deque (leaving the owner the
+// groups it is about to run), starting with the next worker.
+ProcessGroup* ProcessExecutor::steal(Worker* const worker){
+  for(WorkerIndex_t i = 1; i < workerCount; i++){
+    Worker &victim = workers[(worker->index + i) % workerCount];
+    ProcessGroup *group = NULL;
+    pthread_mutex_lock(&victim.dequeMutex);
+    if(victim.dequeSize > 0){
+      victim.dequeSize--;
+      group = victim.deque[(victim.dequeFront + victim.dequeSize) % groups.get_capacity()];
+      __atomic_sub_fetch(&queuedCount, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&victim.dequeMutex);
+
+    if(group != NULL){
+      __atomic_add_fetch(&worker->stealCount, 1, __ATOMIC_RELAXED);
+      return group;
+    }
+  }
+  return NULL;
+}
+
+// Sleep until a group is queued (or the executor stops).
+void ProcessExecutor::sleep(){
+  pthread_mutex_lock(&idleMutex);
+  __atomic_add_fetch(&sleepingCount, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&queuedCount, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&running, __ATOMIC_SEQ_CST))
+    pthread_cond_wait(&idleCondition, &idleMutex);
+  __atomic_sub_fetch(&sleepingCount, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&idleMutex);
+}
+
+void* ProcessExecutor::run(void* const worker_ptr){
+  Worker *worker = (Worker*) worker_ptr;
+  ProcessExecutor *executor = worker->executor;
+  currentWorker = worker;
+
+  while(__atomic_load_n(&executor->running, __ATOMIC_SEQ_CST)){
+    ProcessGroup *group = executor->dequeue(worker);
+    if(group == NULL)
+      group = executor->steal(worker);
+    if(group == NULL){
+      executor->sleep();
+      continue;
+    }
+
+  // Only the worker that dequeued the group may run it.
+    __atomic_store_n(&group->state, ProcessGroup::State__Running, __ATOMIC_RELEASE);
+    uint64_t runStart = get_time();
+    group->run();
+    __atomic_add_fetch(&worker->busyTime, get_time() - runStart, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&worker->runCount, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&group->homeWorker, worker->index, __ATOMIC_RELAXED);
+
+  // Requeue the group (on this worker) if polled, or if signalled while running.
+    ProcessGroup::State_t expected = ProcessGroup::State__Running;
+    if(group->polled || ! __atomic_compare_exchange_n(&group->state, &expected, ProcessGroup::State__Idle, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      __atomic_store_n(&group->state, ProcessGroup::State__Queued, __ATOMIC_RELEASE);
+      executor->enqueue(group, worker);
+    }
+  }
+
+  currentWorker = NULL;
+  return NULL;
+}
+
+uint64_t ProcessExecutor::get_time(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
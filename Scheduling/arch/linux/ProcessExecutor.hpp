@@ -0,0 +1,184 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Process scheduling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Process executor (linux)
+//
+// Runs Processes on a pool of worker threads, in place of the single cooperative loop.
+//
+// Processes are added in groups. A group is the unit of scheduling: running it runs each of its
+// processes once, in order, and a group is only ever run by one worker at a time. Processes that
+// call each other directly (e.g. a MAPPacketBuffer and the MEPEncoder it feeds) must share a
+// group, and then need no locking of their own; links between groups must be thread-safe (e.g.
+// the concurrent MAPPacketBuffers, with MAP_THREADSAFE_REFERENCES).
+//
+// A group containing any process added without a ReadySignal is polled: it is requeued every
+// time it runs. A group whose processes all signal is run only when one of them signals.
+//
+// Each worker has its own deque of queued groups. A worker runs groups from the front of its own
+// deque, and requeues them at the back (so a group tends to stay on one core); when its deque is
+// empty, it steals from the back of the others'; when every deque is empty, it sleeps until a
+// group is queued.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ATcommon/DataStore/Buffer.hpp>
+#include <Upacket/Scheduling/ReadyScheduler.hpp>
+
+class ProcessExecutor;
+
+class ProcessGroup : public ReadyTarget {
+public:
+// Max of 255 processes per group
+  typedef uint8_t Capacity_t;
+
+private:
+  friend class ProcessExecutor;
+
+  typedef uint8_t State_t;
+  static const State_t State__Idle = 0;
+  static const State_t State__Queued = 1;
+  static const State_t State__Running = 2;
+// Signalled while running; to be requeued once run.
+  static const State_t State__RunningSignalled = 3;
+
+// Static
+  DataStore::ArrayBuffer<Process*, Capacity_t> processes;
+  bool polled;
+
+  ProcessExecutor *executor;
+  State_t state;
+// Worker to queue the group to, when signalled from outside the pool.
+  uint16_t homeWorker;
+
+public:
+
+  ProcessGroup(Process** const processes_buffer, const Capacity_t processes_buffer_capacity)
+  : processes(processes_buffer, processes_buffer_capacity),
+    polled(false),
+    executor(NULL), state(State__Idle), homeWorker(0)
+  { }
+
+// Add a process, signalled by ready_signal (usually the process itself), or polled if NULL.
+// Processes may only be added before the group is added to an executor.
+  Status::Status_t addProcess(Process* const new_process, ReadySignal* const ready_signal = NULL){
+    if(! processes.sinkData(new_process))
+      return Status::Status__Busy;
+    if(ready_signal == NULL)
+      polled = true;
+    else
+      ready_signal->set_readyTarget(this, processes.get_size() - 1);
+    return Status::Status__Good;
+  }
+
+// Any of the group's processes has work (from any thread).
+  void markReady(const uint8_t index);
+
+private:
+  void run(){
+    for(Process **process = processes.front(); process < processes.back(); process++)
+      (*process)->process();
+  }
+};
+
+class ProcessExecutor {
+public:
+  typedef uint16_t WorkerIndex_t;
+  typedef uint16_t GroupIndex_t;
+
+// Per-worker statistics (times in nanoseconds).
+  class WorkerStats {
+  public:
+    uint64_t runCount;
+    uint64_t stealCount;
+  // Time spent running groups, and time since the executor started.
+    uint64_t busyTime;
+    uint64_t elapsedTime;
+
+  // Fraction of the time spent running groups, in percent.
+    uint8_t get_utilization() const{
+      return (elapsedTime == 0)? 0 : (uint8_t) (busyTime * 100 / elapsedTime);
+    }
+  };
+
+private:
+  class Worker {
+  public:
+    ProcessExecutor *executor;
+    WorkerIndex_t index;
+  // CPU to pin the worker to, or -1.
+    int cpu;
+    pthread_t thread;
+
+  // Deque of queued groups: the owner pops from the front, thieves from the back.
+    pthread_mutex_t dequeMutex;
+    ProcessGroup **deque;
+    GroupIndex_t dequeFront;
+    GroupIndex_t dequeSize;
+
+    uint64_t runCount;
+    uint64_t stealCount;
+    uint64_t busyTime;
+  };
+
+  Worker *workers;
+  WorkerIndex_t workerCount;
+
+// Static
+  DataStore::ArrayBuffer<ProcessGroup*, GroupIndex_t> groups;
+
+// Groups queued, across all deques.
+  uint32_t queuedCount;
+// Workers with nothing to do sleep on idleCondition.
+  pthread_mutex_t idleMutex;
+  pthread_cond_t idleCondition;
+  WorkerIndex_t sleepingCount;
+
+  bool running;
+  uint64_t startTime;
+  uint64_t stopTime;
+
+// Worker running on the current thread, if any.
+  static __thread Worker *currentWorker;
+
+public:
+
+  ProcessExecutor(ProcessGroup** const groups_buffer, const GroupIndex_t groups_buffer_capacity, const WorkerIndex_t worker_count);
+// Stops the workers, if running.
+  ~ProcessExecutor();
+
+// Groups may only be added while stopped. Each is queued to run once when started.
+  Status::Status_t addGroup(ProcessGroup* const new_group);
+
+// Pin a worker to a CPU (-1 to unpin), or every worker i to CPU i (modulo the CPU count).
+// Takes effect when started.
+  void pinWorker(const WorkerIndex_t worker, const int cpu);
+  void pinWorkers();
+
+  bool start();
+// Wait for every worker to finish the group it is running, and stop them.
+  void stop();
+
+  inline WorkerIndex_t get_workerCount() const{
+    return workerCount;
+  }
+  WorkerStats get_workerStats(const WorkerIndex_t worker) const;
+
+private:
+  friend class ProcessGroup;
+
+  void enqueue(ProcessGroup* const group, Worker* worker);
+  ProcessGroup* dequeue(Worker* const worker);
+  ProcessGroup* steal(Worker* const worker);
+  void sleep();
+  void joinWorkers(const WorkerIndex_t count);
+
+  static void* run(void* const worker);
+  static uint64_t get_time();
+};
+
@@ -0,0 +1 @@
+../../ReadyScheduler.hpp
\ No newline at end of file
@@ -9,6 +9,7 @@
 
 
 #include "SimpleServer.hpp"
+#include "QueuedServer.hpp"
 
 class EchoServer : public SimpleServer, public Process {
 public:
@@ -27,23 +28,8 @@ public:
 
     DEBUGprint_ESRV("EchSrv: proc pack\n");
 
-    MAP::MAPPacket *replyPacket;
-  // Attempt to prepare a reply packet large enough to contain the received packet's contents.
-  // Only works if the sender encapsulated a MAP-encoded destination address.
-  // Returns false if the source packet was invalid (not encapsulated, missing
-  // a dest address, dest address too long), or if the packet data could not
-  // be allocated.
-    MAP::Data_t* data_ptr = offsetPacket.packet->get_data(offsetPacket.headerOffset);
-    if(prepareReply(&replyPacket, offsetPacket.packet, offsetPacket.packet->back() - data_ptr)){
-
-  // Append the received packet contents.
-      for(; data_ptr < offsetPacket.packet->back(); data_ptr++)
-        replyPacket->sinkData(*data_ptr);
-
-  // Send the packet on its way.
-      sendPacket(replyPacket);
-    }else{
-      DEBUGprint_ESRV("EchSrv: reply prep fld\n");
+    if(! replyEcho()){
+      DEBUGprint_ESRV("EchSrv: reply fld\n");
     }
   // Finished with the source packet.
     finishedWithPacket();
@@ -51,3 +37,25 @@ public:
   }
 };
 
+// Echo server with a request backlog (see QueuedServer).
+class QueuedEchoServer : public QueuedServer {
+public:
+
+  QueuedEchoServer(MAPPacketSink *new_packetSink, MemoryPool *new_memoryPool, MAP::OffsetMAPPacket* const raw_request_buffer, const uint8_t request_buffer_capacity, const uint8_t new_requestBudget = 0)
+  : QueuedServer(new_memoryPool, new_packetSink, raw_request_buffer, request_buffer_capacity, new_requestBudget)
+  {
+    assert(new_memoryPool != NULL);
+  }
+
+protected:
+// Assumes the packet has been validated!!
+  Status::Status_t processRequest(){
+    DEBUGprint_ESRV("EchSrv: proc pack\n");
+
+    if(! replyEcho()){
+      DEBUGprint_ESRV("EchSrv: reply fld\n");
+    }
+    return Status::Status__Good;
+  }
+};
+
@@ -0,0 +1,119 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Fundamental MAP servers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Queued server
+//
+// SimpleServer that queues incoming requests, rather than refusing a request that arrives while
+// another is pending. process() handles queued requests, one after another, until the queue is
+// empty or the request budget runs out. A full queue refuses requests as Busy (so that a
+// MAPPacketBuffer in front of the server retries them), and counts them.
+//
+// Subclasses implement processRequest(), which handles the current request (in offsetPacket,
+// as for SimpleServer) using the usual SimpleServer reply helpers.
+
+#pragma once
+
+#include "SimpleServer.hpp"
+
+class QueuedServer : public SimpleServer, public Process {
+private:
+  DataStore::RingBuffer<MAP::OffsetMAPPacket, uint8_t> requestQueue;
+// Max requests handled per process() call; 0 for no limit.
+  uint8_t requestBudget;
+
+// Statistics
+  uint8_t maxQueueDepth;
+  uint32_t rejectedCount;
+
+public:
+
+  QueuedServer(MemoryPool* const new_memoryPool, MAP::MAPPacketSink* const new_outputPacketSink, MAP::OffsetMAPPacket* const raw_request_buffer, const uint8_t request_buffer_capacity, const uint8_t new_requestBudget = 0)
+  : SimpleServer(new_memoryPool, new_outputPacketSink),
+    requestQueue(raw_request_buffer, request_buffer_capacity),
+    requestBudget(new_requestBudget),
+    maxQueueDepth(0), rejectedCount(0)
+  {
+    assert(request_buffer_capacity > 0);
+  }
+
+// Dereferences any requests still queued.
+  ~QueuedServer(){
+    finishedWithPacket();
+    while(! requestQueue.is_empty()){
+      MAP::MAPPacket *packet = requestQueue.get_in_place().packet;
+      requestQueue.increment_read_position();
+      MAP::dereferencePacket(packet);
+    }
+  }
+
+  void set_requestBudget(const uint8_t new_requestBudget){
+    requestBudget = new_requestBudget;
+  }
+
+// Requests queued (not counting the one in progress, if any).
+  inline uint8_t get_queueDepth() const{
+    return requestQueue.get_size();
+  }
+// Deepest the queue has been since the last reset.
+  inline uint8_t get_maxQueueDepth() const{
+    return maxQueueDepth;
+  }
+// Requests refused (Busy) because the queue was full.
+  inline uint32_t get_rejectedCount() const{
+    return rejectedCount;
+  }
+  void resetStatistics(){
+    maxQueueDepth = requestQueue.get_size();
+    rejectedCount = 0;
+  }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+    if(requestQueue.is_full()){
+      rejectedCount++;
+      return Status::Status__Busy;
+    }
+
+  // Note packet in use.
+    MAP::referencePacket(packet);
+    requestQueue.sinkData(MAP::OffsetMAPPacket(packet, headerOffset));
+    if(requestQueue.get_size() > maxQueueDepth)
+      maxQueueDepth = requestQueue.get_size();
+
+    signalReady();
+    return Status::Status__Good;
+  }
+
+  Status::Status_t process(){
+    for(uint8_t count = 0; requestBudget == 0 || count < requestBudget; count++){
+    // Take the next request, unless one was left in progress.
+      if(offsetPacket.packet == NULL){
+        if(requestQueue.is_empty())
+          break;
+      // The queue's reference passes to offsetPacket.
+        offsetPacket = requestQueue.get_in_place();
+        requestQueue.increment_read_position();
+      }
+
+    // Busy: leave the request in progress, to be continued on the next call.
+      if(processRequest() == Status::Status__Busy){
+        signalReady();
+        return Status::Status__Good;
+      }
+    // Finished with the request (if the subclass hasn't already said so).
+      finishedWithPacket();
+    }
+
+  // Run again while requests remain.
+    if(! requestQueue.is_empty())
+      signalReady();
+    return Status::Status__Good;
+  }
+
+protected:
+// Handle the request in offsetPacket. Return Busy to be called again with the same request
+// (e.g. if a reply could not be sent yet); otherwise the request is finished.
+  virtual Status::Status_t processRequest() = 0;
+};
+
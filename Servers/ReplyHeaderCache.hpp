@@ -0,0 +1,121 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Fundamental MAP servers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Reply header cache
+//
+// Remembers the reply headers SimpleServer::prepareReply built for recent requesters, so that a
+// repeat request (e.g. from a polling client) is answered by copying the cached reply headers,
+// rather than re-parsing the request's header chain.
+//
+// Entries are keyed by the request's header bytes (everything before the packet contents). The
+// reply headers depend on nothing else, and a request beginning with exactly those bytes has
+// exactly that header chain, so a key matches a request by a plain compare of its first bytes.
+// Entries are replaced round-robin.
+//
+// Requests with headers longer than MaxHeaderLength are not cached.
+
+#pragma once
+
+#ifndef REPLY_HEADER_CACHE_ENTRIES
+#define REPLY_HEADER_CACHE_ENTRIES 4
+#endif
+#ifndef REPLY_HEADER_CACHE_MAX_HEADER_LENGTH
+#define REPLY_HEADER_CACHE_MAX_HEADER_LENGTH 16
+#endif
+
+#include <Upacket/MAP/MAP.hpp>
+
+class ReplyHeaderCache {
+public:
+  static const uint8_t EntryCount = REPLY_HEADER_CACHE_ENTRIES;
+  static const uint8_t MaxHeaderLength = REPLY_HEADER_CACHE_MAX_HEADER_LENGTH;
+
+  struct Entry {
+  // Request headers.
+    uint8_t requestLength;
+    MAP::Data_t requestHeaders[MaxHeaderLength];
+  // Reply headers (never longer than the request headers); 0 length marks an empty entry.
+    uint8_t replyLength;
+    MAP::Data_t replyHeaders[MaxHeaderLength];
+  };
+
+private:
+  Entry entries[EntryCount];
+// Next entry to replace.
+  uint8_t victim;
+
+  uint32_t hits;
+  uint32_t misses;
+
+public:
+
+  ReplyHeaderCache()
+  : victim(0), hits(0), misses(0)
+  {
+    clear();
+  }
+
+  inline uint32_t get_hits() const{
+    return hits;
+  }
+  inline uint32_t get_misses() const{
+    return misses;
+  }
+// Hits, in percent of lookups.
+  uint8_t get_hitRate() const{
+    uint32_t lookups = hits + misses;
+    return (lookups == 0)? 0 : (uint8_t) ((uint64_t) hits * 100 / lookups);
+  }
+  void resetCounters(){
+    hits = 0;
+    misses = 0;
+  }
+
+  void clear(){
+    for(uint8_t i = 0; i < EntryCount; i++)
+      entries[i].replyLength = 0;
+  }
+
+// Find the entry whose request headers begin the packet, or NULL.
+  const Entry* lookup(MAP::MAPPacket* const packet){
+    MAP::Data_t *headers = packet->front();
+    for(uint8_t i = 0; i < EntryCount; i++){
+      Entry &entry = entries[i];
+      if(entry.replyLength != 0 && entry.requestLength <= packet->get_size()
+        && entry.requestHeaders[0] == headers[0]
+        && memcmp(entry.requestHeaders, headers, entry.requestLength) == 0){
+        hits++;
+        return &entry;
+      }
+    }
+    misses++;
+    return NULL;
+  }
+
+// Claim an entry for the request headers (copied now, as the caller may overwrite them);
+// the reply headers are to be filled in with set_reply. Returns NULL if too long to cache.
+  Entry* insert(const MAP::Data_t* const request_headers, const uint16_t request_length){
+    if(request_length == 0 || request_length > MaxHeaderLength)
+      return NULL;
+
+    Entry &entry = entries[victim];
+    victim = (victim + 1) % EntryCount;
+
+    entry.requestLength = request_length;
+    memcpy(entry.requestHeaders, request_headers, request_length);
+  // Left empty until the reply is set.
+    entry.replyLength = 0;
+    return &entry;
+  }
+
+// Fill in (or, if too long, drop) a claimed entry's reply headers.
+  static void set_reply(Entry* const entry, const MAP::Data_t* const reply_headers, const uint16_t reply_length){
+    if(entry == NULL || reply_length == 0 || reply_length > MaxHeaderLength)
+      return;
+    entry->replyLength = reply_length;
+    memcpy(entry->replyHeaders, reply_headers, reply_length);
+  }
+};
+
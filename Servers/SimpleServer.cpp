@@ -25,6 +25,21 @@ bool SimpleServer::prepareReply(MAP::MAPPacket **replyPacket_ptr_ptr, MAP::MAPPa
 
   MAP::MAPPacket *replyPacket;
 
+// No request (e.g. already consumed by an in-place reply)?
+  if(srcPacket == NULL)
+    return false;
+
+// Repeat requester? Start the reply with the cached reply headers.
+  const ReplyHeaderCache::Entry *cached = (replyHeaderCache == NULL)? NULL : replyHeaderCache->lookup(srcPacket);
+  if(cached != NULL){
+    DEBUGprint_SS("SS:pR: cchd\n");
+    if(! allocateNewPacket(&replyPacket, cached->replyLength + data_capacity))
+      return false;
+    replyPacket->sinkBlock(cached->replyHeaders, cached->replyLength);
+    *replyPacket_ptr_ptr = replyPacket;
+    return true;
+  }
+
   DEBUGprint_SS("SS:pR: try alloc pack\n");
 
   // Attempt to allocate reply packet.
@@ -51,17 +66,10 @@ bool SimpleServer::prepareReply(MAP::MAPPacket **replyPacket_ptr_ptr, MAP::MAPPa
 //      DEBUGprint_SS("prepareReply: Header byte sunk.\n");
 
       // Copy src address from incoming packet to outgoing replyPacket (as dest address).
-      for(MAP::Data_t *src_data_ptr = srcPacket->get_srcAddress(srcHeader); src_data_ptr < srcPacket->back(); src_data_ptr++){
-      // Attempt to sink the dest address byte.
-        if(! replyPacket->sinkExpand(*src_data_ptr, IncrementReplyPacketCapacity))
-          break;
-
-      // Stop copying address if have reached last C78 byte.
-        if(Code78::isLastByte(*src_data_ptr)){
+      MAP::DataView srcAddress = srcPacket->get_srcAddressView(srcHeader);
+      if(srcAddress.is_valid() && replyPacket->sinkBlock(srcAddress.data, srcAddress.length, IncrementReplyPacketCapacity)){
       // Note that a src address was found and copied successfully.
-          successful_preparation = true;
-          break;
-        }
+        successful_preparation = true;
       }
 
   // Check for errors
@@ -89,12 +97,122 @@ bool SimpleServer::prepareReply(MAP::MAPPacket **replyPacket_ptr_ptr, MAP::MAPPa
     return false;
   }
 
+// Remember the reply headers (everything so far) for repeat requests.
+  if(replyHeaderCache != NULL){
+    MAP::Data_t *contents = srcPacket->get_data(srcPacket->get_first_header());
+    if(contents != NULL)
+      ReplyHeaderCache::set_reply(replyHeaderCache->insert(srcPacket->front(), contents - srcPacket->front()), replyPacket->front(), replyPacket->get_size());
+  }
+
 // Success!
   DEBUGprint_SS("SS:pR: prep succeed\n");
   *replyPacket_ptr_ptr = replyPacket;
   return true;
 }
 
+// Attempt to prepare a reply packet by rewriting the received packet in place, rather than
+// allocating a new one. Only possible if the received packet is referenced by this server alone.
+// As for prepareReply, each src address becomes a dest address. If keep_contents is true, the
+// packet contents follow the reply headers; otherwise they are dropped, and data_capacity is
+// made available instead.
+// On success, the server is finished with the received packet, which becomes the (unreferenced)
+// reply packet. On failure, the received packet is left untouched.
+bool SimpleServer::prepareReplyInPlace(MAP::MAPPacket **replyPacket_ptr_ptr, uint16_t data_capacity, bool keep_contents){
+  MAP::MAPPacket *packet = offsetPacket.packet;
+  if(packet == NULL || packet->get_referenceCount() != 1)
+    return false;
+
+// Lengths of the request headers, and of the reply headers to replace them.
+  uint16_t request_length;
+  uint16_t reply_length;
+
+// Repeat requester? The cached reply headers are copied over the request headers.
+  const ReplyHeaderCache::Entry *cached = (replyHeaderCache == NULL)? NULL : replyHeaderCache->lookup(packet);
+  if(cached != NULL){
+    request_length = cached->requestLength;
+    reply_length = cached->replyLength;
+  }else{
+    MAP::Data_t *contents = packet->get_data(offsetPacket.headerOffset);
+    if(contents == NULL)
+      return false;
+    request_length = contents - packet->front();
+
+  // Check the src addresses before touching the packet, so that a failure leaves it intact.
+    reply_length = 0;
+    for(MAP::Data_t* srcHeader = packet->get_first_header(); srcHeader != NULL; srcHeader = packet->get_next_header(srcHeader)){
+      if(MAP::get_srcAddressPresent(*srcHeader)){
+        MAP::DataView srcAddress = packet->get_srcAddressView(srcHeader);
+      // This implementation only supports addy types 0 to 14 (not Expanded).
+        if(MAP::get_addressType(*srcHeader) > 14 || ! srcAddress.is_valid())
+          return false;
+        reply_length += 1 + srcAddress.length;
+      }
+    }
+    if(reply_length == 0)
+      return false;
+  }
+
+// Make sure sufficient data capacity will be left available, also before touching the packet.
+// (Growing the packet keeps its contents, but may move them.)
+  if(! keep_contents){
+    MAP::MAPPacket::Capacity_t required_capacity = reply_length + data_capacity;
+    if(required_capacity < data_capacity || (packet->get_capacity() < required_capacity && ! packet->set_capacity(required_capacity))){
+      DEBUGprint_SS("SS:pRIP: expnsn fld\n");
+      return false;
+    }
+  }
+
+  MAP::Data_t *contents = packet->front() + request_length;
+  MAP::Data_t *reply_ptr;
+  if(cached != NULL){
+    DEBUGprint_SS("SS:pRIP: cchd\n");
+    memcpy(packet->front(), cached->replyHeaders, reply_length);
+    reply_ptr = packet->front() + reply_length;
+  }else{
+    DEBUGprint_SS("SS:pRIP: rwrt\n");
+
+  // Note the request headers before they are overwritten.
+    ReplyHeaderCache::Entry *entry = (replyHeaderCache == NULL)? NULL : replyHeaderCache->insert(packet->front(), request_length);
+
+  // Each reply header (header byte plus address) is no longer than the request header it
+  // replaces, so the reply headers can be written front to back over the request headers.
+    reply_ptr = packet->front();
+    MAP::Data_t *srcHeader = packet->get_first_header();
+    while(srcHeader != NULL){
+    // Find the next header before this one is overwritten.
+      MAP::Data_t *nextHeader = packet->get_next_header(srcHeader);
+
+      if(MAP::get_srcAddressPresent(*srcHeader)){
+        MAP::DataView srcAddress = packet->get_srcAddressView(srcHeader);
+        *reply_ptr = MAP::DestAddressPresent_Mask | MAP::get_addressType(*srcHeader);
+        memmove(reply_ptr + 1, srcAddress.data, srcAddress.length);
+        reply_ptr += 1 + srcAddress.length;
+      }
+
+      srcHeader = nextHeader;
+    }
+
+    ReplyHeaderCache::set_reply(entry, packet->front(), reply_length);
+  }
+
+  if(keep_contents){
+  // Move the contents (in the head buffer; any chained segments follow on as before).
+    uint16_t contents_size = packet->back() - contents;
+    memmove(reply_ptr, contents, contents_size);
+    packet->set_size(reply_length + contents_size);
+  }else{
+    packet->truncate(reply_length);
+  }
+
+// Hand the server's reference over to the reply.
+  packet->sinkStatus(Status::Status__Complete);
+  packet->decrementReferenceCount();
+  offsetPacket.packet = NULL;
+
+  *replyPacket_ptr_ptr = packet;
+  return true;
+}
+
 // Prepare a boolean reply packet.
 // Packet contains a single byte, 1 for true, 0 for false.
 bool SimpleServer::replyBoolean(bool value){
@@ -120,6 +238,53 @@ bool SimpleServer::replyC78(uint32_t value){
   return sendPacket(replyPacket);
 }
 
+// As replyBoolean, but turns the received packet around in place if possible.
+bool SimpleServer::replyBooleanInPlace(bool value){
+  DEBUGprint_SS("rBIP:%d;", (value? 1:0));
+  MAP::MAPPacket *replyPacket;
+  if(! prepareReplyInPlace(&replyPacket, sizeof(bool), false))
+    return replyBoolean(value);
+  if(! replyPacket->sinkBool(value)){ MAP::dereferencePacket(replyPacket); return false; }
+  return sendPacket(replyPacket);
+}
+
+// As replyC78, but turns the received packet around in place if possible.
+bool SimpleServer::replyC78InPlace(uint32_t value){
+  DEBUGprint_SS("rCIP:%d;", value);
+  MAP::MAPPacket *replyPacket;
+  if(! prepareReplyInPlace(&replyPacket, sizeof(uint32_t), false))
+    return replyC78(value);
+  if(! replyPacket->sinkC78(value)){ MAP::dereferencePacket(replyPacket); return false; }
+  return sendPacket(replyPacket);
+}
+
+// Prepare a reply packet containing the received packet's contents.
+// The received packet is turned around in place if possible (see prepareReplyInPlace).
+// Assumes the packet has been validated!!
+bool SimpleServer::replyEcho(){
+  MAP::MAPPacket *replyPacket;
+  if(prepareReplyInPlace(&replyPacket, 0, true))
+    return sendPacket(replyPacket);
+
+  // Attempt to prepare a reply packet large enough to contain the received packet's contents.
+  // Only works if the sender encapsulated a MAP-encoded destination address.
+  // Returns false if the source packet was invalid (not encapsulated, missing
+  // a dest address, dest address too long), or if the packet data could not
+  // be allocated.
+  MAP::Data_t* data_ptr = offsetPacket.packet->get_data(offsetPacket.headerOffset);
+  if(! prepareReply(&replyPacket, offsetPacket.packet, offsetPacket.packet->back() - data_ptr)) return false;
+
+  // Append the received packet contents: the rest of the head buffer, then any chained
+  // segments (chained on to the reply in turn, rather than growing its head buffer).
+  MAP::MAPPacket::RunIterator run(*offsetPacket.packet, data_ptr);
+  do{
+    if(! replyPacket->sinkSegmented(run.front(), run.back() - run.front())){ MAP::dereferencePacket(replyPacket); return false; }
+  }while(run.next());
+
+  // Send the packet on its way.
+  return sendPacket(replyPacket);
+}
+
 namespace Debug {
   void printC78S(const uint8_t* buf, uint16_t buf_len){
     for(; buf_len > 0; buf_len--){
@@ -137,6 +302,7 @@ bool SimpleServer::replyC78String(const uint8_t* buf, uint16_t buf_len){
   MAP::MAPPacket *replyPacket;
 
   // Sink string length in C78. Educated guess as to C78 size.
+  // Always allocated, as buf may point into the received packet.
   if(! SimpleServer::prepareReply(&replyPacket, offsetPacket.packet, 1 + buf_len)) return false;
   if(! replyPacket->sinkC78(buf_len)){ MAP::dereferencePacket(replyPacket); return false; }
 
@@ -7,9 +7,11 @@
 
 #include <ATcommon/DataStore/Buffer.hpp>
 #include <Upacket/MAP/MAP.hpp>
+#include "ReplyHeaderCache.hpp"
 
 // SimpleServer class
-class SimpleServer : public MAP::MAPPacketSink {
+// Under a ReadyScheduler, subclasses that are Processes are run when a packet is sunk.
+class SimpleServer : public MAP::MAPPacketSink, public ReadySignal {
 protected:
 // Memory pool (from which packets are sourced)
   MemoryPool *memoryPool;
@@ -17,6 +19,8 @@ protected:
   MAP::MAPPacketSink *outputPacketSink;
 // Incoming packet container
   MAP::OffsetMAPPacket offsetPacket;
+// Reply headers for repeat requesters (optional)
+  ReplyHeaderCache *replyHeaderCache;
 
   static const uint8_t InitialReplyPacketCapacity = 8;
   static const uint8_t IncrementReplyPacketCapacity = 8;
@@ -25,9 +29,16 @@ public:
 
   SimpleServer(MemoryPool *new_memoryPool = NULL, MAP::MAPPacketSink *new_outputPacketSink = NULL)
   : memoryPool(new_memoryPool), outputPacketSink(new_outputPacketSink),
-    offsetPacket(NULL, 0)
+    offsetPacket(NULL, 0),
+    replyHeaderCache(NULL)
   { }
 
+// Cache the reply headers built for requesters (NULL for none). The cache may be shared
+// between servers.
+  void set_replyHeaderCache(ReplyHeaderCache* const new_replyHeaderCache){
+    replyHeaderCache = new_replyHeaderCache;
+  }
+
   inline Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
     if(offsetPacket.packet != NULL)
       return Status::Status__Bad;
@@ -36,6 +47,7 @@ public:
     offsetPacket.headerOffset = headerOffset;
 // Note packet in use.
     MAP::referencePacket(offsetPacket.packet);
+    signalReady();
 
     return Status::Status__Good;
   }
@@ -72,8 +84,16 @@ protected:
   }
 
   bool prepareReply(MAP::MAPPacket **replyPacket, MAP::MAPPacket *packet, uint16_t data_capacity);
+// prepareReplyInPlace, replyBooleanInPlace, replyC78InPlace and replyEcho may turn the received
+// packet itself into the reply, consuming the request: once a reply has been prepared,
+// offsetPacket.packet may be NULL, even if the reply then fails to be filled in or sent. A reply
+// that cannot be prepared leaves the request intact. The other reply helpers never consume it.
+  bool prepareReplyInPlace(MAP::MAPPacket **replyPacket, uint16_t data_capacity, bool keep_contents);
   bool replyBoolean(bool value);
   bool replyC78(uint32_t value);
+  bool replyBooleanInPlace(bool value);
+  bool replyC78InPlace(uint32_t value);
   bool replyC78String(const uint8_t* buf, uint16_t buf_len);
+  bool replyEcho();
 };
 
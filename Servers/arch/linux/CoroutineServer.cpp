@@ -0,0 +1,183 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Fundamental MAP servers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+#include <ATcommon/arch/linux/linux.hpp>
+#include "CoroutineServer.hpp"
+
+/* CoroutineFramePool */
+
+__thread CoroutineFramePool::FreeFrame *CoroutineFramePool::freeFrames[CoroutineFramePool::ClassCount];
+__thread uint32_t CoroutineFramePool::heapAllocationCount = 0;
+
+void* CoroutineFramePool::allocate(const size_t size){
+  size_t frameClass = (size - 1) / ClassSize;
+  if(frameClass >= ClassCount)
+    return malloc(size);
+
+// Reuse a freed frame of the same class, if any.
+  FreeFrame *frame = freeFrames[frameClass];
+  if(frame != NULL){
+    freeFrames[frameClass] = frame->next;
+    return frame;
+  }
+
+  heapAllocationCount++;
+  return malloc((frameClass + 1) * ClassSize);
+}
+
+void CoroutineFramePool::deallocate(void* const frame, const size_t size){
+  size_t frameClass = (size - 1) / ClassSize;
+  if(frameClass >= ClassCount){
+    free(frame);
+    return;
+  }
+
+  FreeFrame *freeFrame = (FreeFrame*) frame;
+  freeFrame->next = freeFrames[frameClass];
+  freeFrames[frameClass] = freeFrame;
+}
+
+/* ServerTask */
+
+ServerTask::promise_type::~promise_type(){
+  if(server != NULL)
+    server->handlerCount--;
+}
+
+/* CoroutineServer */
+
+CoroutineServer::~CoroutineServer(){
+  destroyWaiters(requestWaiters, false);
+  destroyWaiters(allocationWaiters, false);
+  destroyWaiters(sendWaiters, true);
+
+  while(! requestQueue.is_empty()){
+    MAP::MAPPacket *packet = requestQueue.get_in_place().packet;
+    requestQueue.increment_read_position();
+    MAP::dereferencePacket(packet);
+  }
+}
+
+bool CoroutineServer::spawn(ServerTask task){
+  if(! task.handle)
+    return false;
+
+  std::coroutine_handle<ServerTask::promise_type> handle = task.handle;
+  task.handle = std::coroutine_handle<ServerTask::promise_type>();
+  handle.promise().server = this;
+  handlerCount++;
+
+// Run until the handler first waits (or returns).
+  handle.resume();
+  return true;
+}
+
+Status::Status_t CoroutineServer::sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+  if(requestQueue.is_full()){
+    rejectedCount++;
+    return Status::Status__Busy;
+  }
+
+// Note packet in use. Handlers are only resumed from process().
+  MAP::referencePacket(packet);
+  requestQueue.sinkData(MAP::OffsetMAPPacket(packet, headerOffset));
+  signalReady();
+  return Status::Status__Good;
+}
+
+Status::Status_t CoroutineServer::process(){
+// Sends first (freeing output capacity and memory), then allocations, then new requests.
+  retryWaiters(sendWaiters);
+  retryWaiters(allocationWaiters);
+
+// Hand out requests, in order, to the handlers waiting longest.
+  while(! requestQueue.is_empty() && ! requestWaiters.is_empty()){
+    Waiter *waiter = requestWaiters.pop();
+    waiter->retry();
+    waiter->handle.resume();
+  }
+
+// Poll again while handlers wait on memory or output.
+  if(! sendWaiters.is_empty() || ! allocationWaiters.is_empty())
+    signalReady();
+  return Status::Status__Good;
+}
+
+bool CoroutineServer::takeRequest(CoroutineRequest &request){
+  if(requestQueue.is_empty())
+    return false;
+
+// The queue's reference passes to the request.
+  request = CoroutineRequest(requestQueue.get_in_place());
+  requestQueue.increment_read_position();
+  return true;
+}
+
+bool CoroutineServer::tryAllocateReply(MAP::MAPPacket* const requestPacket, const uint16_t data_capacity, uint8_t &attemptCount, MAP::MAPPacket* &replyPacket){
+  if(requestPacket != NULL && prepareReply(&replyPacket, requestPacket, data_capacity))
+    return true;
+
+// Nowhere to reply to (no point waiting), or given up.
+  attemptCount++;
+  if(requestPacket == NULL || attemptCount >= MaxAllocationAttempts || ! hasReplyAddress(requestPacket)){
+    replyPacket = NULL;
+    return true;
+  }
+  return false;
+}
+
+bool CoroutineServer::trySend(MAP::MAPPacket* const packet, Status::Status_t &sinkStatus){
+  sinkStatus = outputPacketSink->sinkPacket(packet);
+  if(sinkStatus == Status::Status__Busy)
+    return false;
+
+  MAP::dereferencePacket(packet);
+  return true;
+}
+
+// Retry each waiter once, resuming those done. Waiters added meanwhile (by the handlers
+// resumed) wait for the next call.
+void CoroutineServer::retryWaiters(WaiterList &waiters){
+  WaiterList retrying = waiters;
+  waiters = WaiterList();
+
+  for(Waiter *waiter = retrying.pop(); waiter != NULL; waiter = retrying.pop()){
+    if(waiter->retry())
+      waiter->handle.resume();
+    else
+      waiters.push(waiter);
+  }
+}
+
+void CoroutineServer::destroyWaiters(WaiterList &waiters, const bool abandon_sends){
+  for(Waiter *waiter = waiters.pop(); waiter != NULL; waiter = waiters.pop()){
+    if(abandon_sends)
+      ((SendAwaiter*) waiter)->abandon();
+  // The waiter lives in the frame.
+    waiter->handle.destroy();
+  }
+}
+
+// Whether prepareReply could ever succeed (a src address of a supported type is present).
+bool CoroutineServer::hasReplyAddress(MAP::MAPPacket* const packet){
+// Map the header chain once, rather than re-walking it for each header's src address.
+  MAP::HeaderMap headerMap(*packet);
+  for(uint8_t i = 0; i < headerMap.depth; i++){
+    const MAP::HeaderFields &fields = headerMap.headers[i];
+    if(fields.is_present(MAP::HeaderFields::SrcAddress_Mask) && MAP::get_addressType(packet->front()[fields.header]) <= 14 && packet->get_c78View(packet->front() + fields.srcAddress).is_valid())
+      return true;
+  }
+  if(headerMap.complete)
+    return false;
+
+// Deeper than the map: walk the rest.
+  MAP::Data_t *header = packet->get_next_header(packet->front() + headerMap.headers[headerMap.depth - 1].header);
+  for(; header != NULL; header = packet->get_next_header(header)){
+    if(MAP::get_srcAddressPresent(*header) && MAP::get_addressType(*header) <= 14 && packet->get_srcAddressView(header).is_valid())
+      return true;
+  }
+  return false;
+}
+
@@ -0,0 +1,415 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Fundamental MAP servers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Coroutine server (linux)
+//
+// Servers written as coroutines (handlers), rather than as hand-rolled state machines. A handler
+// co_awaits the next request, the allocation of a reply (waiting for pool memory if need be),
+// and the sending of the reply (waiting for output capacity if need be). While it waits, the
+// server's process() runs the other handlers; everything runs on the usual Process loop, with no
+// threads.
+//
+// Any number of handlers may be spawned on a server, each serving one request at a time; a waiting
+// handler costs only its (small) frame. Frames come from a pooled allocator (CoroutineFramePool),
+// so that handlers can come and go without going back to the heap.
+//
+// For example:
+//
+//   ServerTask echoHandler(CoroutineServer &server){
+//     for(;;){
+//       CoroutineRequest request = co_await server.nextRequest();
+//       MAP::MAPPacket *reply = co_await server.allocateReply(request, request.get_dataSize());
+//       if(reply == NULL)
+//         continue;
+//       reply->sinkBlock(request.get_data(), request.get_dataSize());
+//       co_await server.send(reply);
+//     }
+//   }
+//
+//   for(uint16_t i = 0; i < 1000; i++)
+//     server.spawn(echoHandler(server));
+//
+// Handlers may only co_await the server's own awaitables. Handlers still waiting when the server
+// is destroyed are destroyed with it (along with any requests and replies they hold).
+//
+// Requires C++20 coroutines (-std=c++20).
+
+#pragma once
+
+#if ! defined(__cpp_impl_coroutine)
+#error "CoroutineServer requires C++20 coroutines."
+#endif
+
+#include <coroutine>
+#include <utility>
+#include <stdlib.h>
+
+#include <ATcommon/DataStore/RingBuffer.hpp>
+#include <Upacket/Servers/SimpleServer.hpp>
+
+// Pooled allocator for coroutine frames.
+// Frames are pooled by size, in classes of ClassSize bytes; freed frames are kept for reuse
+// rather than returned to the heap. Larger frames are not pooled.
+// Each thread has its own pool (a frame may be freed into a different thread's pool).
+class CoroutineFramePool {
+public:
+  static const size_t ClassSize = 64;
+// Frames of up to 1KiB are pooled.
+  static const uint8_t ClassCount = 16;
+
+  static void* allocate(const size_t size);
+  static void deallocate(void* const frame, const size_t size);
+
+// Frames allocated from the heap (rather than reused), by the current thread.
+  static inline uint32_t get_heapAllocationCount(){
+    return heapAllocationCount;
+  }
+
+private:
+  class FreeFrame {
+  public:
+    FreeFrame *next;
+  };
+
+  static __thread FreeFrame *freeFrames[ClassCount];
+  static __thread uint32_t heapAllocationCount;
+};
+
+class CoroutineServer;
+
+// Coroutine handler, to be spawned on a CoroutineServer.
+class ServerTask {
+public:
+  class promise_type {
+  public:
+    CoroutineServer *server;
+
+    promise_type()
+    : server(NULL)
+    { }
+    ~promise_type();
+
+    ServerTask get_return_object(){
+      return ServerTask(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+  // Frame allocation failed; the task is empty (and won't spawn).
+    static ServerTask get_return_object_on_allocation_failure(){
+      return ServerTask();
+    }
+  // Handlers start running when spawned, and are destroyed when they return.
+    std::suspend_always initial_suspend() noexcept{
+      return std::suspend_always();
+    }
+    std::suspend_never final_suspend() noexcept{
+      return std::suspend_never();
+    }
+    void return_void(){ }
+    void unhandled_exception(){
+      abort();
+    }
+
+    static void* operator new(const size_t size) noexcept{
+      return CoroutineFramePool::allocate(size);
+    }
+    static void operator delete(void* const frame, const size_t size){
+      CoroutineFramePool::deallocate(frame, size);
+    }
+  };
+
+  ServerTask()
+  : handle()
+  { }
+  ServerTask(ServerTask &&other)
+  : handle(other.handle)
+  {
+    other.handle = std::coroutine_handle<promise_type>();
+  }
+// A task never spawned is destroyed with its ServerTask.
+  ~ServerTask(){
+    if(handle)
+      handle.destroy();
+  }
+
+private:
+  friend class CoroutineServer;
+
+  std::coroutine_handle<promise_type> handle;
+
+  explicit ServerTask(const std::coroutine_handle<promise_type> new_handle)
+  : handle(new_handle)
+  { }
+  ServerTask(const ServerTask&);
+  ServerTask& operator=(const ServerTask&);
+};
+
+// A request, held by a handler. The handler is finished with the request when the
+// CoroutineRequest is destroyed (or finished() is called).
+class CoroutineRequest {
+  MAP::OffsetMAPPacket offsetPacket;
+
+public:
+
+  CoroutineRequest()
+  : offsetPacket(NULL, 0)
+  { }
+// Takes over the reference to the packet.
+  explicit CoroutineRequest(const MAP::OffsetMAPPacket &new_offsetPacket)
+  : offsetPacket(new_offsetPacket)
+  { }
+  CoroutineRequest(CoroutineRequest &&other)
+  : offsetPacket(other.offsetPacket)
+  {
+    other.offsetPacket.packet = NULL;
+  }
+  CoroutineRequest& operator=(CoroutineRequest &&other){
+    if(this != &other){
+      finished();
+      offsetPacket = other.offsetPacket;
+      other.offsetPacket.packet = NULL;
+    }
+    return *this;
+  }
+  ~CoroutineRequest(){
+    finished();
+  }
+
+  inline MAP::MAPPacket* get_packet() const{
+    return offsetPacket.packet;
+  }
+  inline MAP::MAPPacket::HeaderOffset_t get_headerOffset() const{
+    return offsetPacket.headerOffset;
+  }
+// The request contents (after the MAP headers), in the head buffer.
+  inline MAP::Data_t* get_data() const{
+    return (offsetPacket.packet == NULL)? NULL : offsetPacket.packet->get_data(offsetPacket.headerOffset);
+  }
+  inline uint16_t get_dataSize() const{
+    MAP::Data_t *data = get_data();
+    return (data == NULL)? 0 : offsetPacket.packet->back() - data;
+  }
+
+  void finished(){
+    if(offsetPacket.packet != NULL){
+      offsetPacket.packet->sinkStatus(Status::Status__Complete);
+      MAP::dereferencePacket(offsetPacket.packet);
+      offsetPacket.packet = NULL;
+    }
+  }
+
+private:
+  CoroutineRequest(const CoroutineRequest&);
+  CoroutineRequest& operator=(const CoroutineRequest&);
+};
+
+class CoroutineServer : public SimpleServer, public Process {
+public:
+// Max of 65535 handlers
+  typedef uint16_t HandlerCount_t;
+
+// Reply allocation is given up (NULL) after this many failed attempts.
+  static const uint8_t MaxAllocationAttempts = 255;
+
+private:
+// A suspended handler, waiting on the server. Waiters live in the handlers' frames.
+  class Waiter {
+  public:
+    Waiter *next;
+    std::coroutine_handle<> handle;
+
+    Waiter()
+    : next(NULL)
+    { }
+  // Try again to complete the wait; true once complete (and the handler can be resumed).
+    virtual bool retry() = 0;
+  };
+
+  class WaiterList {
+    Waiter *head;
+    Waiter *tail;
+
+  public:
+    WaiterList()
+    : head(NULL), tail(NULL)
+    { }
+
+    inline bool is_empty() const{
+      return (head == NULL);
+    }
+    void push(Waiter* const waiter){
+      waiter->next = NULL;
+      if(tail == NULL)
+        head = waiter;
+      else
+        tail->next = waiter;
+      tail = waiter;
+    }
+    Waiter* pop(){
+      Waiter *waiter = head;
+      if(waiter != NULL){
+        head = waiter->next;
+        if(head == NULL)
+          tail = NULL;
+      }
+      return waiter;
+    }
+  };
+
+// Static
+  DataStore::RingBuffer<MAP::OffsetMAPPacket, uint8_t> requestQueue;
+
+  WaiterList requestWaiters;
+  WaiterList allocationWaiters;
+  WaiterList sendWaiters;
+
+  HandlerCount_t handlerCount;
+  uint32_t rejectedCount;
+
+public:
+
+  class RequestAwaiter : public Waiter {
+    CoroutineServer *server;
+    CoroutineRequest request;
+
+  public:
+    explicit RequestAwaiter(CoroutineServer* const new_server)
+    : server(new_server)
+    { }
+
+    bool retry(){
+      return server->takeRequest(request);
+    }
+
+    bool await_ready(){
+      return retry();
+    }
+    void await_suspend(const std::coroutine_handle<> new_handle){
+      handle = new_handle;
+      server->requestWaiters.push(this);
+    }
+    CoroutineRequest await_resume(){
+      return std::move(request);
+    }
+  };
+
+  class AllocationAwaiter : public Waiter {
+    CoroutineServer *server;
+    MAP::MAPPacket *requestPacket;
+    uint16_t dataCapacity;
+    uint8_t attemptCount;
+    MAP::MAPPacket *replyPacket;
+
+  public:
+    AllocationAwaiter(CoroutineServer* const new_server, MAP::MAPPacket* const new_requestPacket, const uint16_t new_dataCapacity)
+    : server(new_server), requestPacket(new_requestPacket), dataCapacity(new_dataCapacity),
+      attemptCount(0), replyPacket(NULL)
+    { }
+
+    bool retry(){
+      return server->tryAllocateReply(requestPacket, dataCapacity, attemptCount, replyPacket);
+    }
+
+    bool await_ready(){
+      return retry();
+    }
+    void await_suspend(const std::coroutine_handle<> new_handle){
+      handle = new_handle;
+      server->allocationWaiters.push(this);
+      server->signalReady();
+    }
+    MAP::MAPPacket* await_resume(){
+      return replyPacket;
+    }
+  };
+
+  class SendAwaiter : public Waiter {
+    CoroutineServer *server;
+    MAP::MAPPacket *packet;
+    Status::Status_t sinkStatus;
+
+  public:
+    SendAwaiter(CoroutineServer* const new_server, MAP::MAPPacket* const new_packet)
+    : server(new_server), packet(new_packet), sinkStatus(Status::Status__Busy)
+    {
+    // Hold the packet until sent.
+      MAP::referencePacket(packet);
+    }
+
+    bool retry(){
+      return server->trySend(packet, sinkStatus);
+    }
+  // Handler destroyed while waiting.
+    void abandon(){
+      MAP::dereferencePacket(packet);
+    }
+
+    bool await_ready(){
+      return retry();
+    }
+    void await_suspend(const std::coroutine_handle<> new_handle){
+      handle = new_handle;
+      server->sendWaiters.push(this);
+      server->signalReady();
+    }
+    bool await_resume(){
+      return (sinkStatus == Status::Status__Good);
+    }
+  };
+
+  CoroutineServer(MemoryPool* const new_memoryPool, MAP::MAPPacketSink* const new_outputPacketSink, MAP::OffsetMAPPacket* const raw_request_buffer, const uint8_t request_buffer_capacity)
+  : SimpleServer(new_memoryPool, new_outputPacketSink),
+    requestQueue(raw_request_buffer, request_buffer_capacity),
+    handlerCount(0), rejectedCount(0)
+  {
+    assert(new_memoryPool != NULL && request_buffer_capacity > 0);
+  }
+// Destroys the handlers still waiting, and dereferences any requests still queued.
+  ~CoroutineServer();
+
+// Start a handler. It runs (from within spawn) until it first waits.
+// Returns false if the handler's frame could not be allocated.
+  bool spawn(ServerTask task);
+
+// Wait for the next request (resumes with a CoroutineRequest).
+  inline RequestAwaiter nextRequest(){
+    return RequestAwaiter(this);
+  }
+// Wait for a reply packet to the request, with at least data_capacity available (resumes with
+// the reply, or NULL if the request has nowhere to reply to or allocation keeps failing).
+  inline AllocationAwaiter allocateReply(const CoroutineRequest &request, const uint16_t data_capacity){
+    return AllocationAwaiter(this, request.get_packet(), data_capacity);
+  }
+// Wait for the output sink to accept the packet (resumes with true if sunk as Good).
+// The packet is dereferenced once sent.
+  inline SendAwaiter send(MAP::MAPPacket* const packet){
+    return SendAwaiter(this, packet);
+  }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset);
+  Status::Status_t process();
+
+// Handlers spawned and not yet returned.
+  inline HandlerCount_t get_handlerCount() const{
+    return handlerCount;
+  }
+// Requests queued, waiting for a handler.
+  inline uint8_t get_queueDepth() const{
+    return requestQueue.get_size();
+  }
+// Requests refused (Busy) because the queue was full.
+  inline uint32_t get_rejectedCount() const{
+    return rejectedCount;
+  }
+
+private:
+  friend class ServerTask::promise_type;
+
+  bool takeRequest(CoroutineRequest &request);
+  bool tryAllocateReply(MAP::MAPPacket* const requestPacket, const uint16_t data_capacity, uint8_t &attemptCount, MAP::MAPPacket* &replyPacket);
+  bool trySend(MAP::MAPPacket* const packet, Status::Status_t &sinkStatus);
+  void retryWaiters(WaiterList &waiters);
+  void destroyWaiters(WaiterList &waiters, const bool abandon_sends);
+  static bool hasReplyAddress(MAP::MAPPacket* const packet);
+};
+
@@ -0,0 +1 @@
+../../QueuedServer.hpp
\ No newline at end of file
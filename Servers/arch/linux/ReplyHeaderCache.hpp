@@ -0,0 +1 @@
+../../ReplyHeaderCache.hpp
\ No newline at end of file
@@ -0,0 +1,121 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// AddressClassifier differential test (linux)
+//
+// Checks the classifier against AddressFilter::isMatch, over random edge tables (built whole,
+// then changed an edge at a time, growing past the bitmap width) and random dest addresses:
+// the edges walked by nextMatch must be exactly, and in the same order as, the edges a scan
+// matches.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -I<path containing Upacket/ and ATcommon/> test/AddressClassifierTest.cpp -o AddressClassifierTest
+//   ./AddressClassifierTest
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/Routing/arch/linux/AddressGraph.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+
+static const uint32_t Rounds = 200;
+static const uint32_t MaxEdges = 300;
+static const uint32_t ChangesPerRound = 100;
+static const uint32_t AddressesPerCheck = 64;
+
+// Deterministic xorshift PRNG, so failures reproduce.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+// Random edge, biased toward the cases that matter: few types and values (so edges collide),
+// negation, masks, and the odd invalid mode.
+static AddressFilter randomEdge(){
+  AddressFilter::Mode_t mode = randomWord() % 5;
+  if(randomWord() % 3 == 0)
+    mode |= AddressFilter::ModeMask__Negate;
+  uint8_t mask = (randomWord() % 2)? 0xFF : (uint8_t) randomWord();
+  uint8_t value = (randomWord() % 2)? (randomWord() % 8) : (uint8_t) randomWord();
+  return AddressFilter(mode, randomWord() % 8, randomWord() % 18, value, mask, randomWord() % 2);
+}
+
+static uint32_t failures = 0;
+
+static void check(AddressClassifier<AddressFilter> &classifier, AddressFilter* const edges, const uint32_t edgeCount, const uint32_t round){
+  for(uint32_t a = 0; a < AddressesPerCheck; a++){
+  // A header's address type is 4 bits wide (edges may still name wider types).
+    uint8_t type = randomWord() % (MAP::AddressType_Mask + 1);
+    uint8_t value = (randomWord() % 2)? (randomWord() % 8) : (uint8_t) randomWord();
+
+    classifier.classify(type, value);
+    uint32_t match = classifier.nextMatch(0);
+    for(uint32_t i = 0; i < edgeCount; i++){
+      if(! edges[i].isMatch(type, &value))
+        continue;
+      if(match != i){
+        printf("round %u: type %u value 0x%02x: edge %u matches, classifier gave %d\n", round, type, value, i, (int) match);
+        failures++;
+        return;
+      }
+      match = classifier.nextMatch(i + 1);
+    }
+    if(match != AddressClassifier<AddressFilter>::NullIndex){
+      printf("round %u: type %u value 0x%02x: classifier matched edge %u, scan did not\n", round, type, value, match);
+      failures++;
+      return;
+    }
+  }
+}
+
+int main(){
+  MemoryPool memoryPool;
+  static AddressFilter edges[MaxEdges];
+
+  for(uint32_t round = 0; round < Rounds; round++){
+    AddressClassifier<AddressFilter> classifier(&memoryPool);
+
+    uint32_t edgeCount = randomWord() % 40;
+    for(uint32_t i = 0; i < edgeCount; i++)
+      edges[i] = randomEdge();
+    if(! classifier.compile(edges, edgeCount)){
+      printf("round %u: compile failed\n", round);
+      return 1;
+    }
+    check(classifier, edges, edgeCount, round);
+
+  // Change edges one at a time: append (growing the table), replace, or drop the last.
+    for(uint32_t change = 0; change < ChangesPerRound; change++){
+      uint32_t op = randomWord() % 4;
+      uint32_t i;
+      if((op == 0 || edgeCount == 0) && edgeCount < MaxEdges){
+        i = edgeCount++;
+        edges[i] = randomEdge();
+      }else if(op == 1 && edgeCount > 0){
+        i = --edgeCount;
+        edges[i] = AddressFilter();
+      }else{
+        i = randomWord() % edgeCount;
+        edges[i] = randomEdge();
+      }
+      if(! classifier.update(edges, edgeCount, i)){
+        printf("round %u: update failed\n", round);
+        return 1;
+      }
+      check(classifier, edges, edgeCount, round);
+    }
+  }
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok: %u rounds\n", Rounds);
+  return 0;
+}
+
@@ -0,0 +1,172 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// AddressEdgeIndex routing benchmark (linux)
+//
+// Builds AddressGraph edge tables of 16 to 100000 edges (masked-value edges over the whole
+// address space, with one MatchAll, AddressType, negated and wide-mask edge in every 4096),
+// then routes packets to random dest addresses through a linear scan and through an attached
+// edge index, and reports the cost per packet. Also reports the cost per sinkEdge with and
+// without the index attached (sinkEdge's own duplicate check is linear in the table).
+//
+// Also checks that both deliver the same packets, to the same sinks, in the same order.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/AddressEdgeIndexBench.cpp -o AddressEdgeIndexBench
+//   ./AddressEdgeIndexBench
+// Exits 0 if every check passed.
+
+#define ADDRESS_GRAPH_EDGE_INDEX_T uint32_t
+#define ADDRESS_GRAPH_MAX_EDGES 100000
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/Routing/arch/linux/AddressGraph.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <time.h>
+
+static const uint8_t SinkCount = 8;
+// The graph's own (command) address; bench packets use lower types.
+static const uint8_t LocalAddressType = 15;
+static const uint8_t LocalAddressValue = 0x7F;
+static const uint32_t AddressCount = 256;
+
+// Deterministic xorshift PRNG, so runs are comparable.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Deliveries, in order, folded into one running hash.
+static uint32_t deliveryCount = 0;
+static uint32_t deliveryHash = 0;
+
+class RecordingSink : public MAP::MAPPacketSink {
+public:
+  uint32_t id;
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const, MAP::MAPPacket::HeaderOffset_t headerOffset){
+    deliveryCount++;
+    deliveryHash = (deliveryHash * 31) ^ (id << 8) ^ headerOffset;
+    return Status::Status__Good;
+  }
+};
+
+static AddressFilter randomEdge(const uint32_t i){
+  uint8_t sinkIndex = i % SinkCount;
+  uint8_t type = randomWord() % (LocalAddressType - 1);
+  switch(i % 4096){
+    case 0: return AddressFilter(AddressFilter::Mode__MatchAll, sinkIndex);
+    case 1: return AddressFilter(AddressFilter::Mode__AddressType, sinkIndex, type);
+    case 2: return AddressFilter(AddressFilter::Mode__MaskedAddressValue | AddressFilter::ModeMask__Negate, sinkIndex, type, randomWord() & 0x7F, 0x7F);
+    case 3: return AddressFilter(AddressFilter::Mode__MaskedAddressValue, sinkIndex, type, randomWord() & 0x70, 0x70);
+  }
+// Distinct edges (by header offset), so that sinkEdge keeps them all.
+  return AddressFilter(AddressFilter::Mode__MaskedAddressValue, sinkIndex, type, randomWord() & 0x7F, 0x7F, i / 16384);
+}
+
+static uint32_t failures = 0;
+
+// Route every packet, repeats times; returns the time per packet.
+static double route(AddressGraph &graph, MAP::MAPPacket** const packets, const uint32_t repeats){
+  uint64_t start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < repeats; repeat++){
+    for(uint32_t a = 0; a < AddressCount; a++)
+      graph.sinkPacket(packets[a], 0);
+  }
+  return (double) (nanoseconds() - start) / ((double) repeats * AddressCount);
+}
+
+static void runEdges(const uint32_t edgeCount, DataStore::ArrayBuffer<MAP::MAPPacketSink*, uint8_t> &packetSinks, MAP::MAPPacket** const packets, MemoryPool &memoryPool){
+  AddressGraph graph(LocalAddressType, LocalAddressValue, &packetSinks, &memoryPool, edgeCount);
+  AddressGraph indexedGraph(LocalAddressType, LocalAddressValue, &packetSinks, &memoryPool, edgeCount);
+  AddressGraph::EdgeIndex edgeIndex(&memoryPool);
+  indexedGraph.set_edgeIndex(&edgeIndex);
+
+  uint32_t seed = randomState;
+  uint64_t start = nanoseconds();
+  for(uint32_t i = 0; i < edgeCount; i++)
+    graph.sinkEdge(randomEdge(i));
+  uint64_t scanBuild = nanoseconds() - start;
+
+  randomState = seed;
+  start = nanoseconds();
+  for(uint32_t i = 0; i < edgeCount; i++){
+    if(! indexedGraph.sinkEdge(randomEdge(i))){
+      printf("%u edges: sinkEdge failed\n", edgeCount);
+      failures++;
+      return;
+    }
+  }
+  uint64_t indexedBuild = nanoseconds() - start;
+
+// Same deliveries, in the same order.
+  deliveryCount = 0; deliveryHash = 0;
+  route(graph, packets, 1);
+  uint32_t scanCount = deliveryCount, scanHash = deliveryHash;
+  deliveryCount = 0; deliveryHash = 0;
+  route(indexedGraph, packets, 1);
+  if(deliveryCount != scanCount || deliveryHash != scanHash || ! edgeIndex.is_valid()){
+    printf("%u edges: index delivered %u packets, scan %u (or in another order)\n", edgeCount, deliveryCount, scanCount);
+    failures++;
+    return;
+  }
+
+// About the same total number of edge visits at each size.
+  uint32_t repeats = 200000 / edgeCount + 1;
+  double scan = route(graph, packets, repeats);
+  double indexed = route(indexedGraph, packets, repeats * 4);
+
+  printf("%6u edges: scan %9.0f ns/packet, index %6.0f ns/packet (%5.1f deliveries); sinkEdge %6.0f ns (%6.0f ns indexed)\n",
+    edgeCount, scan, indexed, (double) scanCount / AddressCount,
+    (double) scanBuild / edgeCount, (double) indexedBuild / edgeCount);
+
+  indexedGraph.set_edgeIndex(NULL);
+}
+
+int main(){
+  MemoryPool memoryPool;
+  static RecordingSink sinks[SinkCount];
+  static MAP::MAPPacketSink *sinkPointers[SinkCount];
+  for(uint8_t i = 0; i < SinkCount; i++){
+    sinks[i].id = i;
+    sinkPointers[i] = &sinks[i];
+  }
+  DataStore::ArrayBuffer<MAP::MAPPacketSink*, uint8_t> packetSinks(sinkPointers, SinkCount);
+  packetSinks.set_size(SinkCount);
+
+// Packets to random dest addresses, built up front.
+  static MAP::MAPPacket *packets[AddressCount];
+  for(uint32_t a = 0; a < AddressCount; a++){
+    MAP::allocateNewPacket(&packets[a], 8, &memoryPool);
+    packets[a]->sinkExpand(MAP::DestAddressPresent_Mask | (randomWord() % (LocalAddressType - 1)));
+    packets[a]->sinkC78(randomWord() & 0x7F);
+    packets[a]->sinkExpand(1);
+    MAP::referencePacket(packets[a]);
+  }
+
+  static const uint32_t EdgeCounts[] = { 16, 100, 1000, 10000, 100000 };
+  for(uint8_t i = 0; i < sizeof(EdgeCounts) / sizeof(EdgeCounts[0]); i++)
+    runEdges(EdgeCounts[i], packetSinks, packets, memoryPool);
+
+  for(uint32_t a = 0; a < AddressCount; a++)
+    MAP::dereferencePacket(packets[a]);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,211 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Code78 handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// C78 batch codec benchmark (linux)
+//
+// Times Code78::decodeArray and encodeArray against a loop of the scalar Code78::decode and
+// encode, over arrays of values of 1 byte, 1-2 bytes, 1-4 bytes and 64-bit values of any
+// width, and reports millions of values and gigabytes of decoded integers per second.
+//
+// Also checks that the batch and scalar codecs agree byte for byte and value for value,
+// for unsigned and signed (zigzag) values, and on input cut off mid-value.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -msse4.1 -I<path containing Upacket/ and ATcommon/> test/C78BatchBench.cpp -o C78BatchBench
+//   ./C78BatchBench
+// Build with -mavx2 for the 32-byte paths, or without -msse4.1 to time the scalar fallback.
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const uint32_t ValueCount = 1 << 20;
+static const uint32_t Repeats = 20;
+
+// Deterministic xorshift PRNG, so runs are comparable.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t failures = 0;
+
+// Scalar loops, as the batch codecs replace.
+template <typename Value_t>
+static uint32_t scalarDecode(const uint8_t *ptr, const uint8_t* const end, Value_t* const values, const uint32_t count){
+  uint32_t i = 0;
+  for(; i < count; i++){
+    uint8_t length = Code78::decodeValue(ptr, end, values[i]);
+    if(length == 0)
+      break;
+    ptr += length;
+  }
+  return i;
+}
+template <typename Value_t>
+static uint8_t* scalarEncode(const Value_t* const values, const uint32_t count, uint8_t *buf){
+  for(uint32_t i = 0; i < count; i++)
+    buf += Code78::encodeValue(values[i], buf);
+  return buf;
+}
+
+static void report(const char* const name, const char* const operation, const uint64_t batch, const uint64_t scalar, const uint8_t valueSize){
+  double values = (double) Repeats * ValueCount;
+  printf("%-10s %s %7.1f Mvalues/s, %5.2f GB/s (scalar %7.1f Mvalues/s, %5.2f GB/s)\n", name, operation,
+    values * 1000 / batch, values * valueSize / batch, values * 1000 / scalar, values * valueSize / scalar);
+}
+
+template <typename Value_t>
+static void runValues(const char* const name, const Value_t* const values, uint8_t* const encoded, uint8_t* const scalarEncoded, Value_t* const decoded){
+  const uint8_t *encodedEnd = encoded + ValueCount * Code78::MaxEncodedLength64;
+
+  uint8_t *buf = NULL;
+  uint64_t start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    buf = encoded;
+    Code78::encodeArray(values, ValueCount, buf, encodedEnd);
+  }
+  uint64_t batchEncode = nanoseconds() - start;
+  uint32_t length = buf - encoded;
+
+  uint8_t *scalarBuf = NULL;
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++)
+    scalarBuf = scalarEncode(values, ValueCount, scalarEncoded);
+  uint64_t scalarEncodeTime = nanoseconds() - start;
+
+  if((uint32_t) (scalarBuf - scalarEncoded) != length || memcmp(encoded, scalarEncoded, length) != 0){
+    printf("%s: encodings differ\n", name);
+    failures++;
+    return;
+  }
+
+  uint32_t count = 0;
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    const uint8_t *ptr = encoded;
+    count = Code78::decodeArray(ptr, encoded + length, decoded, ValueCount);
+  }
+  uint64_t batchDecode = nanoseconds() - start;
+
+  if(count != ValueCount || memcmp(decoded, values, ValueCount * sizeof(Value_t)) != 0){
+    printf("%s: batch decode differs\n", name);
+    failures++;
+    return;
+  }
+
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++)
+    count = scalarDecode(encoded, encoded + length, decoded, ValueCount);
+  uint64_t scalarDecodeTime = nanoseconds() - start;
+
+  if(count != ValueCount || memcmp(decoded, values, ValueCount * sizeof(Value_t)) != 0){
+    printf("%s: scalar decode differs\n", name);
+    failures++;
+    return;
+  }
+
+  report(name, "decode", batchDecode, scalarDecodeTime, sizeof(Value_t));
+  report(name, "encode", batchEncode, scalarEncodeTime, sizeof(Value_t));
+}
+
+// Short random arrays, signed and unsigned, whole and cut off mid-value.
+static void checkShortArrays(){
+  static const uint32_t MaxCount = 300;
+  uint32_t values[MaxCount], decoded[MaxCount + 1];
+  int32_t signedValues[MaxCount], signedDecoded[MaxCount];
+  uint8_t encoded[MaxCount * Code78::MaxEncodedLength32];
+
+  for(uint32_t round = 0; round < 20000; round++){
+    uint32_t count = randomWord() % MaxCount;
+    uint8_t width = randomWord() % 33;
+    for(uint32_t i = 0; i < count; i++){
+      values[i] = (width == 0)? 0 : randomWord() >> (32 - width);
+      signedValues[i] = (i & 1)? - (int32_t) (values[i] >> 1) : (int32_t) (values[i] >> 1);
+    }
+
+    uint8_t *buf = encoded;
+    Code78::encodeArray(values, count, buf, encoded + sizeof(encoded));
+    uint32_t length = buf - encoded;
+    const uint8_t *ptr = encoded;
+    if(Code78::decodeArray(ptr, encoded + length, decoded, count) != count || ptr != encoded + length
+       || memcmp(decoded, values, count * sizeof(uint32_t)) != 0){
+      printf("round %u: round trip failed\n", round);
+      failures++;
+      return;
+    }
+  // Cut off mid-value: every value but the last decodes, as with the scalar decoder.
+    if(length > 0){
+      ptr = encoded;
+      if(Code78::decodeArray(ptr, encoded + length - 1, decoded, count) != count - 1){
+        printf("round %u: cut-off input decoded wrongly\n", round);
+        failures++;
+        return;
+      }
+    }
+
+    buf = encoded;
+    Code78::encodeArraySigned(signedValues, count, buf, encoded + sizeof(encoded));
+    ptr = encoded;
+    if(Code78::decodeArraySigned(ptr, buf, signedDecoded, count) != count
+       || memcmp(signedDecoded, signedValues, count * sizeof(int32_t)) != 0){
+      printf("round %u: signed round trip failed\n", round);
+      failures++;
+      return;
+    }
+  }
+}
+
+int main(){
+  uint8_t *encoded = (uint8_t*) malloc(ValueCount * Code78::MaxEncodedLength64);
+  uint8_t *scalarEncoded = (uint8_t*) malloc(ValueCount * Code78::MaxEncodedLength64);
+  uint32_t *values = (uint32_t*) malloc(ValueCount * sizeof(uint32_t));
+  uint32_t *decoded = (uint32_t*) malloc(ValueCount * sizeof(uint32_t));
+  uint64_t *values64 = (uint64_t*) malloc(ValueCount * sizeof(uint64_t));
+  uint64_t *decoded64 = (uint64_t*) malloc(ValueCount * sizeof(uint64_t));
+// Fault the pages in before timing.
+  memset(encoded, 0, ValueCount * Code78::MaxEncodedLength64);
+  memset(scalarEncoded, 0, ValueCount * Code78::MaxEncodedLength64);
+  memset(decoded, 0, ValueCount * sizeof(uint32_t));
+  memset(decoded64, 0, ValueCount * sizeof(uint64_t));
+
+  checkShortArrays();
+
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() & 0x7F;
+  runValues("1 byte", values, encoded, scalarEncoded, decoded);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() >> (18 + randomWord() % 14);
+  runValues("1-2 bytes", values, encoded, scalarEncoded, decoded);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() >> (4 + randomWord() % 28);
+  runValues("1-4 bytes", values, encoded, scalarEncoded, decoded);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values64[i] = (((uint64_t) randomWord() << 32) | randomWord()) >> (randomWord() % 64);
+  runValues("64-bit", values64, encoded, scalarEncoded, decoded64);
+
+  free(encoded); free(scalarEncoded);
+  free(values); free(decoded);
+  free(values64); free(decoded64);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
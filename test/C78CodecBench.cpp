@@ -0,0 +1,193 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// C78 codec benchmark (linux)
+//
+// Times MAPPacket::sinkC78 and sourceC78 against the byte-at-a-time versions they replaced
+// (one sinkExpand per byte; one branch per byte), over values of 1, 2 and 5 encoded bytes
+// and of random widths, and reports the cost per value.
+//
+// Also checks that both encoders write the same bytes and both decoders read back the
+// same values, and that 64-bit values survive sinkC78_64/sourceC78_64.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/C78CodecBench.cpp -o C78CodecBench
+//   ./C78CodecBench
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <time.h>
+
+static const uint32_t ValueCount = 8192;
+static const uint32_t Repeats = 200;
+// Room for ValueCount values of the longest (5-byte) encoding.
+static const MAP::MAPPacket::Capacity_t PacketCapacity = ValueCount * Code78::MaxEncodedLength32;
+
+// Deterministic xorshift PRNG, so runs are comparable.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The replaced encoder: count the extra bytes, then sink each byte separately.
+static bool baselineSinkC78(MAP::MAPPacket &packet, const uint32_t value){
+  uint8_t extraBytes = 0;
+  for(uint32_t tmpValue = value >> 7; tmpValue > 0; tmpValue >>= 7)
+    extraBytes++;
+  for(; extraBytes > 0; extraBytes--){
+    if(! packet.sinkExpand((value >> (7 * extraBytes)) | 0x80, 1, PacketCapacity)) return false;
+  }
+  return packet.sinkExpand(value & 0x7F, 1, PacketCapacity);
+}
+
+// The replaced decoder: one byte, and one branch, at a time.
+static bool baselineSourceC78(MAP::MAPPacket &packet, uint32_t &value, MAP::Data_t*& data_ptr){
+  if(data_ptr == NULL || data_ptr >= packet.back())
+    return false;
+  value = 0;
+  while(data_ptr < packet.back()){
+    value |= *data_ptr & 0x7F;
+    if(!(*data_ptr & 0x80))
+      break;
+    value <<= 7;
+    data_ptr++;
+  }
+  return (data_ptr < packet.back());
+}
+
+static uint32_t failures = 0;
+// Keeps decoded values live.
+static volatile uint32_t sink;
+
+static void runValues(const char* const name, const uint32_t* const values, MAP::MAPPacket &packet, MAP::MAPPacket &baselinePacket){
+  uint64_t start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    baselinePacket.set_size(0);
+    for(uint32_t i = 0; i < ValueCount; i++)
+      baselineSinkC78(baselinePacket, values[i]);
+  }
+  uint64_t baselineSink = nanoseconds() - start;
+
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    packet.set_size(0);
+    for(uint32_t i = 0; i < ValueCount; i++)
+      packet.sinkC78(values[i], 1, PacketCapacity);
+  }
+  uint64_t codecSink = nanoseconds() - start;
+
+  if(packet.get_size() != baselinePacket.get_size() || memcmp(packet.front(), baselinePacket.front(), packet.get_size()) != 0){
+    printf("%s: encodings differ\n", name);
+    failures++;
+    return;
+  }
+
+  uint32_t sum = 0;
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    MAP::Data_t *data_ptr = baselinePacket.front();
+    uint32_t value;
+    for(uint32_t i = 0; i < ValueCount && baselineSourceC78(baselinePacket, value, data_ptr); i++, data_ptr++)
+      sum += value;
+  }
+  uint64_t baselineSource = nanoseconds() - start;
+  sink = sum;
+
+  sum = 0;
+  start = nanoseconds();
+  for(uint32_t repeat = 0; repeat < Repeats; repeat++){
+    MAP::Data_t *data_ptr = packet.front();
+    uint32_t value;
+    for(uint32_t i = 0; i < ValueCount && packet.sourceC78(value, data_ptr); i++, data_ptr++)
+      sum += value;
+  }
+  uint64_t codecSource = nanoseconds() - start;
+  sink = sum;
+
+  MAP::Data_t *data_ptr = packet.front();
+  for(uint32_t i = 0; i < ValueCount; i++, data_ptr++){
+    uint32_t value;
+    if(! packet.sourceC78(value, data_ptr) || value != values[i]){
+      printf("%s: value %u decoded wrongly\n", name, i);
+      failures++;
+      return;
+    }
+  }
+
+  double perValue = 1.0 / ((double) Repeats * ValueCount);
+  printf("%-10s sink %5.2f ns/value (was %5.2f), source %5.2f ns/value (was %5.2f)\n", name,
+    codecSink * perValue, baselineSink * perValue, codecSource * perValue, baselineSource * perValue);
+}
+
+// Round trip random 64-bit values of every width.
+static void check64(MAP::MAPPacket &packet){
+  static uint64_t values[ValueCount / 2];
+  packet.set_size(0);
+  for(uint32_t i = 0; i < ValueCount / 2; i++){
+    values[i] = (((uint64_t) randomWord() << 32) | randomWord()) >> (randomWord() % 64);
+    if(! packet.sinkC78_64(values[i], 1, PacketCapacity)){
+      printf("64-bit: sink failed\n");
+      failures++;
+      return;
+    }
+  }
+  MAP::Data_t *data_ptr = packet.front();
+  for(uint32_t i = 0; i < ValueCount / 2; i++, data_ptr++){
+    uint64_t value;
+    if(! packet.sourceC78_64(value, data_ptr) || value != values[i]){
+      printf("64-bit: value %u decoded wrongly\n", i);
+      failures++;
+      return;
+    }
+  }
+}
+
+int main(){
+  MemoryPool memoryPool;
+  MAP::MAPPacket *packet, *baselinePacket;
+  if(! (MAP::allocateNewPacket(&packet, PacketCapacity, &memoryPool) && MAP::allocateNewPacket(&baselinePacket, PacketCapacity, &memoryPool))){
+    printf("allocation failed\n");
+    return 1;
+  }
+  MAP::referencePacket(packet);
+  MAP::referencePacket(baselinePacket);
+
+  static uint32_t values[ValueCount];
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() & 0x7F;
+  runValues("1 byte", values, *packet, *baselinePacket);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = 0x80 + randomWord() % (0x4000 - 0x80);
+  runValues("2 bytes", values, *packet, *baselinePacket);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() | 0xF0000000;
+  runValues("5 bytes", values, *packet, *baselinePacket);
+  for(uint32_t i = 0; i < ValueCount; i++)
+    values[i] = randomWord() >> (randomWord() % 32);
+  runValues("mixed", values, *packet, *baselinePacket);
+
+  check64(*packet);
+
+  MAP::dereferencePacket(packet);
+  MAP::dereferencePacket(baselinePacket);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
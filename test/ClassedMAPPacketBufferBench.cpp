@@ -0,0 +1,205 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// ClassedMAPPacketBuffer control latency benchmark (linux)
+//
+// Feeds a link that sends BytesPerTick bytes per tick with bulk packets (BulkSize bytes, at 50%
+// to 150% of the link's rate) and small control packets (one every ControlPeriod ticks, as
+// AddressGraph commands or server replies would be), through a single FIFO MAPPacketBuffer and
+// through a ClassedMAPPacketBuffer under strict priority and under deficit round-robin. Reports
+// the control packets' p50/p99 latency (in ticks, as measured at the link) and the share of
+// bulk packets refused, and the classed buffer's own control-class p99 (from its histogram).
+//
+// Also checks that the classed buffers refuse no control packets, and pass every packet they
+// accept on to the link.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/ClassedMAPPacketBufferBench.cpp -o ClassedMAPPacketBufferBench
+//   ./ClassedMAPPacketBufferBench
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/MAP/arch/linux/ClassedMAPPacketBuffer.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const uint32_t BytesPerTick = 16;
+static const uint16_t BulkSize = 64;
+static const uint16_t ControlSize = 8;
+static const uint32_t ControlPeriod = 50;
+static const uint32_t Ticks = 500000;
+static const uint32_t MaxControlPackets = Ticks / ControlPeriod + 1;
+
+static const uint8_t BulkAddressType = 1;
+static const uint8_t CommandAddressType = 4;
+static const uint8_t CommandAddressValue = 0;
+
+static const uint8_t ControlDepth = 16;
+static const uint8_t BulkDepth = 64;
+
+// Deterministic xorshift PRNG, so runs are comparable.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint32_t failures = 0;
+
+class TickClock : public MAP::ProcessClock {
+public:
+  Time_t tick;
+
+  TickClock() : tick(0) { }
+
+  Time_t get_time(){
+    return tick;
+  }
+};
+
+// Sends one packet at a time, taking a tick per BytesPerTick; Busy while sending.
+class Link : public MAP::MAPPacketSink {
+public:
+  TickClock *clock;
+  uint32_t busyUntil;
+  uint32_t sent;
+  uint32_t *controlLatencies;
+  uint32_t controlCount;
+
+  Link(TickClock* const new_clock)
+  : clock(new_clock), busyUntil(0), sent(0), controlCount(0)
+  {
+    controlLatencies = (uint32_t*) malloc(MaxControlPackets * sizeof(uint32_t));
+  }
+  ~Link(){
+    free(controlLatencies);
+  }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t){
+    if(clock->tick < busyUntil)
+      return Status::Status__Busy;
+    busyUntil = clock->tick + (packet->get_size() + BytesPerTick - 1) / BytesPerTick;
+    sent++;
+
+  // Payload: header, dest address, then the tick the packet was offered in.
+    if(MAP::get_addressType(*packet->front()) == CommandAddressType && controlCount < MaxControlPackets){
+      MAP::Data_t *data_ptr = packet->front() + 2;
+      uint32_t offerTick = 0;
+      packet->sourceC78(offerTick, data_ptr);
+      controlLatencies[controlCount++] = clock->tick - offerTick;
+    }
+    return Status::Status__Good;
+  }
+};
+
+static MAP::MAPPacket* newPacket(const uint8_t addressType, const uint8_t address, const uint16_t size, const uint32_t tick, MemoryPool &memoryPool){
+  MAP::MAPPacket *packet;
+  if(! MAP::allocateNewPacket(&packet, size, &memoryPool))
+    return NULL;
+  packet->sinkExpand(MAP::DestAddressPresent_Mask | addressType);
+  packet->sinkC78(address);
+  packet->sinkC78(tick);
+  while(packet->get_size() < size)
+    packet->sinkExpand(0);
+  return packet;
+}
+
+static int compareLatencies(const void *a, const void *b){
+  uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+  return (x < y)? -1 : (x > y);
+}
+
+// Offer bulk at load (percent of the link's rate) and control traffic for Ticks ticks, then drain.
+template <typename Buffer_t>
+static void runLoad(const char* const name, Buffer_t &buffer, Link &link, TickClock &clock, const uint32_t load, MemoryPool &memoryPool,
+                    MAP::PacketClass* const controlClass){
+  uint32_t bulkOffered = 0, bulkRefused = 0, controlOffered = 0, controlRefused = 0;
+// Bulk packets due, in hundredths.
+  uint32_t bulkCredit = 0;
+  for(; clock.tick < Ticks; clock.tick++){
+    bulkCredit += load * BytesPerTick / BulkSize;
+  // Randomly spread the arrivals.
+    while(bulkCredit >= 100 && randomWord() % 2 == 0){
+      bulkCredit -= 100;
+      MAP::MAPPacket *packet = newPacket(BulkAddressType, randomWord() & 0x7F, BulkSize, clock.tick, memoryPool);
+      MAP::referencePacket(packet);
+      bulkOffered++;
+      if(buffer.sinkPacket(packet, 0) == Status::Status__Busy)
+        bulkRefused++;
+      MAP::dereferencePacket(packet);
+    }
+    if(clock.tick % ControlPeriod == 0){
+      MAP::MAPPacket *packet = newPacket(CommandAddressType, CommandAddressValue, ControlSize, clock.tick, memoryPool);
+      MAP::referencePacket(packet);
+      controlOffered++;
+      if(buffer.sinkPacket(packet, 0) == Status::Status__Busy)
+        controlRefused++;
+      MAP::dereferencePacket(packet);
+    }
+    buffer.process();
+  }
+  for(; buffer.get_backlog() > 0; clock.tick++)
+    buffer.process();
+
+  uint32_t accepted = bulkOffered - bulkRefused + controlOffered - controlRefused;
+  if(link.sent != accepted || (controlClass != NULL && controlRefused > 0)){
+    printf("%s, load %u%%: %u accepted, %u sent, %u control packets refused\n", name, load, accepted, link.sent, controlRefused);
+    failures++;
+  }
+
+  qsort(link.controlLatencies, link.controlCount, sizeof(uint32_t), compareLatencies);
+  printf("%-23s load %3u%%: control p50 %4u, p99 %4u ticks (%u of %u refused); bulk %5.1f%% refused", name, load,
+    link.controlLatencies[link.controlCount / 2], link.controlLatencies[link.controlCount * 99 / 100], controlRefused, controlOffered,
+    100.0 * bulkRefused / bulkOffered);
+  if(controlClass != NULL)
+    printf("; histogram p99 < %u", controlClass->get_latencyPercentile(99) + 1);
+  printf("\n");
+}
+
+static const uint32_t Loads[] = { 50, 90, 100, 150 };
+
+int main(){
+  MemoryPool memoryPool;
+
+  for(uint8_t i = 0; i < sizeof(Loads) / sizeof(Loads[0]); i++){
+    TickClock clock;
+    Link link(&clock);
+    static MAP::OffsetMAPPacket rawBuffer[ControlDepth + BulkDepth];
+    MAP::MAPPacketBuffer buffer(&link, rawBuffer, ControlDepth + BulkDepth);
+    runLoad("FIFO", buffer, link, clock, Loads[i], memoryPool, NULL);
+  }
+
+  for(MAP::ClassedMAPPacketBuffer::Scheduling_t scheduling = MAP::ClassedMAPPacketBuffer::Scheduling__StrictPriority;
+      scheduling <= MAP::ClassedMAPPacketBuffer::Scheduling__DeficitRoundRobin; scheduling++){
+    for(uint8_t i = 0; i < sizeof(Loads) / sizeof(Loads[0]); i++){
+      TickClock clock;
+      Link link(&clock);
+      static MAP::TimedOffsetMAPPacket controlBuffer[ControlDepth], bulkBuffer[BulkDepth];
+      MAP::PacketClass controlClass(controlBuffer, ControlDepth, ControlSize);
+      MAP::PacketClass bulkClass(bulkBuffer, BulkDepth, BulkSize);
+      MAP::PacketClass *classes[2];
+      MAP::PacketClassRule rules[1];
+      MAP::ClassedMAPPacketBuffer buffer(&link, classes, 2, rules, 1, scheduling);
+      buffer.addClass(&controlClass);
+      buffer.addClass(&bulkClass);
+      buffer.addRule(MAP::PacketClassRule(0, MAP::PacketClassRule::Match__AddressType | MAP::PacketClassRule::Match__DestAddress,
+                                          CommandAddressType, CommandAddressValue));
+      buffer.set_defaultClass(1);
+      buffer.set_clock(&clock);
+      runLoad((scheduling == MAP::ClassedMAPPacketBuffer::Scheduling__StrictPriority)? "classed, strict" : "classed, round-robin",
+        buffer, link, clock, Loads[i], memoryPool, &controlClass);
+    }
+  }
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,271 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// Concurrent MAP packet buffer benchmark (linux)
+//
+// Hands packets through SpscMAPPacketBuffer and MpscMAPPacketBuffer and reports packets/sec
+// and the p50/p99 handoff latency (from sinkPacket/sinkPackets on the producer to the sink's
+// sinkPacket on the consumer):
+//   - on one thread, alternating producer and consumer, against MAPPacketBuffer;
+//   - saturated, with one producer thread (packet at a time, and batches of 16) and with 1, 2
+//     and 4 producer threads on the MPSC buffer;
+//   - paced (one packet every PacedInterval ns), with the consumer spinning and with it
+//     blocked in wait() for an eventfd wakeup.
+//
+// Also checks that every packet arrives exactly once, and in order from each producer.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/ConcurrentMAPPacketBufferBench.cpp -o ConcurrentMAPPacketBufferBench -lpthread
+//   ./ConcurrentMAPPacketBufferBench [packets]
+// Exits 0 if every check passed. Threaded figures are only meaningful with a core per thread.
+
+#define MAP_THREADSAFE_REFERENCES
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/MAP/arch/linux/ConcurrentMAPPacketBuffer.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+static const uint8_t MaxProducers = 4;
+static const uint32_t BufferCapacity = 1024;
+// More than a buffer's worth per producer, so no packet is restamped while still buffered.
+static const uint32_t PoolSize = 2 * BufferCapacity;
+static const uint8_t BatchSize = 16;
+static const uint32_t PacedInterval = 20000;
+static const uint32_t PacedPackets = 20000;
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t failures = 0;
+
+// Each packet carries its producer, sequence number and send time (in place of a header).
+struct Stamp {
+  uint8_t producer;
+  uint32_t sequence;
+  uint64_t sendTime;
+};
+
+static void stamp(MAP::MAPPacket* const packet, const uint8_t producer, const uint32_t sequence){
+  Stamp packetStamp = { producer, sequence, nanoseconds() };
+  memcpy(packet->front(), &packetStamp, sizeof(packetStamp));
+}
+
+// Records handoff latencies, and checks each producer's sequence.
+class TimingSink : public MAP::MAPPacketSink {
+public:
+  uint32_t *latencies;
+  uint32_t latencyCapacity;
+  uint32_t received;
+  uint32_t nextSequence[MaxProducers];
+  bool inOrder;
+
+  TimingSink(const uint32_t capacity)
+  : latencyCapacity(capacity), received(0), inOrder(true)
+  {
+    latencies = (uint32_t*) malloc(capacity * sizeof(uint32_t));
+    memset(nextSequence, 0, sizeof(nextSequence));
+  }
+  ~TimingSink(){
+    free(latencies);
+  }
+
+// Run on the consumer thread only.
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t){
+    Stamp packetStamp;
+    memcpy(&packetStamp, packet->front(), sizeof(packetStamp));
+    uint64_t now = nanoseconds();
+    if(packetStamp.producer >= MaxProducers || packetStamp.sequence != nextSequence[packetStamp.producer])
+      inOrder = false;
+    else
+      nextSequence[packetStamp.producer]++;
+    if(received < latencyCapacity)
+      latencies[received] = (uint32_t) (now - packetStamp.sendTime);
+    __atomic_store_n(&received, received + 1, __ATOMIC_RELEASE);
+    return Status::Status__Good;
+  }
+};
+
+static int compareLatencies(const void *a, const void *b){
+  uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+  return (x < y)? -1 : (x > y);
+}
+
+static void report(const char* const name, TimingSink &sink, const uint32_t packetCount, const uint64_t elapsed){
+  uint32_t count = (packetCount < sink.latencyCapacity)? packetCount : sink.latencyCapacity;
+  qsort(sink.latencies, count, sizeof(uint32_t), compareLatencies);
+  printf("%-28s %7.2f Mpkt/s, handoff p50 %8u ns, p99 %8u ns\n", name, packetCount * 1000.0 / elapsed,
+    sink.latencies[count / 2], sink.latencies[count * 99 / 100]);
+  if(sink.received != packetCount || ! sink.inOrder){
+    printf("%s: received %u of %u packets (or out of order)\n", name, sink.received, packetCount);
+    failures++;
+  }
+}
+
+// Producer packets, stamped and reused round-robin.
+static MAP::MAPPacket *pools[MaxProducers][PoolSize];
+
+struct Producer {
+  MAP::MAPPacketSink *buffer;
+  uint8_t id;
+  uint32_t packetCount;
+  uint8_t batchSize;
+// Nonzero to send one packet every interval ns.
+  uint32_t interval;
+};
+
+static void* produce(void* const argument){
+  const Producer &producer = *(const Producer*) argument;
+  MAP::OffsetMAPPacket batch[BatchSize];
+  uint64_t nextSend = nanoseconds();
+  for(uint32_t sent = 0; sent < producer.packetCount; ){
+    if(producer.interval != 0){
+      while(nanoseconds() < nextSend)
+        sched_yield();
+      nextSend += producer.interval;
+    }
+    uint16_t count = (producer.packetCount - sent < producer.batchSize)? producer.packetCount - sent : producer.batchSize;
+    for(uint16_t i = 0; i < count; i++){
+      MAP::MAPPacket *packet = pools[producer.id][(sent + i) % PoolSize];
+      stamp(packet, producer.id, sent + i);
+      batch[i] = MAP::OffsetMAPPacket(packet, 0);
+    }
+    uint16_t sunk = producer.buffer->sinkPackets(batch, count);
+    sent += sunk;
+    if(sunk < count)
+      sched_yield();
+  }
+  return NULL;
+}
+
+// Spin (or, with wakeups, block) on the buffer until every packet has been passed on.
+template <typename Buffer_t>
+static void consume(Buffer_t &buffer, TimingSink &sink, const uint32_t packetCount, const bool blocking){
+  while(__atomic_load_n(&sink.received, __ATOMIC_ACQUIRE) < packetCount){
+    if(buffer.is_empty()){
+      if(blocking)
+        buffer.wait();
+      else
+        sched_yield();
+    }
+    buffer.process();
+  }
+}
+
+template <typename Buffer_t>
+static void runThreaded(const char* const name, const uint8_t producerCount, const uint32_t packetsPerProducer,
+                        const uint8_t batchSize, const uint32_t interval, const bool blocking){
+  uint32_t packetCount = producerCount * packetsPerProducer;
+  TimingSink sink(packetCount);
+  Buffer_t buffer(&sink, BufferCapacity, blocking);
+
+  Producer producers[MaxProducers];
+  pthread_t threads[MaxProducers];
+  uint64_t start = nanoseconds();
+  for(uint8_t i = 0; i < producerCount; i++){
+    producers[i].buffer = &buffer;
+    producers[i].id = i;
+    producers[i].packetCount = packetsPerProducer;
+    producers[i].batchSize = batchSize;
+    producers[i].interval = interval;
+    pthread_create(&threads[i], NULL, produce, &producers[i]);
+  }
+  consume(buffer, sink, packetCount, blocking);
+  uint64_t elapsed = nanoseconds() - start;
+  for(uint8_t i = 0; i < producerCount; i++)
+    pthread_join(threads[i], NULL);
+
+  report(name, sink, packetCount, elapsed);
+}
+
+// Producer and consumer alternating on this thread: the handoff cost alone.
+template <typename Buffer_t>
+static void runAlternating(const char* const name, Buffer_t &buffer, TimingSink &sink, const uint32_t packetCount){
+  MAP::OffsetMAPPacket batch[BatchSize];
+  uint64_t start = nanoseconds();
+  for(uint32_t sent = 0; sent < packetCount; ){
+    uint16_t count = (packetCount - sent < BatchSize)? packetCount - sent : BatchSize;
+    for(uint16_t i = 0; i < count; i++){
+      MAP::MAPPacket *packet = pools[0][(sent + i) % PoolSize];
+      stamp(packet, 0, sent + i);
+      batch[i] = MAP::OffsetMAPPacket(packet, 0);
+    }
+    sent += buffer.sinkPackets(batch, count);
+    while(! buffer.is_empty())
+      buffer.process();
+  }
+  report(name, sink, packetCount, nanoseconds() - start);
+}
+
+// MAPPacketBuffer has no is_empty(); its backlog serves.
+class MAPPacketBufferAdapter : public MAP::MAPPacketBuffer {
+public:
+  MAPPacketBufferAdapter(MAP::MAPPacketSink* const packetSink, MAP::OffsetMAPPacket* const raw_packet_buffer)
+  : MAP::MAPPacketBuffer(packetSink, raw_packet_buffer, 255, BatchSize)
+  { }
+  bool is_empty() const{
+    return get_backlog() == 0;
+  }
+};
+
+int main(int argc, char **argv){
+  uint32_t packetCount = (argc > 1)? atoi(argv[1]) : 1000000;
+  MemoryPool memoryPool;
+
+  for(uint8_t p = 0; p < MaxProducers; p++){
+    for(uint32_t i = 0; i < PoolSize; i++){
+      MAP::allocateNewPacket(&pools[p][i], sizeof(Stamp), &memoryPool);
+      for(uint8_t j = 0; j < sizeof(Stamp); j++)
+        pools[p][i]->sinkExpand(0);
+      MAP::referencePacket(pools[p][i]);
+    }
+  }
+
+  {
+    TimingSink sink(packetCount);
+    static MAP::OffsetMAPPacket rawBuffer[255];
+    MAPPacketBufferAdapter buffer(&sink, rawBuffer);
+    runAlternating("one thread, MAPPacketBuffer", buffer, sink, packetCount);
+  }
+  {
+    TimingSink sink(packetCount);
+    MAP::SpscMAPPacketBuffer buffer(&sink, BufferCapacity);
+    runAlternating("one thread, SPSC", buffer, sink, packetCount);
+  }
+  {
+    TimingSink sink(packetCount);
+    MAP::MpscMAPPacketBuffer buffer(&sink, BufferCapacity);
+    runAlternating("one thread, MPSC", buffer, sink, packetCount);
+  }
+
+  runThreaded<MAP::SpscMAPPacketBuffer>("SPSC", 1, packetCount, 1, 0, false);
+  runThreaded<MAP::SpscMAPPacketBuffer>("SPSC, batches of 16", 1, packetCount, BatchSize, 0, false);
+  runThreaded<MAP::MpscMAPPacketBuffer>("MPSC, 1 producer", 1, packetCount, 1, 0, false);
+  runThreaded<MAP::MpscMAPPacketBuffer>("MPSC, 2 producers", 2, packetCount / 2, 1, 0, false);
+  runThreaded<MAP::MpscMAPPacketBuffer>("MPSC, 4 producers", 4, packetCount / 4, 1, 0, false);
+  runThreaded<MAP::MpscMAPPacketBuffer>("MPSC, 4 producers, batches", 4, packetCount / 4, BatchSize, 0, false);
+
+  runThreaded<MAP::SpscMAPPacketBuffer>("SPSC, paced, spinning", 1, PacedPackets, 1, PacedInterval, false);
+  runThreaded<MAP::SpscMAPPacketBuffer>("SPSC, paced, wakeups", 1, PacedPackets, 1, PacedInterval, true);
+  runThreaded<MAP::MpscMAPPacketBuffer>("MPSC, paced, wakeups", 2, PacedPackets / 2, 1, PacedInterval, true);
+
+  for(uint8_t p = 0; p < MaxProducers; p++){
+    for(uint32_t i = 0; i < PoolSize; i++)
+      MAP::dereferencePacket(pools[p][i]);
+  }
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,186 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// MAP packet handling (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// HeaderMap differential test (linux)
+//
+// Checks HeaderMap against the scalar MAPPacket accessors, over random nested header chains
+// (well-formed, then with stray bytes appended and a random bit flipped; some continued in a
+// chained segment): every header mapped, every field's presence and offset, and the data
+// offset must be exactly those the accessors give. Also checks fields at the very top of the
+// offset range, in a maximum-size packet.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -I<path containing Upacket/ and ATcommon/> test/MAPHeaderMapTest.cpp -o MAPHeaderMapTest
+//   ./MAPHeaderMapTest
+// Build with -mavx2 (or without -msse2, where it is not the default) to check the other
+// terminator mask paths.
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+
+static const uint32_t Rounds = 500000;
+
+// Deterministic xorshift PRNG, so failures reproduce.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint32_t failures = 0;
+
+// Check one header's mapped field against its accessor.
+static bool checkField(MAP::MAPPacket &packet, const MAP::HeaderFields &fields, const MAP::HeaderFields::FieldMask_t field_mask, const MAP::MAPPacket::Capacity_t field_offset, const MAP::Data_t* const field){
+  if(field == NULL)
+    return ! fields.is_present(field_mask);
+  return fields.is_present(field_mask) && field_offset == field - packet.front();
+}
+
+static void check(MAP::MAPPacket &packet, const uint32_t round){
+  MAP::HeaderMap headerMap(packet);
+
+  uint8_t depth = 0;
+  MAP::Data_t *header = packet.is_empty()? NULL : packet.get_first_header();
+  while(header != NULL){
+    if(depth >= headerMap.depth){
+      if(depth < MAP::HeaderMap::MaxDepth || headerMap.complete){
+        printf("round %u: %u headers mapped, more follow\n", round, headerMap.depth);
+        failures++;
+      }
+      return;
+    }
+
+    const MAP::HeaderFields &fields = headerMap.headers[depth];
+    if(fields.header != header - packet.front()
+       || ! checkField(packet, fields, MAP::HeaderFields::NextProto_Mask, fields.nextProto, packet.get_nextProto(header))
+       || ! checkField(packet, fields, MAP::HeaderFields::DestAddress_Mask, fields.destAddress, packet.get_destAddress(header))
+       || ! checkField(packet, fields, MAP::HeaderFields::SrcAddress_Mask, fields.srcAddress, packet.get_srcAddress(header))
+       || ! checkField(packet, fields, MAP::HeaderFields::Contents_Mask, fields.contents, packet.get_contents(header))){
+      printf("round %u: header %u (at %u) mapped wrongly\n", round, depth, (unsigned) (header - packet.front()));
+      failures++;
+      return;
+    }
+    depth++;
+
+  // A next-proto byte at back() ends the chain (get_next_header would read past the packet).
+    MAP::Data_t *nextProto = packet.get_nextProto(header);
+    if(nextProto != NULL && nextProto >= packet.back())
+      break;
+    header = packet.get_next_header(header);
+  }
+  if(depth != headerMap.depth){
+    printf("round %u: %u headers mapped, %u found\n", round, headerMap.depth, depth);
+    failures++;
+    return;
+  }
+
+  if(depth == 0 || ! headerMap.complete)
+    return;
+  MAP::MAPPacket::Capacity_t data_offset = 0;
+  MAP::Data_t *data = packet.get_contents(packet.front() + headerMap.headers[depth - 1].header);
+  if(headerMap.get_data(data_offset) != (data != NULL) || (data != NULL && data_offset != data - packet.front())){
+    printf("round %u: data offset mapped wrongly\n", round);
+    failures++;
+  }
+}
+
+static void sinkC78Field(MAP::MAPPacket &packet){
+  for(uint32_t i = randomWord() % 5; i > 0; i--)
+    packet.sinkExpand(0x80 | randomWord(), 1, 255);
+  packet.sinkExpand(randomWord() & 0x7F, 1, 255);
+}
+
+// Random header chain, from 0 to 9 headers deep (past MaxDepth), followed by stray bytes.
+static void buildChain(MAP::MAPPacket &packet){
+  for(uint32_t i = randomWord() % 10; i > 0; i--){
+  // Next-proto always present (and MAP), so that the chain continues.
+    uint8_t header = MAP::NextProtoPresent_Mask | (randomWord() & (MAP::DestAddressPresent_Mask | MAP::SrcAddressPresent_Mask | MAP::AddressType_Mask));
+    packet.sinkExpand(header, 1, 255);
+    packet.sinkExpand(MAP::Protocol__MAP, 1, 255);
+    if(MAP::get_destAddressPresent(header))
+      sinkC78Field(packet);
+    if(MAP::get_srcAddressPresent(header))
+      sinkC78Field(packet);
+  }
+
+// Stray bytes: header-like bytes, MAP protocol bytes, and C78 continuation and end bytes.
+  for(uint32_t i = randomWord() % 20; i > 0; i--){
+    uint32_t r = randomWord();
+    uint8_t data;
+    switch(r % 6){
+      case 0: data = ((r >> 8) & 0xF0) | MAP::NextProtoPresent_Mask; break;
+      case 1: data = MAP::Protocol__MAP; break;
+      case 2: data = (r >> 8) | 0x80; break;
+      default: data = (r >> 8) & 0x7F;
+    }
+    packet.sinkExpand(data, 1, 255);
+  }
+}
+
+// Fields at the top of the offset range: the contents of a header whose dest address fills
+// the rest of a maximum-size packet.
+static void checkLargePacket(MemoryPool &memoryPool){
+  static const MAP::MAPPacket::Capacity_t LargeSize = (MAP::MAPPacket::Capacity_t) ~0;
+  MAP::MAPPacket *packet;
+  if(! MAP::allocateNewPacket(&packet, LargeSize, &memoryPool)){
+    printf("large packet: allocation failed\n");
+    failures++;
+    return;
+  }
+  MAP::referencePacket(packet);
+
+  for(MAP::MAPPacket::Capacity_t contents = LargeSize - 2; contents <= LargeSize - 1; contents++){
+    packet->set_size(0);
+    packet->sinkExpand(MAP::DestAddressPresent_Mask | MAP::SrcAddressPresent_Mask, 0, LargeSize);
+    while(packet->get_size() < contents - 2)
+      packet->sinkExpand(0x80, 0, LargeSize);
+    packet->sinkExpand(0x01, 0, LargeSize);
+  // The src address, then the contents, at the top offsets.
+    packet->sinkExpand(0x02, 0, LargeSize);
+    while(packet->get_size() < LargeSize)
+      packet->sinkExpand(0x00, 0, LargeSize);
+    check(*packet, contents);
+  }
+
+  MAP::dereferencePacket(packet);
+}
+
+int main(){
+  MemoryPool memoryPool;
+  static const uint8_t segmentData[128] = { 0 };
+
+  for(uint32_t round = 0; round < Rounds; round++){
+    MAP::MAPPacket *packet;
+    if(! MAP::allocateNewPacket(&packet, 64, &memoryPool)){
+      printf("round %u: allocation failed\n", round);
+      return 1;
+    }
+    MAP::referencePacket(packet);
+
+    buildChain(*packet);
+  // Corrupt a bit now and then.
+    if(! packet->is_empty() && randomWord() % 3 == 0)
+      packet->front()[randomWord() % packet->get_size()] ^= 1 << (randomWord() % 8);
+  // Continue the packet in a chained segment now and then.
+    if(randomWord() % 4 == 0)
+      packet->sinkSegmented(segmentData, packet->get_availableCapacity() + 1 + randomWord() % 32);
+
+    check(*packet, round);
+    MAP::dereferencePacket(packet);
+  }
+
+  checkLargePacket(memoryPool);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok: %u rounds\n", Rounds);
+  return 0;
+}
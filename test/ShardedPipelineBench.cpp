@@ -0,0 +1,182 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// ShardedPipeline benchmark (linux)
+//
+// Routes the same packets (from many sources, through the dispatcher) with 1, 2, 4, 8 and 16
+// shards, and reports the throughput and each worker's utilization. Each shard's router passes
+// packets on to one of four egress links, through the links' handoff buffers, by source address.
+//
+// Also checks that a route command sent through the dispatcher reaches every shard's router, and
+// that every packet is routed exactly once.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/ShardedPipelineBench.cpp -o ShardedPipelineBench -lpthread
+//   ./ShardedPipelineBench [packets]
+// Exits 0 if every check passed. Scaling is only meaningful with at least as many cores as shards.
+
+#define MAP_THREADSAFE_REFERENCES
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/MAP/arch/linux/ConcurrentMAPPacketBuffer.cpp>
+#include <Upacket/Scheduling/arch/linux/ProcessExecutor.cpp>
+#include <Upacket/Routing/arch/linux/ShardedPipeline.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <sched.h>
+
+static const uint8_t MaxShards = 16;
+static const uint8_t LinkCount = 4;
+static const uint32_t SourceCount = 256;
+static const uint8_t BatchSize = 16;
+
+static const uint8_t CommandAddressType = 4;
+static const uint8_t CommandAddressValue = 0;
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+class CountingLink : public MAP::MAPPacketSink {
+public:
+  uint32_t received;
+
+  CountingLink() : received(0) { }
+
+// Run by the link's own shard only.
+  Status::Status_t sinkPacket(MAP::MAPPacket* const, MAP::MAPPacket::HeaderOffset_t){
+    __atomic_add_fetch(&received, 1, __ATOMIC_RELAXED);
+    return Status::Status__Good;
+  }
+};
+
+// Passes packets on to a link by source address; counts commands.
+class TestRouter : public MAP::MAPPacketSink {
+public:
+  MAP::MAPPacketSink **links;
+  uint32_t routed;
+  uint32_t commands;
+
+  TestRouter() : links(NULL), routed(0), commands(0) { }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t headerOffset){
+    MAP::Data_t *header = packet->get_header(headerOffset);
+    MAP::Data_t *destAddress = packet->get_destAddress(header);
+    if(destAddress != NULL && MAP::get_addressType(*header) == CommandAddressType && *destAddress == CommandAddressValue){
+      __atomic_add_fetch(&commands, 1, __ATOMIC_RELAXED);
+      return Status::Status__Good;
+    }
+    uint32_t src = 0;
+    MAP::Data_t *srcAddress = packet->get_srcAddress(header);
+    packet->sourceC78(src, srcAddress);
+    Status::Status_t status = links[src % LinkCount]->sinkPacket(packet, headerOffset);
+    if(status != Status::Status__Busy)
+      routed++;
+    return status;
+  }
+};
+
+static uint32_t failures = 0;
+
+static void runShards(const ShardIndex_t shardCount, MAP::MAPPacket** const packets, const uint32_t packetCount, MAP::MAPPacket* const command){
+  ShardedPipeline pipeline(shardCount, 1 + LinkCount, 4096, LinkCount);
+  CountingLink links[LinkCount];
+  MAP::MAPPacketSink *handoffs[LinkCount];
+  TestRouter routers[MaxShards];
+
+  for(uint8_t i = 0; i < LinkCount; i++)
+    handoffs[i] = pipeline.addEgressLink(ShardDispatcher::selectLinkShard(i, shardCount), &links[i], 1024);
+  for(ShardIndex_t i = 0; i < shardCount; i++){
+    routers[i].links = handoffs;
+    pipeline.set_router(i, &routers[i]);
+  }
+  pipeline.get_dispatcher()->set_commandAddress(CommandAddressType, CommandAddressValue);
+  if(! pipeline.start()){
+    printf("%u shards: start failed\n", shardCount);
+    failures++;
+    return;
+  }
+
+  double startTime = now();
+  MAP::OffsetMAPPacket batch[BatchSize];
+  for(uint32_t sent = 0; sent < packetCount; ){
+    uint16_t count = (packetCount - sent < BatchSize)? packetCount - sent : BatchSize;
+    for(uint16_t i = 0; i < count; i++)
+      batch[i] = MAP::OffsetMAPPacket(packets[sent + i], 0);
+    uint16_t sunk = pipeline.get_dispatcher()->sinkPackets(batch, count);
+    sent += sunk;
+    if(sunk < count)
+      sched_yield();
+  }
+  while(pipeline.get_dispatcher()->sinkPacket(command, 0) == Status::Status__Busy)
+    sched_yield();
+
+  uint32_t received = 0;
+  while(received < packetCount){
+    sched_yield();
+    received = 0;
+    for(uint8_t i = 0; i < LinkCount; i++)
+      received += __atomic_load_n(&links[i].received, __ATOMIC_RELAXED);
+  }
+  double seconds = now() - startTime;
+// Let the command reach the last shards.
+  for(ShardIndex_t i = 0; i < shardCount; i++){
+    while(__atomic_load_n(&routers[i].commands, __ATOMIC_RELAXED) == 0)
+      sched_yield();
+  }
+  pipeline.stop();
+
+  printf("%2u shards: %6.2f Mpkt/s; util", shardCount, packetCount / seconds / 1e6);
+  uint32_t routed = 0;
+  for(ShardIndex_t i = 0; i < shardCount; i++){
+    printf(" %u%%", pipeline.get_executor()->get_workerStats(i).get_utilization());
+    routed += routers[i].routed;
+    if(routers[i].commands != 1){
+      printf("\n%u shards: shard %u saw %u commands\n", shardCount, i, routers[i].commands);
+      failures++;
+    }
+  }
+  printf("\n");
+  if(routed != packetCount || received != packetCount){
+    printf("%u shards: routed %u, received %u, of %u\n", shardCount, routed, received, packetCount);
+    failures++;
+  }
+}
+
+int main(int argc, char **argv){
+  uint32_t packetCount = (argc > 1)? atoi(argv[1]) : 200000;
+  MemoryPool memoryPool;
+
+  MAP::MAPPacket **packets = (MAP::MAPPacket**) malloc(packetCount * sizeof(MAP::MAPPacket*));
+  for(uint32_t i = 0; i < packetCount; i++){
+    MAP::allocateNewPacket(&packets[i], 8, &memoryPool);
+    packets[i]->sinkExpand(MAP::SrcAddressPresent_Mask | 4);
+    packets[i]->sinkC78(i % SourceCount);
+    packets[i]->sinkExpand(1);
+    MAP::referencePacket(packets[i]);
+  }
+  MAP::MAPPacket *command;
+  MAP::allocateNewPacket(&command, 8, &memoryPool);
+  command->sinkExpand(MAP::DestAddressPresent_Mask | CommandAddressType);
+  command->sinkC78(CommandAddressValue);
+  command->sinkExpand(1);
+  MAP::referencePacket(command);
+
+  for(ShardIndex_t shardCount = 1; shardCount <= MaxShards; shardCount *= 2)
+    runShards(shardCount, packets, packetCount, command);
+
+  MAP::dereferencePacket(command);
+  for(uint32_t i = 0; i < packetCount; i++)
+    MAP::dereferencePacket(packets[i]);
+  free(packets);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
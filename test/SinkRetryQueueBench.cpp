@@ -0,0 +1,227 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// SinkRetryQueue goodput benchmark (linux)
+//
+// Offers bursty traffic (bursts of BurstLength packets, spread over BurstTicks ticks, every
+// BurstPeriod ticks) through a BroadcastRouter and an AddressGraph to a slow sink, which holds
+// at most SinkDepth packets and sends one per tick, as an encoder would. Each router is run
+// without retry queues, then with queues of several depths and both drop policies, and the
+// goodput (packets the sink accepted, of those offered), the drop counts and the mean delay
+// (in ticks) are reported. Also reports the cost per packet of a queue while its sink is
+// never busy.
+//
+// Also checks that every offered packet is either delivered or counted as dropped, and that
+// the sink receives its packets in order.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/SinkRetryQueueBench.cpp -o SinkRetryQueueBench
+//   ./SinkRetryQueueBench
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/Routing/arch/linux/AddressGraph.cpp>
+#include <Upacket/Routing/BroadcastRouter.hpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <time.h>
+
+static const uint8_t SinkDepth = 4;
+static const uint32_t BurstLength = 32;
+static const uint32_t BurstTicks = 4;
+// One packet per tick is sent on; this offers 80% of that.
+static const uint32_t BurstPeriod = 40;
+static const uint32_t Bursts = 20000;
+
+static const uint8_t LocalAddressType = 15;
+static const uint8_t LocalAddressValue = 0x7F;
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t failures = 0;
+
+// Holds up to SinkDepth packets, and sends one on per tick; Busy when full.
+// (Packets are only counted, not kept: the router dereferences them once they are accepted.)
+class SlowSink : public MAP::MAPPacketSink {
+public:
+  uint8_t held;
+  bool never_busy;
+  uint32_t delivered;
+  uint32_t nextSequence;
+  bool inOrder;
+  uint64_t totalDelay;
+  uint32_t tick;
+
+  SlowSink() : held(0), never_busy(false), delivered(0), nextSequence(0), inOrder(true), totalDelay(0), tick(0) { }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const packet, MAP::MAPPacket::HeaderOffset_t){
+    if(! never_busy){
+      if(held >= SinkDepth)
+        return Status::Status__Busy;
+      held++;
+    }
+    delivered++;
+
+  // Payload: header, dest address, then sequence number and offer tick.
+    MAP::Data_t *data_ptr = packet->front() + 2;
+    uint32_t sequence = 0, offerTick = 0;
+    packet->sourceC78(sequence, data_ptr);
+    data_ptr++;
+    packet->sourceC78(offerTick, data_ptr);
+  // Drops may skip sequence numbers, but never reorder them.
+    if(sequence < nextSequence)
+      inOrder = false;
+    nextSequence = sequence + 1;
+    totalDelay += tick - offerTick;
+    return Status::Status__Good;
+  }
+
+  void advance(){
+    if(held > 0)
+      held--;
+    tick++;
+  }
+};
+
+static MAP::MAPPacket* newPacket(const uint32_t sequence, const uint32_t tick, MemoryPool &memoryPool){
+  MAP::MAPPacket *packet;
+  if(! MAP::allocateNewPacket(&packet, 16, &memoryPool))
+    return NULL;
+  packet->sinkExpand(MAP::DestAddressPresent_Mask | 1);
+  packet->sinkC78(0);
+  packet->sinkC78(sequence);
+  packet->sinkC78(tick);
+  return packet;
+}
+
+// Offer the bursts, then let the queue drain.
+template <typename Router_t>
+static void runBursts(Router_t &router, SlowSink &sink, SinkRetryQueue* const retryQueue, MemoryPool &memoryPool,
+                      const char* const routerName, const char* const queueName){
+  uint32_t offered = 0;
+  for(uint32_t burst = 0; burst < Bursts; burst++){
+    for(uint32_t t = 0; t < BurstPeriod; t++){
+      for(uint32_t i = 0; t < BurstTicks && i < BurstLength / BurstTicks; i++){
+        MAP::MAPPacket *packet = newPacket(offered++, sink.tick, memoryPool);
+        if(packet == NULL){
+          printf("allocation failed\n");
+          failures++;
+          return;
+        }
+        MAP::referencePacket(packet);
+        router.sinkPacket(packet, 0);
+        MAP::dereferencePacket(packet);
+      }
+      router.process();
+      sink.advance();
+    }
+  }
+  for(uint32_t t = 0; t < 256; t++){
+    router.process();
+    sink.advance();
+  }
+
+  uint32_t dropped = (retryQueue == NULL)? offered - sink.delivered : retryQueue->get_dropCount();
+  if(sink.delivered + dropped != offered || (retryQueue != NULL && ! retryQueue->is_empty()) || ! sink.inOrder){
+    printf("%s, %s: %u offered, %u delivered, %u dropped (or out of order)\n", routerName, queueName, offered, sink.delivered, dropped);
+    failures++;
+  }
+  printf("%-15s %-19s: goodput %5.1f%%, %6u dropped, mean delay %5.1f ticks\n", routerName, queueName,
+    100.0 * sink.delivered / offered, dropped, (double) sink.totalDelay / sink.delivered);
+}
+
+// Time sinkPacket with the sink never busy.
+template <typename Router_t>
+static double timeUnbusy(Router_t &router, SlowSink &sink, MAP::MAPPacket* const packet){
+  static const uint32_t Packets = 4000000;
+  sink.never_busy = true;
+  uint64_t start = nanoseconds();
+  for(uint32_t i = 0; i < Packets; i++)
+    router.sinkPacket(packet, 0);
+  sink.never_busy = false;
+  return (double) (nanoseconds() - start) / Packets;
+}
+
+struct QueueConfig {
+  SinkRetryQueue::Capacity_t depth;
+  SinkRetryQueue::DropPolicy_t dropPolicy;
+  const char *name;
+};
+static const QueueConfig QueueConfigs[] = {
+  { 0, 0, "no queue" },
+  { 8, SinkRetryQueue::DropPolicy__Newest, "queue 8, newest" },
+  { 8, SinkRetryQueue::DropPolicy__Oldest, "queue 8, oldest" },
+  { 32, SinkRetryQueue::DropPolicy__Newest, "queue 32, newest" },
+  { 32, SinkRetryQueue::DropPolicy__Oldest, "queue 32, oldest" },
+};
+
+int main(){
+  MemoryPool memoryPool;
+  static MAP::OffsetMAPPacket retryBuffer[32];
+
+  for(uint8_t c = 0; c < sizeof(QueueConfigs) / sizeof(QueueConfigs[0]); c++){
+    SlowSink sink;
+    MAP::MAPPacketSink *sinkPointers[1] = { &sink };
+    BroadcastRouter router(sinkPointers, 1);
+    router.addSink(&sink);
+    SinkRetryQueue retryQueue(retryBuffer, (QueueConfigs[c].depth > 0)? QueueConfigs[c].depth : 1, QueueConfigs[c].dropPolicy);
+    if(QueueConfigs[c].depth > 0)
+      router.set_retryQueues(&retryQueue, 1);
+    runBursts(router, sink, (QueueConfigs[c].depth > 0)? &retryQueue : NULL, memoryPool, "BroadcastRouter", QueueConfigs[c].name);
+  }
+
+  for(uint8_t c = 0; c < sizeof(QueueConfigs) / sizeof(QueueConfigs[0]); c++){
+    SlowSink sink;
+    MAP::MAPPacketSink *sinkPointers[1] = { &sink };
+    DataStore::ArrayBuffer<MAP::MAPPacketSink*, uint8_t> packetSinks(sinkPointers, 1);
+    packetSinks.set_size(1);
+    AddressGraph graph(LocalAddressType, LocalAddressValue, &packetSinks, &memoryPool, 4);
+    graph.sinkEdge(AddressFilter(AddressFilter::Mode__MatchAll, 0));
+    SinkRetryQueue retryQueue(retryBuffer, (QueueConfigs[c].depth > 0)? QueueConfigs[c].depth : 1, QueueConfigs[c].dropPolicy);
+    if(QueueConfigs[c].depth > 0)
+      graph.set_retryQueues(&retryQueue, 1);
+    runBursts(graph, sink, (QueueConfigs[c].depth > 0)? &retryQueue : NULL, memoryPool, "AddressGraph", QueueConfigs[c].name);
+  }
+
+// Overhead while the sink keeps up.
+  MAP::MAPPacket *packet = newPacket(0, 0, memoryPool);
+  MAP::referencePacket(packet);
+  {
+    SlowSink sink;
+    MAP::MAPPacketSink *sinkPointers[1] = { &sink };
+    BroadcastRouter router(sinkPointers, 1);
+    router.addSink(&sink);
+    double bare = timeUnbusy(router, sink, packet);
+    SinkRetryQueue retryQueue(retryBuffer, 8);
+    router.set_retryQueues(&retryQueue, 1);
+    double queued = timeUnbusy(router, sink, packet);
+    printf("BroadcastRouter, sink never busy: %5.1f ns/packet, with a queue %5.1f ns/packet\n", bare, queued);
+  }
+  {
+    SlowSink sink;
+    MAP::MAPPacketSink *sinkPointers[1] = { &sink };
+    DataStore::ArrayBuffer<MAP::MAPPacketSink*, uint8_t> packetSinks(sinkPointers, 1);
+    packetSinks.set_size(1);
+    AddressGraph graph(LocalAddressType, LocalAddressValue, &packetSinks, &memoryPool, 4);
+    graph.sinkEdge(AddressFilter(AddressFilter::Mode__MatchAll, 0));
+    double bare = timeUnbusy(graph, sink, packet);
+    SinkRetryQueue retryQueue(retryBuffer, 8);
+    graph.set_retryQueues(&retryQueue, 1);
+    double queued = timeUnbusy(graph, sink, packet);
+    printf("AddressGraph,    sink never busy: %5.1f ns/packet, with a queue %5.1f ns/packet\n", bare, queued);
+  }
+  MAP::dereferencePacket(packet);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
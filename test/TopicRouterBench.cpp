@@ -0,0 +1,136 @@
+// Copyright (C) 2010, Aret N Carlsen (aretcarlsen@autonomoustools.com).
+// Dynamic routing handlers (C++).
+// Licensed under GPLv3 and later versions. See license.txt or <http://www.gnu.org/licenses/>.
+
+
+// TopicRouter publish latency benchmark (linux)
+//
+// Subscribes counting sinks to many topics, at fan-outs from 1 to 512 subscribers per topic,
+// then times each publish (sinkPacket of a Topic packet, lookup and fan-out) to random topics,
+// and reports the median and 99th percentile latency, and the cost per delivery.
+//
+// Also checks that every publish reached exactly its topic's subscribers.
+//
+// Build and run (with Upacket and ATcommon on the include path):
+//   g++ -O2 -I<path containing Upacket/ and ATcommon/> test/TopicRouterBench.cpp -o TopicRouterBench
+//   ./TopicRouterBench
+// Exits 0 if every check passed.
+
+#include <Upacket/MAP/arch/linux/MAP.cpp>
+#include <Upacket/Routing/arch/linux/TopicRouter.cpp>
+#include <Upacket/PosixCRC32ChecksumEngine/arch/linux/PosixCRC32Checksum.cpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const uint32_t SinkCount = 1024;
+static const uint32_t SubscriptionsPerRun = 65536;
+static const uint32_t Publishes = 20000;
+
+// Deterministic xorshift PRNG, so runs are comparable.
+static uint32_t randomState = 2463534242UL;
+static uint32_t randomWord(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+static uint64_t nanoseconds(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class CountingSink : public MAP::MAPPacketSink {
+public:
+  uint32_t received;
+
+  CountingSink() : received(0) { }
+
+  Status::Status_t sinkPacket(MAP::MAPPacket* const, MAP::MAPPacket::HeaderOffset_t){
+    received++;
+    return Status::Status__Good;
+  }
+};
+
+static int compareLatency(const void *a, const void *b){
+  uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+  return (x < y)? -1 : (x > y);
+}
+
+static uint32_t failures = 0;
+
+static void runFanout(const uint32_t fanout, TopicRouter::PacketSinks_t &packetSinks, CountingSink* const sinks, MemoryPool &memoryPool){
+  TopicRouter router(MAP::AddressType__Topic - 1, 0, &packetSinks, &memoryPool);
+  uint32_t topicCount = SubscriptionsPerRun / fanout;
+  for(uint32_t topic = 0; topic < topicCount; topic++){
+    for(uint32_t i = 0; i < fanout; i++){
+      if(! router.subscribe(topic, (topic + i) % SinkCount)){
+        printf("fan-out %u: subscribe failed\n", fanout);
+        failures++;
+        return;
+      }
+    }
+  }
+
+// One packet per topic, built up front.
+  MAP::MAPPacket **packets = (MAP::MAPPacket**) malloc(topicCount * sizeof(MAP::MAPPacket*));
+  for(uint32_t topic = 0; topic < topicCount; topic++){
+    MAP::allocateNewPacket(&packets[topic], 8, &memoryPool);
+    packets[topic]->sinkExpand(MAP::DestAddressPresent_Mask | MAP::AddressType__Topic);
+    packets[topic]->sinkC78(topic);
+    packets[topic]->sinkExpand(1);
+    MAP::referencePacket(packets[topic]);
+  }
+
+  for(uint32_t i = 0; i < SinkCount; i++)
+    sinks[i].received = 0;
+
+  static uint64_t latencies[Publishes];
+  uint64_t total = 0;
+  for(uint32_t i = 0; i < Publishes; i++){
+    uint32_t topic = randomWord() % topicCount;
+    uint64_t start = nanoseconds();
+    router.sinkPacket(packets[topic], 0);
+    latencies[i] = nanoseconds() - start;
+    total += latencies[i];
+  }
+
+  uint64_t delivered = 0;
+  for(uint32_t i = 0; i < SinkCount; i++)
+    delivered += sinks[i].received;
+  if(delivered != (uint64_t) Publishes * fanout){
+    printf("fan-out %u: %llu deliveries, expected %llu\n", fanout, (unsigned long long) delivered, (unsigned long long) Publishes * fanout);
+    failures++;
+  }
+
+  qsort(latencies, Publishes, sizeof(uint64_t), compareLatency);
+  printf("fan-out %4u (%5u topics): p50 %7llu ns, p99 %7llu ns, %5.1f ns/delivery\n", fanout, topicCount,
+    (unsigned long long) latencies[Publishes / 2], (unsigned long long) latencies[Publishes * 99 / 100],
+    (double) total / Publishes / fanout);
+
+  for(uint32_t topic = 0; topic < topicCount; topic++)
+    MAP::dereferencePacket(packets[topic]);
+  free(packets);
+}
+
+int main(){
+  MemoryPool memoryPool;
+  static CountingSink sinks[SinkCount];
+  static MAP::MAPPacketSink *sinkPointers[SinkCount];
+  for(uint32_t i = 0; i < SinkCount; i++)
+    sinkPointers[i] = &sinks[i];
+  TopicRouter::PacketSinks_t packetSinks(sinkPointers, SinkCount);
+  packetSinks.set_size(SinkCount);
+
+  for(uint32_t fanout = 1; fanout <= SinkCount; fanout *= 8)
+    runFanout(fanout, packetSinks, sinks, memoryPool);
+
+  if(failures > 0){
+    printf("%u failures\n", failures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}